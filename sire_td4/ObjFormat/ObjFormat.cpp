@@ -473,7 +473,7 @@ ObjMesh* ObjMesh::LoadFromStream(IStream& in, const ObjString& texturePath)
             if (words.size()!=4)
             {
                 std::cerr << "ObjLoader: Error parsing line : " << buffer << "\n";
-                return false;
+                return 0;
             }
             // std::cerr << "add vertex\n";
             pMesh->positions.push_back(args.toVector3());
@@ -483,7 +483,7 @@ ObjMesh* ObjMesh::LoadFromStream(IStream& in, const ObjString& texturePath)
             if (words.size()<3)
             {
                 std::cerr << "ObjLoader: Error parsing line : " << buffer << "\n";
-                return false;
+                return 0;
             }
             pMesh->texcoords.push_back(args.toVector2());
         }
@@ -492,7 +492,7 @@ ObjMesh* ObjMesh::LoadFromStream(IStream& in, const ObjString& texturePath)
             if (words.size()!=4)
             {
                 std::cerr << "ObjLoader: Error parsing line : " << buffer << "\n";
-                return false;
+                return 0;
             }
             pMesh->normals.push_back(args.toVector3());
 //             std::cout << args.toVector3() << " ";
@@ -502,7 +502,7 @@ ObjMesh* ObjMesh::LoadFromStream(IStream& in, const ObjString& texturePath)
             if (words.size()<4)
             {
                 std::cerr << "ObjLoader: Error parsing line : " << buffer << "\n";
-                return false;
+                return 0;
             }
 
             int nofVertices = words.size()-1;
@@ -641,11 +641,9 @@ ObjMesh* ObjMesh::createIndexedFaceSet(Obj::Options options) const
         pClone->mMaterialsByName[pMat->getName()] = i;
     }
 
-    // store for each vertex position the indices of the new vertices.
+    // assign an index to each distinct (position, texcoord, normal) triplet.
     // a vertex having multiple different normals or texcoords will appear multiple times.
-    // the key value is a mix of the normal and texcoord indices.
-    std::vector< std::map<long long int,unsigned int> > vertices;
-    vertices.resize(positions.size());
+    ObjVertexTable vertices(positions.size());
 
     for (unsigned int smi=0 ; smi<mSubMeshes.size() ; ++smi)
     {
@@ -709,28 +707,19 @@ ObjMesh* ObjMesh::createIndexedFaceSet(Obj::Options options) const
                 ObjFaceHandle dface = pDstSubMesh->createFace(dstNofVertices,Obj::None,matId);
                 for (unsigned int k=0 ; k<3 ; ++k)
                 {
-                    // construction of the unique key value of the vertex:
-                    long long int key = 0;
-                    if (options&Obj::Texcoord)
-                        key = (long long int)(sface.vTexcoordId(ids[k])+1);
-                    if (options&Obj::Normal)
-                        key = key | ((long long int)(sface.vNormalId(ids[k])+1) << 32 );
+                    // construction of the unique key of the vertex:
+                    int texcoordId = (options&Obj::Texcoord) ? sface.vTexcoordId(ids[k]) : -1;
+                    int normalId = (options&Obj::Normal) ? sface.vNormalId(ids[k]) : -1;
 
                     assert(sface.vPositionId(k)<int(positions.size()));
                     assert(sface.vTexcoordId(k)<int(texcoords.size()));
                     assert(sface.vNormalId(k)<int(normals.size()));
 
-                    std::map<long long int,unsigned int>::const_iterator vit = vertices[sface.vPositionId(ids[k])].find(key);
-                    if (vit!=vertices[sface.vPositionId(ids[k])].end())
-                    {
-                        // the unique vertex already exist, let's reuse it
-                        dface.vertexId(k) = vit->second;
-                    }
-                    else
+                    unsigned int id = vertices.insert(sface.vPositionId(ids[k]), texcoordId, normalId);
+                    dface.vertexId(k) = id;
+                    if (id==pClone->positions.size())
                     {
                         // a new vertex has to be created
-                        vertices[sface.vPositionId(ids[k])][key] = pClone->positions.size();
-                        dface.vertexId(k) = pClone->positions.size();
                         pClone->positions.push_back(this->positions[sface.vPositionId(ids[k])]);
 
                         if ( (options&Obj::Texcoord) && (!this->texcoords.empty()) )
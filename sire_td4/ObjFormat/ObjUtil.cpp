@@ -20,6 +20,30 @@
 #include <cstdlib>
 //#include <QFile>
 
+ObjVertexTable::ObjVertexTable(size_t expectedSize)
+{
+    size_t capacity = 16;
+    while (capacity < 2*expectedSize)
+        capacity *= 2;
+    mSlots.resize(capacity, (unsigned int)(EmptySlot));
+    mKeys.reserve(expectedSize);
+}
+
+void ObjVertexTable::grow()
+{
+    // the keys are stored apart from the slots, only the slots have to be rebuilt
+    std::vector<unsigned int> slots(2*mSlots.size(), (unsigned int)(EmptySlot));
+    size_t mask = slots.size()-1;
+    for (unsigned int id=0 ; id<mKeys.size() ; ++id)
+    {
+        size_t i = hash(mKeys[id])&mask;
+        while (slots[i]!=(unsigned int)(EmptySlot))
+            i = (i+1)&mask;
+        slots[i] = id;
+    }
+    mSlots.swap(slots);
+}
+
 std::vector<ObjString> ObjString::split( const ObjString& delims /*= "\t\n "*/) const
 {
     std::vector<ObjString> ret;
@@ -141,6 +141,79 @@ public:
     //@}
 };
 
+/** Flat open addressing hash table assigning a unique id to each distinct
+    (position, texcoord, normal) index triplet, in order of insertion.
+    Missing attributes are represented by a negative index.
+*/
+class ObjVertexTable
+{
+public:
+
+    struct Key
+    {
+        int position, texcoord, normal;
+        bool operator == (const Key& other) const
+        {
+            return position==other.position && texcoord==other.texcoord && normal==other.normal;
+        }
+    };
+
+    /** \a expectedSize is the expected number of distinct vertices
+    */
+    explicit ObjVertexTable(size_t expectedSize = 0);
+
+    /** \returns the id of the vertex (\a position, \a texcoord, \a normal), creating it if needed.
+    */
+    unsigned int insert(int position, int texcoord, int normal)
+    {
+        Key key;
+        key.position = position;
+        key.texcoord = texcoord;
+        key.normal = normal;
+        size_t mask = mSlots.size()-1;
+        for (size_t i = hash(key)&mask ; ; i = (i+1)&mask)
+        {
+            unsigned int id = mSlots[i];
+            if (id==EmptySlot)
+            {
+                id = (unsigned int)(mKeys.size());
+                mSlots[i] = id;
+                mKeys.push_back(key);
+                if (2*mKeys.size() > mSlots.size())
+                    grow();
+                return id;
+            }
+            if (mKeys[id]==key)
+                return id;
+        }
+    }
+
+    /** Number of distinct vertices
+    */
+    size_t size() const { return mKeys.size(); }
+
+    /** Indices of the vertex \a id
+    */
+    const Key& key(unsigned int id) const { return mKeys[id]; }
+
+protected:
+
+    enum { EmptySlot = 0xffffffff };
+
+    static size_t hash(const Key& key)
+    {
+        unsigned int h = (unsigned int)(key.position)*0x9E3779B1u;
+        h ^= (unsigned int)(key.texcoord)*0x85EBCA77u + (h<<6) + (h>>2);
+        h ^= (unsigned int)(key.normal)*0xC2B2AE3Du + (h<<6) + (h>>2);
+        return h ^ (h>>15);
+    }
+
+    void grow();
+
+    std::vector<unsigned int> mSlots;
+    std::vector<Key> mKeys;
+};
+
 /** Performs a case-insensitive search of completefilename and modify it if a match exists.
     \note Only the name of the file is tested in a case insitive fashion. The path is not changed.
 */
@@ -0,0 +1,103 @@
+#include "BenchScenes.h"
+
+#include <Eigen/Geometry>
+#include <map>
+#include <algorithm>
+
+using namespace Eigen;
+
+void BenchScenes::icosphere(int level, std::vector<Vector3f>& positions, std::vector<Vector3i>& faces)
+{
+    const float X = .525731112119133606f, Z = .850650808352039932f;
+    static const float vdata[12][3] = {
+        {-X, 0.0, Z},{X, 0.0, Z}, {-X, 0.0, -Z}, {X, 0.0, -Z},
+        {0.0, Z, X}, {0.0, Z, -X}, {0.0, -Z, X}, {0.0, -Z, -X},
+        {Z, X, 0.0}, {-Z, X, 0.0}, {Z, -X, 0.0}, {-Z, -X, 0.0}
+    };
+    static const int tindices[20][3] = {
+        {0,4,1}, {0,9,4}, {9,5,4}, {4,5,8}, {4,8,1},
+        {8,10,1}, {8,3,10}, {5,3,8}, {5,2,3}, {2,7,3},
+        {7,10,3}, {7,6,10}, {7,11,6}, {11,0,6}, {0,1,6},
+        {6,1,10}, {9,0,11}, {9,11,2}, {9,2,5}, {7,2,11} };
+
+    positions.clear();
+    faces.clear();
+    for(int i=0; i<12; ++i)
+        positions.push_back(Vector3f(vdata[i][0], vdata[i][1], vdata[i][2]));
+    for(int i=0; i<20; ++i)
+        faces.push_back(Vector3i(tindices[i][0], tindices[i][1], tindices[i][2]));
+
+    for(int l=0; l<level; ++l)
+    {
+        std::map<std::pair<int,int>, int> midpoints;
+        std::vector<Vector3i> subdivided;
+        subdivided.reserve(4*faces.size());
+        for(size_t f=0; f<faces.size(); ++f)
+        {
+            int m[3];
+            for(int k=0; k<3; ++k)
+            {
+                int a = faces[f](k), b = faces[f]((k+1)%3);
+                std::pair<int,int> edge(std::min(a,b), std::max(a,b));
+                std::map<std::pair<int,int>, int>::iterator it = midpoints.find(edge);
+                if(it==midpoints.end())
+                {
+                    positions.push_back((positions[a]+positions[b]).normalized());
+                    it = midpoints.insert(std::make_pair(edge, int(positions.size())-1)).first;
+                }
+                m[k] = it->second;
+            }
+            subdivided.push_back(Vector3i(faces[f](0), m[0], m[2]));
+            subdivided.push_back(Vector3i(faces[f](1), m[1], m[0]));
+            subdivided.push_back(Vector3i(faces[f](2), m[2], m[1]));
+            subdivided.push_back(Vector3i(m[0], m[1], m[2]));
+        }
+        faces.swap(subdivided);
+    }
+}
+
+std::vector<Mesh*> BenchScenes::addIcosphereField(Scene& scene, int n, int level, bool merged, const Material* material)
+{
+    std::vector<Mesh*> meshes;
+    std::vector<Vector3f> sphere;
+    std::vector<Vector3i> sphereFaces;
+    icosphere(level, sphere, sphereFaces);
+
+    std::vector<float> positions;
+    std::vector<int> indices;
+    for(int y=0; y<n; ++y)
+        for(int x=0; x<n; ++x)
+        {
+            Vector3f center(2.5f*(x - 0.5f*(n-1)), 2.5f*(y - 0.5f*(n-1)), 0.f);
+            if(!merged || (x==0 && y==0))
+            {
+                positions.clear();
+                indices.clear();
+            }
+            int base = positions.size()/3;
+            for(size_t i=0; i<sphere.size(); ++i)
+                for(int k=0; k<3; ++k)
+                    positions.push_back(sphere[i](k) + (merged ? center(k) : 0.f));
+            for(size_t f=0; f<sphereFaces.size(); ++f)
+                for(int k=0; k<3; ++k)
+                    indices.push_back(base + sphereFaces[f](k));
+            if(!merged || (x==n-1 && y==n-1))
+            {
+                Mesh* mesh = new Mesh;
+                mesh->loadRawData(&positions[0], positions.size()/3, &indices[0], indices.size()/3);
+                meshes.push_back(mesh);
+                Object* pObj = new Object;
+                pObj->attachShape(mesh);
+                pObj->setTransformation((merged ? Affine3f::Identity() : Affine3f(Translation3f(center))).matrix());
+                if(material)
+                    pObj->setMaterial(material);
+                scene.addObject(pObj);
+            }
+        }
+
+    float extent = 1.25f*n;
+    scene.camera().setViewport(512, 512);
+    scene.camera().setFovY(M_PI/3.);
+    scene.camera().lookAt(Vector3f(0.f, -1.2f*extent, 0.9f*extent), Vector3f::Zero(), Vector3f::UnitZ());
+    return meshes;
+}
@@ -0,0 +1,22 @@
+#ifndef SIRE_BENCHSCENES_H
+#define SIRE_BENCHSCENES_H
+
+#include "Scene.h"
+#include "Mesh.h"
+
+#include <Eigen/Core>
+#include <vector>
+
+/** Procedural scenes shared by the benchmark and the regression harness. */
+namespace BenchScenes
+{
+    /// fills \a positions and \a faces with a unit icosphere obtained by \a level subdivisions of the icosahedron
+    void icosphere(int level, std::vector<Eigen::Vector3f>& positions, std::vector<Eigen::Vector3i>& faces);
+
+    /** Adds to \a scene a field of \a n x \a n icospheres of \a level subdivisions in the z=0 plane, as separate
+      * objects or \a merged in a single mesh, of the given \a material (the default one if null), and sets up the
+      * camera to look at the field. \returns the created meshes, whose BVH is not built. */
+    std::vector<Mesh*> addIcosphereField(Scene& scene, int n, int level, bool merged, const Material* material = 0);
+}
+
+#endif // SIRE_BENCHSCENES_H
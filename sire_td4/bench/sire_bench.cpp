@@ -0,0 +1,306 @@
+// Benchmark of the raytracer: loading, BVH construction and ray throughput on standard scenes.
+//
+// usage: sire_bench [--json file] [--width n] [--trials n] [--no-default] [mesh.off ...]
+//
+// The scenes are two fields of subdivided icospheres (as separate objects, and merged in a single mesh),
+// a single densely subdivided icosphere, the meshes given on the command line, and the default scene of the
+// viewer, whose cube map is read from SIRE_DIR/data (the background color is used if it is missing). For each scene, the load time,
+// the BVH build time, and the wall-clock number of primary, shadow and incoherent rays traced per second
+// (median over the trials) are printed, and also written in JSON if --json is given, with the memory of the BVHs.
+// The memory statistics of all the scenes are printed after loading and at the end.
+// The meshes are parsed without their binary cache such that the load and build times do not depend on previous runs.
+// Rendering statistics should be compiled out (-DSIRE_RENDER_STATISTICS=0) when measuring the throughput.
+
+#include "Scene.h"
+#include "Mesh.h"
+#include "Raytracing.h"
+#include "BenchScenes.h"
+#include "MemoryStatistics.h"
+
+#include <Eigen/Geometry>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace Eigen;
+
+/// \returns a monotonic wall-clock time in seconds
+static double currentTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/// a scene to benchmark, with the meshes whose BVH has to be built
+struct BenchScene
+{
+    std::string name;
+    Scene scene;
+    std::vector<Mesh*> meshes;
+    double loadTime;
+    double buildTime;
+    size_t bvhMemory;           // bytes of the BVHs of the scene
+    long long nbTriangles;
+    double raysPerSecond[3];    // primary, shadow, incoherent
+};
+
+static const char* rayKindNames[3] = { "primary", "shadow", "incoherent" };
+
+static Object* addMeshObject(Scene& scene, Mesh* mesh, const Affine3f& transformation)
+{
+    Object* pObj = new Object;
+    pObj->attachShape(mesh);
+    pObj->setTransformation(transformation.matrix());
+    scene.addObject(pObj);
+    return pObj;
+}
+
+/// a field of \a n x \a n icospheres of \a level subdivisions, as separate objects or merged in a single mesh
+static void createIcosphereField(BenchScene& bench, int n, int level, bool merged)
+{
+    double t = currentTime();
+    bench.meshes = BenchScenes::addIcosphereField(bench.scene, n, level, merged);
+    bench.loadTime = currentTime() - t;
+}
+
+/// scales \a mesh to the unit box and adds it to \a bench, seen from the front
+static void addUnitaryMesh(BenchScene& bench, Mesh* mesh)
+{
+    mesh->makeUnitary();
+    bench.meshes.push_back(mesh);
+    addMeshObject(bench.scene, mesh, Affine3f::Identity());
+    bench.scene.camera().setViewport(512, 512);
+    bench.scene.camera().setFovY(M_PI/3.);
+    bench.scene.camera().lookAt(Vector3f(0.f, -1.5f, 1.f), Vector3f::Zero(), Vector3f::UnitZ());
+}
+
+/// a single icosphere of \a level subdivisions, such that the BVH is built over one dense mesh
+static void createDenseIcosphere(BenchScene& bench, int level)
+{
+    double t = currentTime();
+    std::vector<Vector3f> positions;
+    std::vector<Vector3i> faces;
+    BenchScenes::icosphere(level, positions, faces);
+    Mesh* mesh = new Mesh;
+    mesh->loadRawData(positions[0].data(), positions.size(), faces[0].data(), faces.size());
+    bench.loadTime = currentTime() - t;
+    addUnitaryMesh(bench, mesh);
+}
+
+/// a mesh file seen from the front of its bounding box
+static bool createMeshScene(BenchScene& bench, const std::string& filename)
+{
+    double t = currentTime();
+    Mesh* mesh = new Mesh;
+    mesh->loadOFF(filename);
+    bench.loadTime = currentTime() - t;
+    if(mesh->nbFaces()==0)
+    {
+        delete mesh;
+        return false;
+    }
+    addUnitaryMesh(bench, mesh);
+    return true;
+}
+
+/// traces \a rays \a nbTrials times, \returns the median number of rays per second
+static double traceRays(const Scene& scene, const std::vector<Ray>& rays, int nbTrials)
+{
+    std::vector<double> rates;
+    for(int trial=0; trial<nbTrials; ++trial)
+    {
+        double t = currentTime();
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(int i=0; i<int(rays.size()); ++i)
+        {
+            Hit hit;
+            scene.intersect(rays[i], hit);
+        }
+        t = currentTime() - t;
+        rates.push_back(t>0. ? rays.size()/t : 0.);
+    }
+    std::sort(rates.begin(), rates.end());
+    return rates.empty() ? 0. : rates[rates.size()/2];
+}
+
+/** Generates the primary rays of a \a width x \a width image, and from their hits the rays toward a point light
+  * above the scene and the incoherent rays in random directions of the hemisphere of the normal. */
+static void benchmarkRays(BenchScene& bench, int width, int nbTrials)
+{
+    Camera camera = bench.scene.camera();
+    camera.setViewport(width, width);
+    std::vector<Ray> rays[3];
+    for(int j=0; j<width; ++j)
+        for(int i=0; i<width; ++i)
+            rays[0].push_back(Raytracing::primaryRay(camera, i+0.5f, j+0.5f));
+
+    Vector3f light = camera.position() + camera.position().norm()*Vector3f::UnitZ();
+    srand(1);
+    for(size_t k=0; k<rays[0].size(); ++k)
+    {
+        Hit hit;
+        bench.scene.intersect(rays[0][k], hit);
+        if(!hit.foundIntersection())
+            continue;
+        Vector3f x = rays[0][k].at(hit.t()) + hit.normal()*1e-4f;
+
+        Ray shadowRay(x, (light - x).normalized());
+        shadowRay.shadowRay = true;
+        rays[1].push_back(shadowRay);
+
+        Vector3f d;
+        do d = Vector3f::Random(); while(d.squaredNorm()>1.f || d.squaredNorm()<1e-4f);
+        if(d.dot(hit.normal())<0.f)
+            d = -d;
+        Ray bounce(x, d.normalized());
+        bounce.recursionLevel = 1;
+        rays[2].push_back(bounce);
+    }
+
+    for(int kind=0; kind<3; ++kind)
+        bench.raysPerSecond[kind] = traceRays(bench.scene, rays[kind], nbTrials);
+}
+
+static void buildBVHs(BenchScene& bench)
+{
+    bench.nbTriangles = 0;
+    double t = currentTime();
+    for(size_t i=0; i<bench.meshes.size(); ++i)
+    {
+        bench.meshes[i]->buildBVH();
+        bench.nbTriangles += bench.meshes[i]->nbFaces();
+    }
+    bench.buildTime = currentTime() - t;
+    bench.bvhMemory = 0;
+    for(size_t i=0; i<bench.meshes.size(); ++i)
+        bench.bvhMemory += bench.meshes[i]->bvh()->statistics().memory;
+}
+
+static void printJSON(std::ostream& out, const std::vector<BenchScene*>& benches, int width, int nbTrials, int nbThreads)
+{
+    out << "{\n  \"threads\": " << nbThreads << ",\n  \"width\": " << width << ",\n  \"trials\": " << nbTrials << ",\n  \"scenes\": [\n";
+    for(size_t i=0; i<benches.size(); ++i)
+    {
+        const BenchScene& b = *benches[i];
+        out << "    { \"name\": \"" << b.name << "\", \"triangles\": " << b.nbTriangles
+            << ", \"load_ms\": " << b.loadTime*1e3 << ", \"build_ms\": " << b.buildTime*1e3
+            << ", \"bvh_bytes\": " << b.bvhMemory;
+        for(int kind=0; kind<3; ++kind)
+            out << ", \"" << rayKindNames[kind] << "_rays_per_sec\": " << b.raysPerSecond[kind];
+        out << " }" << (i+1<benches.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+    std::string jsonFilename;
+    int width = 512, nbTrials = 5;
+    bool defaultScene = true;
+    std::vector<std::string> meshFiles;
+    for(int i=1; i<argc; ++i)
+    {
+        if(!strcmp(argv[i], "--json") && i+1<argc)
+            jsonFilename = argv[++i];
+        else if(!strcmp(argv[i], "--width") && i+1<argc)
+            width = std::max(1, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--trials") && i+1<argc)
+            nbTrials = std::max(1, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--no-default"))
+            defaultScene = false;
+        else if(argv[i][0]=='-')
+        {
+            std::cerr << "usage: " << argv[0] << " [--json file] [--width n] [--trials n] [--no-default] [mesh.off ...]" << std::endl;
+            return 1;
+        }
+        else
+            meshFiles.push_back(argv[i]);
+    }
+    int nbThreads = 1;
+#ifdef _OPENMP
+    nbThreads = omp_get_max_threads();
+#endif
+
+    std::vector<BenchScene*> benches;
+    BenchScene* bench = new BenchScene;
+    bench->name = "icosphere_objects";
+    createIcosphereField(*bench, 8, 4, false);
+    benches.push_back(bench);
+
+    bench = new BenchScene;
+    bench->name = "icosphere_field";
+    createIcosphereField(*bench, 16, 4, true);
+    benches.push_back(bench);
+
+    bench = new BenchScene;
+    bench->name = "icosphere_dense";
+    createDenseIcosphere(*bench, 7);
+    benches.push_back(bench);
+
+    for(size_t i=0; i<meshFiles.size(); ++i)
+    {
+        bench = new BenchScene;
+        bench->name = meshFiles[i];
+        if(createMeshScene(*bench, meshFiles[i]))
+            benches.push_back(bench);
+        else
+        {
+            std::cerr << "sire_bench: cannot load " << meshFiles[i] << std::endl;
+            delete bench;
+        }
+    }
+
+    Shader program;
+    if(defaultScene)
+    {
+        bench = new BenchScene;
+        bench->name = "default";
+        double t = currentTime();
+        bench->scene.createDefaultScene(program);
+        bench->loadTime = currentTime() - t;
+        for(size_t i=0; i<bench->scene.objectList().size(); ++i)
+        {
+            Mesh* mesh = dynamic_cast<Mesh*>(const_cast<Shape*>(bench->scene.objectList()[i]->shape()));
+            if(mesh)
+                bench->meshes.push_back(mesh);
+        }
+        benches.push_back(bench);
+    }
+
+    MemoryStatistics::print(std::cout, "after loading");
+    for(size_t i=0; i<benches.size(); ++i)
+    {
+        BenchScene& b = *benches[i];
+        buildBVHs(b);
+        benchmarkRays(b, width, nbTrials);
+        std::cout << b.name << ": " << b.nbTriangles << " triangles, load " << b.loadTime*1e3 << " ms, build " << b.buildTime*1e3 << " ms"
+                  << " (BVH " << (b.bvhMemory >> 10) << "KB)";
+        for(int kind=0; kind<3; ++kind)
+            std::cout << ", " << rayKindNames[kind] << " " << b.raysPerSecond[kind]*1e-6 << " Mrays/s";
+        std::cout << std::endl;
+    }
+
+    if(!jsonFilename.empty())
+    {
+        std::ofstream out(jsonFilename.c_str());
+        if(!out)
+        {
+            std::cerr << "sire_bench: cannot write " << jsonFilename << std::endl;
+            return 1;
+        }
+        printJSON(out, benches, width, nbTrials, nbThreads);
+    }
+    MemoryStatistics::print(std::cout, "at the end");
+    return 0;
+}
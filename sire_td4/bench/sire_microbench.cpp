@@ -0,0 +1,403 @@
+// Micro-benchmarks of the raytracing kernels: ray/triangle (Mesh::intersectTriangle), ray/box (::intersect of Ray.h),
+// BlinnPhong::brdf and Ward::brdf.
+//
+// usage: sire_microbench [--batch n] [--warmup n] [--trials n] [--seed n] [kernel ...]
+//
+// Each kernel is run over a batch of randomized inputs, first --warmup times, then --trials times, and the median
+// and the median absolute deviation (MAD) of the time per call are reported. The results are then checked against
+// a reference implementation in double precision, away from the degenerate configurations where float rounding
+// decides the answer. The exit code is 1 if any result differs, such that an optimized kernel cannot silently
+// change the answers.
+
+#include "Mesh.h"
+#include "Material.h"
+#include "Ray.h"
+
+#include <Eigen/Geometry>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <time.h>
+
+using namespace Eigen;
+
+/// \returns a monotonic wall-clock time in seconds
+static double currentTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/// \returns true if \a a and \a b are equal up to the relative tolerance \a rel, or the absolute one \a abs
+static bool closeEnough(double a, double b, double rel, double abs)
+{
+    return std::abs(a-b) <= std::max(abs, rel*std::max(std::abs(a), std::abs(b)));
+}
+
+/// \returns a random direction in the hemisphere of \a n
+static Vector3f randomDirection(const Vector3f& n)
+{
+    Vector3f d;
+    do d = Vector3f::Random(); while(d.squaredNorm()>1.f || d.squaredNorm()<1e-2f);
+    d.normalize();
+    return d.dot(n)<0.f ? -d : d;
+}
+
+/// a ray from a sphere of radius 3 toward a random point of [-0.5,0.5]^3
+static Ray randomRay()
+{
+    Vector3f o = Vector3f::Random().normalized()*3.f;
+    Vector3f target = 0.5f*Vector3f::Random();
+    return Ray(o, (target-o).normalized());
+}
+
+/** A kernel to benchmark: prepare() generates the inputs, run() calls the kernel on all of them
+  * and accumulates its results in a checksum, and check() \returns the number of results which
+  * differ from the reference, counting the checked ones in \a nbChecked. */
+class Kernel
+{
+public:
+    virtual ~Kernel() {}
+    virtual const char* name() const = 0;
+    virtual void prepare(int batchSize) = 0;
+    virtual double run() = 0;
+    virtual int check(int& nbChecked) = 0;
+};
+
+class TriangleKernel : public Kernel
+{
+public:
+    const char* name() const { return "ray_triangle"; }
+
+    void prepare(int batchSize)
+    {
+        mRays.resize(batchSize);
+        mVertices.resize(3*batchSize);
+        for(int i=0; i<batchSize; ++i)
+        {
+            mRays[i] = randomRay();
+            for(int k=0; k<3; ++k)
+                mVertices[3*i+k] = 0.7f*Vector3f::Random();
+        }
+    }
+
+    double run()
+    {
+        double sum = 0.;
+        for(size_t i=0; i<mRays.size(); ++i)
+        {
+            Hit hit;
+            if(mMesh.intersectTriangle(mRays[i], hit, 0, mVertices[3*i], mVertices[3*i+1], mVertices[3*i+2]))
+                sum += hit.t();
+        }
+        return sum;
+    }
+
+    int check(int& nbChecked)
+    {
+        int nbErrors = 0;
+        nbChecked = 0;
+        for(size_t i=0; i<mRays.size(); ++i)
+        {
+            Hit hit;
+            bool found = mMesh.intersectTriangle(mRays[i], hit, 0, mVertices[3*i], mVertices[3*i+1], mVertices[3*i+2]);
+
+            // Moller-Trumbore in double precision
+            Vector3d o = mRays[i].origin.cast<double>(), d = mRays[i].direction.cast<double>();
+            Vector3d v0 = mVertices[3*i].cast<double>();
+            Vector3d e1 = mVertices[3*i+1].cast<double>() - v0, e2 = mVertices[3*i+2].cast<double>() - v0;
+            Vector3d p = d.cross(e2);
+            double det = e1.dot(p);
+            if(std::abs(det) < 1e-4)
+                continue;
+            Vector3d s = o - v0, q = s.cross(e1);
+            double u = s.dot(p)/det, v = d.dot(q)/det, t = e2.dot(q)/det;
+            // too close to an edge or to the origin of the ray for float rounding not to matter
+            const double eps = 1e-4;
+            if(std::abs(u)<eps || std::abs(v)<eps || std::abs(1.-u-v)<eps || std::abs(t)<eps)
+                continue;
+            bool refFound = t>0 && u>=0 && v>=0 && u+v<=1;
+
+            ++nbChecked;
+            if(found!=refFound || (found && (!closeEnough(hit.t(), t, 1e-3, 1e-5)
+                                             || !closeEnough(hit.barycentrics()(0), u, 1e-3, 1e-4)
+                                             || !closeEnough(hit.barycentrics()(1), v, 1e-3, 1e-4))))
+                ++nbErrors;
+        }
+        return nbErrors;
+    }
+
+protected:
+    Mesh mMesh;
+    std::vector<Ray> mRays;
+    std::vector<Vector3f> mVertices;
+};
+
+class BoxKernel : public Kernel
+{
+public:
+    const char* name() const { return "ray_box"; }
+
+    void prepare(int batchSize)
+    {
+        mRays.resize(batchSize);
+        mBoxes.resize(batchSize);
+        for(int i=0; i<batchSize; ++i)
+        {
+            mRays[i] = randomRay();
+            Vector3f a = Vector3f::Random(), b = Vector3f::Random();
+            mBoxes[i] = AlignedBox3f(a.cwiseMin(b), a.cwiseMax(b));
+        }
+    }
+
+    double run()
+    {
+        double sum = 0.;
+        for(size_t i=0; i<mRays.size(); ++i)
+        {
+            float tMin, tMax;
+            if(::intersect(mRays[i], mBoxes[i], tMin, tMax))
+                sum += tMin;
+        }
+        return sum;
+    }
+
+    int check(int& nbChecked)
+    {
+        int nbErrors = 0;
+        nbChecked = 0;
+        for(size_t i=0; i<mRays.size(); ++i)
+        {
+            float tMin, tMax;
+            bool found = ::intersect(mRays[i], mBoxes[i], tMin, tMax);
+
+            // slab test in double precision, the rays parallel to a slab are not checked
+            double refMin = -HUGE_VAL, refMax = HUGE_VAL;
+            bool degenerate = false;
+            for(int k=0; k<3; ++k)
+            {
+                double o = mRays[i].origin(k), d = mRays[i].direction(k);
+                if(std::abs(d) < 1e-6)
+                {
+                    degenerate = true;
+                    break;
+                }
+                double t1 = (mBoxes[i].min()(k)-o)/d, t2 = (mBoxes[i].max()(k)-o)/d;
+                refMin = std::max(refMin, std::min(t1, t2));
+                refMax = std::min(refMax, std::max(t1, t2));
+            }
+            // grazing rays and rays starting on a face are decided by rounding
+            if(degenerate || std::abs(refMax-refMin)<1e-4 || std::abs(refMax)<1e-4)
+                continue;
+            bool refFound = refMax>0 && refMin<=refMax;
+
+            ++nbChecked;
+            if(found!=refFound || (found && (!closeEnough(tMin, refMin, 1e-4, 1e-5) || !closeEnough(tMax, refMax, 1e-4, 1e-5))))
+                ++nbErrors;
+        }
+        return nbErrors;
+    }
+
+protected:
+    std::vector<Ray> mRays;
+    std::vector<AlignedBox3f> mBoxes;
+};
+
+/// base class of the BRDF kernels, evaluated for random directions in the hemisphere of a random normal
+class BRDFKernel : public Kernel
+{
+public:
+    void prepare(int batchSize)
+    {
+        mNormals.resize(batchSize);
+        mViewDirs.resize(batchSize);
+        mLightDirs.resize(batchSize);
+        for(int i=0; i<batchSize; ++i)
+        {
+            mNormals[i] = Vector3f::Random().normalized();
+            mViewDirs[i] = randomDirection(mNormals[i]);
+            mLightDirs[i] = randomDirection(mNormals[i]);
+        }
+    }
+
+    double run()
+    {
+        double sum = 0.;
+        for(size_t i=0; i<mNormals.size(); ++i)
+            sum += material().brdf(mViewDirs[i], mLightDirs[i], mNormals[i]).sum();
+        return sum;
+    }
+
+    int check(int& nbChecked)
+    {
+        int nbErrors = 0;
+        nbChecked = 0;
+        for(size_t i=0; i<mNormals.size(); ++i)
+        {
+            Array3d ref;
+            if(!reference(mViewDirs[i].cast<double>(), mLightDirs[i].cast<double>(), mNormals[i].cast<double>(), ref))
+                continue;
+            Array3f value = material().brdf(mViewDirs[i], mLightDirs[i], mNormals[i]);
+            ++nbChecked;
+            for(int k=0; k<3; ++k)
+                if(!closeEnough(value(k), ref(k), 1e-3, 1e-6))
+                {
+                    ++nbErrors;
+                    break;
+                }
+        }
+        return nbErrors;
+    }
+
+protected:
+    virtual const Material& material() const = 0;
+    /// computes the reference value in \a ref, \returns false if the configuration is too ill-conditioned to be checked
+    virtual bool reference(const Vector3d& viewDir, const Vector3d& lightDir, const Vector3d& normal, Array3d& ref) const = 0;
+
+    std::vector<Vector3f> mNormals;
+    std::vector<Vector3f> mViewDirs;
+    std::vector<Vector3f> mLightDirs;
+};
+
+class BlinnPhongKernel : public BRDFKernel
+{
+public:
+    BlinnPhongKernel()
+        : mDiffuse(0.3, 0.3, 0.8), mSpecular(1, 1, 1), mExponent(64), mMaterial(mDiffuse.cast<float>(), mSpecular.cast<float>(), mExponent)
+    {}
+    const char* name() const { return "blinn_phong_brdf"; }
+
+protected:
+    const Material& material() const { return mMaterial; }
+
+    bool reference(const Vector3d& viewDir, const Vector3d& lightDir, const Vector3d& normal, Array3d& ref) const
+    {
+        Vector3d h = viewDir + lightDir;
+        if(h.norm() < 1e-3)
+            return false;
+        h.normalize();
+        ref = mDiffuse + mSpecular * std::pow(std::max(0., normal.dot(h)), mExponent);
+        return true;
+    }
+
+    Array3d mDiffuse, mSpecular;
+    double mExponent;
+    BlinnPhong mMaterial;
+};
+
+class WardKernel : public BRDFKernel
+{
+public:
+    WardKernel()
+        : mDiffuse(0.2, 0.2, 0.2), mSpecular(0.7, 0.7, 0.7), mAx(0.1), mAy(0.5), mMaterial(mDiffuse.cast<float>(), mSpecular.cast<float>(), mAx, mAy)
+    {}
+    const char* name() const { return "ward_brdf"; }
+
+protected:
+    const Material& material() const { return mMaterial; }
+
+    /// the anisotropic Ward BRDF, with the exponent -((h.x/ax)^2 + (h.y/ay)^2) / (h.n)^2
+    bool reference(const Vector3d& viewDir, const Vector3d& lightDir, const Vector3d& normal, Array3d& ref) const
+    {
+        Vector3d h = viewDir + lightDir;
+        if(h.norm() < 1e-3)
+            return false;
+        h.normalize();
+        Vector3d y = normal.unitOrthogonal();
+        Vector3d x = normal.cross(y);
+        double hx = h.dot(x) / mAx, hy = h.dot(y) / mAy, hn = h.dot(normal);
+        // grazing directions, where the float rounding of the cosines dominates
+        if(hn < 1e-3 || std::min(lightDir.dot(normal), viewDir.dot(normal)) < 1e-3)
+            return false;
+        ref = mDiffuse / M_PI
+            + (mSpecular / (4. * M_PI * mAx * mAy * std::sqrt(std::max(lightDir.dot(normal) * viewDir.dot(normal), 1e-8))))
+              * std::exp(-(hx*hx + hy*hy) / (hn*hn));
+        return true;
+    }
+
+    Array3d mDiffuse, mSpecular;
+    double mAx, mAy;
+    Ward mMaterial;
+};
+
+/// \returns the median of \a values, which are sorted
+static double median(std::vector<double>& values)
+{
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n%2 ? values[n/2] : 0.5*(values[n/2-1] + values[n/2]);
+}
+
+int main(int argc, char** argv)
+{
+    int batchSize = 1<<16, nbWarmups = 3, nbTrials = 15;
+    unsigned int seed = 1;
+    std::vector<std::string> selected;
+    for(int i=1; i<argc; ++i)
+    {
+        if(!strcmp(argv[i], "--batch") && i+1<argc)
+            batchSize = std::max(1, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--warmup") && i+1<argc)
+            nbWarmups = std::max(0, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--trials") && i+1<argc)
+            nbTrials = std::max(1, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--seed") && i+1<argc)
+            seed = atoi(argv[++i]);
+        else if(argv[i][0]=='-')
+        {
+            std::cerr << "usage: " << argv[0] << " [--batch n] [--warmup n] [--trials n] [--seed n] [kernel ...]" << std::endl;
+            return 1;
+        }
+        else
+            selected.push_back(argv[i]);
+    }
+
+    std::vector<Kernel*> kernels;
+    kernels.push_back(new TriangleKernel);
+    kernels.push_back(new BoxKernel);
+    kernels.push_back(new BlinnPhongKernel);
+    kernels.push_back(new WardKernel);
+
+    int nbFailed = 0;
+    volatile double sink = 0.;
+    for(size_t k=0; k<kernels.size(); ++k)
+    {
+        Kernel& kernel = *kernels[k];
+        if(!selected.empty() && std::find(selected.begin(), selected.end(), std::string(kernel.name()))==selected.end())
+            continue;
+
+        srand(seed);
+        kernel.prepare(batchSize);
+        for(int i=0; i<nbWarmups; ++i)
+            sink = sink + kernel.run();
+
+        std::vector<double> times;
+        for(int i=0; i<nbTrials; ++i)
+        {
+            double t = currentTime();
+            sink = sink + kernel.run();
+            times.push_back((currentTime() - t) * 1e9 / batchSize);
+        }
+        double med = median(times);
+        std::vector<double> deviations;
+        for(size_t i=0; i<times.size(); ++i)
+            deviations.push_back(std::abs(times[i] - med));
+        double mad = median(deviations);
+
+        int nbChecked;
+        int nbErrors = kernel.check(nbChecked);
+        if(nbErrors)
+            ++nbFailed;
+        std::cout << kernel.name() << ": median " << med << " ns/call, MAD " << mad << " ns ("
+                  << 100.*mad/std::max(med, 1e-12) << "%), reference check " << nbErrors << " errors over " << nbChecked << " calls\n";
+    }
+
+    for(size_t k=0; k<kernels.size(); ++k)
+        delete kernels[k];
+    return nbFailed ? 1 : 0;
+}
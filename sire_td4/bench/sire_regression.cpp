@@ -0,0 +1,379 @@
+// Image regression test of the raytracer.
+//
+// usage: sire_regression [--update] [--reference dir] [--output dir] [--width n] [--seed n]
+//                        [--max-rmse x] [--max-relmse x] [--pixel-tolerance x] [--max-bad-pixels x] [case ...]
+//
+// Each case renders a fixed scene headlessly through Scene::raytrace, with the random generator seeded by --seed,
+// and compares the image with the reference PFM image of the scene:
+//  - the RMSE of the tone mapped values (in [0,1], as displayed) must not exceed --max-rmse,
+//  - the relative MSE of the radiances, (a-b)^2/(b^2+0.01), must not exceed --max-relmse,
+//  - the fraction of pixels of which a tone mapped channel differs by more than --pixel-tolerance
+//    must not exceed --max-bad-pixels.
+// The cases of a same scene rendered with different acceleration structures share its reference, such that they
+// are all checked against each other. The spheres_obj case loads the mesh of the spheres scene from an OBJ file
+// with trailing comments, written in the output directory, to check the OBJ parser. The mesh_cache case renders
+// nothing, it checks that the binary cache of such a file is written when the mesh is modified once loaded.
+// On failure, the image and the differences are written in the output directory (<case>_test.pfm,
+// <case>_diff.pfm, and <case>_diff.ppm where the differences are magnified 10 times).
+// --update writes the references instead. The exit code is 1 if a case fails.
+
+#include "Scene.h"
+#include "Mesh.h"
+#include "Sphere.h"
+#include "Light.h"
+#include "Material.h"
+#include "Raytracing.h"
+#include "BenchScenes.h"
+
+#include <Eigen/Geometry>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+using namespace Eigen;
+
+#ifndef SIRE_DIR
+#define SIRE_DIR "."
+#endif
+
+/// an RGB image of radiances, stored row by row from the top
+struct Image
+{
+    int width, height;
+    std::vector<float> data;
+};
+
+static bool savePFM(const std::string& filename, const Image& img)
+{
+    FILE* f = fopen(filename.c_str(), "wb");
+    if(!f)
+    {
+        std::cerr << "sire_regression: cannot open " << filename << " for writing" << std::endl;
+        return false;
+    }
+    // PFM stores the rows from bottom to top, the negative scale tells they are little endian
+    fprintf(f, "PF\n%d %d\n-1.0\n", img.width, img.height);
+    bool ok = true;
+    for(int j=img.height-1; j>=0 && ok; --j)
+        ok = fwrite(&img.data[3*j*img.width], sizeof(float), 3*img.width, f)==size_t(3*img.width);
+    ok = fclose(f)==0 && ok;
+    if(!ok)
+        std::cerr << "sire_regression: error while writing " << filename << std::endl;
+    return ok;
+}
+
+static bool loadPFM(const std::string& filename, Image& img)
+{
+    FILE* f = fopen(filename.c_str(), "rb");
+    if(!f)
+        return false;
+    char type[3] = {0, 0, 0};
+    float scale;
+    bool ok = fscanf(f, "%2s %d %d %f", type, &img.width, &img.height, &scale)==4 && !strcmp(type, "PF") && scale<0.f
+           && img.width>0 && img.height>0 && fgetc(f)!=EOF;
+    if(ok)
+    {
+        img.data.resize(3*img.width*img.height);
+        for(int j=img.height-1; j>=0 && ok; --j)
+            ok = fread(&img.data[3*j*img.width], sizeof(float), 3*img.width, f)==size_t(3*img.width);
+    }
+    fclose(f);
+    return ok;
+}
+
+/// writes \a values in [0,1] as an 8-bit binary PPM image
+static bool savePPM(const std::string& filename, int width, int height, const std::vector<float>& values)
+{
+    FILE* f = fopen(filename.c_str(), "wb");
+    if(!f)
+        return false;
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> bytes(values.size());
+    for(size_t i=0; i<values.size(); ++i)
+        bytes[i] = (unsigned char)(255.f*std::min(std::max(values[i], 0.f), 1.f) + 0.5f);
+    bool ok = fwrite(&bytes[0], 1, bytes.size(), f)==bytes.size();
+    return fclose(f)==0 && ok;
+}
+
+/// the tone mapping of Raytracing::raytraceImage
+static float toneMap(float x)
+{
+    return std::min(x/(x+0.25f), 1.f);
+}
+
+static Image render(const Scene& scene, int width, unsigned int seed)
+{
+    Camera camera = scene.camera();
+    camera.setViewport(width, width);
+    Image img;
+    img.width = img.height = width;
+    img.data.resize(3*width*width);
+    srand(seed);
+    for(int j=0; j<width; ++j)
+        for(int i=0; i<width; ++i)
+        {
+            Array3f color = scene.raytrace(Raytracing::primaryRay(camera, i+0.5f, j+0.5f));
+            for(int k=0; k<3; ++k)
+                img.data[3*(j*width+i)+k] = color(k);
+        }
+    return img;
+}
+
+/// a test case: a scene, built with a given acceleration structure, and the name of its reference
+struct Case
+{
+    std::string name;
+    std::string reference;
+    Scene scene;
+};
+
+/** writes the mesh \a positions, \a faces to the OBJ file \a filename, with comments at the end of the statements
+  * as written by some exporters. \returns false if the file cannot be written */
+static bool writeCommentedOBJ(const std::string& filename, const std::vector<Vector3f>& positions, const std::vector<Vector3i>& faces)
+{
+    FILE* f = fopen(filename.c_str(), "w");
+    if(!f)
+        return false;
+    fprintf(f, "# icosphere\n");
+    for(size_t i=0; i<positions.size(); ++i)
+        fprintf(f, "v %.9g %.9g %.9g # vertex %d\n", positions[i].x(), positions[i].y(), positions[i].z(), int(i));
+    for(size_t i=0; i<faces.size(); ++i)
+        fprintf(f, "f %d %d %d #%s\n", faces[i](0)+1, faces[i](1)+1, faces[i](2)+1, i%2 ? " triangle 4 5" : "");
+    return fclose(f)==0;
+}
+
+/** two spheres, one analytic with the Ward BRDF of the default scene, lit by a point light.
+  * The mesh is loaded from the OBJ file \a objFilename written by writeCommentedOBJ() if it is not empty. */
+static bool createSpheres(Case& c, const std::string& objFilename = "")
+{
+    Object* pObj = new Object;
+    pObj->attachShape(new Sphere(Vector3f::Zero(), 0.5f));
+    pObj->setTransformation(Affine3f(Translation3f(0.6f, -0.6f, 0.1f)).matrix());
+    pObj->setMaterial(new Ward(Array3f(0.f, 0.f, 0.f), Array3f(0.7f, 0.7f, 0.7f), 0.1f, 0.5f));
+    c.scene.addObject(pObj);
+
+    Mesh* mesh = new Mesh;
+    std::vector<Vector3f> positions;
+    std::vector<Vector3i> faces;
+    BenchScenes::icosphere(3, positions, faces);
+    if(objFilename.empty())
+        mesh->loadRawData(positions[0].data(), positions.size(), faces[0].data(), faces.size());
+    else if(writeCommentedOBJ(objFilename, positions, faces))
+        mesh->loadOBJ(objFilename);
+    if(mesh->nbFaces()!=int(faces.size()))
+    {
+        std::cerr << "sire_regression: " << objFilename << " has " << mesh->nbFaces() << " faces instead of " << faces.size() << std::endl;
+        delete mesh;
+        return false;
+    }
+    mesh->buildBVH();
+    pObj = new Object;
+    pObj->attachShape(mesh);
+    pObj->setTransformation(Affine3f(Translation3f(-0.6f, 0.6f, 0.f) * Scaling(0.6f)).matrix());
+    pObj->setMaterial(new BlinnPhong(Array3f(0.3f, 0.3f, 0.8f), Array3f(0.f, 0.f, 0.f), 32.f));
+    c.scene.addObject(pObj);
+
+    c.scene.addLight(new PointLight(Vector3f(2, -5, 5), Array3f(0.8, 0.8, 0.8), 20));
+    c.scene.camera().setViewport(512, 512);
+    c.scene.camera().setFovY(M_PI/2.);
+    c.scene.camera().lookAt(Vector3f(1.2, -1.2, 1.2), Vector3f(0, 0, 0.1), Vector3f::UnitZ());
+    return true;
+}
+
+/** a 3 x 3 field of icospheres lit by a point light and a directional light, merged in a single mesh
+  * whose BVH is built with \a method, or as separate objects if \a method is negative */
+static void createField(Case& c, int method, bool compressNodes)
+{
+    const Material* material = new BlinnPhong(Array3f(0.8f, 0.6f, 0.4f), Array3f(0.f, 0.f, 0.f), 32.f);
+    std::vector<Mesh*> meshes = BenchScenes::addIcosphereField(c.scene, 3, 3, method>=0, material);
+    for(size_t i=0; i<meshes.size(); ++i)
+    {
+        if(method>=0)
+            meshes[i]->setBVHBuildMethod(BVH::BuildMethod(method));
+        meshes[i]->buildBVH();
+        if(compressNodes)
+            meshes[i]->compressBVH();
+    }
+    c.scene.addLight(new PointLight(Vector3f(-2, -4, 6), Array3f(0.8, 0.8, 0.8), 20));
+    c.scene.addLight(new DirectionalLight(-Vector3f(1, 1, 1).normalized(), Array3f(0.4, 0.4, 0.4)));
+}
+
+/** checks that the binary cache of a mesh file is written when the mesh is modified once loaded,
+  * as by Mesh(file), makeUnitary(), buildBVH(), and that it holds the geometry of the file */
+static bool checkMeshCache(const std::string& objFilename)
+{
+    std::vector<Vector3f> positions;
+    std::vector<Vector3i> faces;
+    BenchScenes::icosphere(3, positions, faces);
+    std::string cacheFilename = Mesh::cacheFilename(objFilename);
+    remove(cacheFilename.c_str());
+    if(!writeCommentedOBJ(objFilename, positions, faces))
+        return false;
+
+    Mesh* mesh = new Mesh(objFilename);
+    mesh->makeUnitary();
+    mesh->buildBVH();
+    delete mesh;
+
+    Mesh cached;
+    if(!cached.loadCache(objFilename))
+    {
+        std::cerr << "sire_regression: " << cacheFilename << " has not been written" << std::endl;
+        return false;
+    }
+    // the cache holds the geometry of the file, not the one made unitary
+    Mesh parsed;
+    parsed.loadOBJ(objFilename);
+    if(cached.nbFaces()!=parsed.nbFaces() || cached.geometryHash()!=parsed.geometryHash())
+    {
+        std::cerr << "sire_regression: " << cacheFilename << " does not hold the geometry of " << objFilename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string referenceDir = SIRE_DIR "/bench/reference", outputDir = ".";
+    int width = 64;
+    unsigned int seed = 1;
+    bool update = false;
+    double maxRMSE = 2e-3, maxRelMSE = 1e-4, pixelTolerance = 4./255., maxBadPixels = 1e-3;
+    std::vector<std::string> selected;
+    for(int i=1; i<argc; ++i)
+    {
+        if(!strcmp(argv[i], "--update"))
+            update = true;
+        else if(!strcmp(argv[i], "--reference") && i+1<argc)
+            referenceDir = argv[++i];
+        else if(!strcmp(argv[i], "--output") && i+1<argc)
+            outputDir = argv[++i];
+        else if(!strcmp(argv[i], "--width") && i+1<argc)
+            width = std::max(1, atoi(argv[++i]));
+        else if(!strcmp(argv[i], "--seed") && i+1<argc)
+            seed = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--max-rmse") && i+1<argc)
+            maxRMSE = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--max-relmse") && i+1<argc)
+            maxRelMSE = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--pixel-tolerance") && i+1<argc)
+            pixelTolerance = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--max-bad-pixels") && i+1<argc)
+            maxBadPixels = atof(argv[++i]);
+        else if(argv[i][0]=='-')
+        {
+            std::cerr << "usage: " << argv[0] << " [--update] [--reference dir] [--output dir] [--width n] [--seed n]"
+                      << " [--max-rmse x] [--max-relmse x] [--pixel-tolerance x] [--max-bad-pixels x] [case ...]" << std::endl;
+            return 1;
+        }
+        else
+            selected.push_back(argv[i]);
+    }
+
+    static const char* caseNames[] = { "spheres", "spheres_obj", "field_midpoint", "field_linear", "field_spatial", "field_compressed", "field_objects" };
+    const int nbCases = sizeof(caseNames)/sizeof(caseNames[0]);
+    int nbFailed = 0, nbRun = 0;
+    std::vector<std::string> written;
+    for(int k=0; k<nbCases; ++k)
+    {
+        if(!selected.empty() && std::find(selected.begin(), selected.end(), std::string(caseNames[k]))==selected.end())
+            continue;
+        Case c;
+        c.name = caseNames[k];
+        c.reference = k<=1 ? "spheres" : "field";
+        bool created = true;
+        switch(k)
+        {
+        case 0: createSpheres(c); break;
+        case 1: created = createSpheres(c, outputDir + "/spheres_obj.obj"); break;
+        case 2: createField(c, BVH::MIDPOINT, false); break;
+        case 3: createField(c, BVH::LINEAR, false); break;
+        case 4: createField(c, BVH::SPATIAL, false); break;
+        case 5: createField(c, BVH::MIDPOINT, true); break;
+        default: createField(c, -1, false); break;
+        }
+        ++nbRun;
+        if(!created)
+        {
+            std::cout << c.name << ": FAILED, the scene cannot be created\n";
+            ++nbFailed;
+            continue;
+        }
+
+        Image img = render(c.scene, width, seed);
+        std::string referenceFile = referenceDir + "/" + c.reference + ".pfm";
+        if(update)
+        {
+            // the first case run of a scene defines its reference
+            if(std::find(written.begin(), written.end(), c.reference)==written.end())
+            {
+                written.push_back(c.reference);
+                if(!savePFM(referenceFile, img))
+                    ++nbFailed;
+                else
+                    std::cout << c.name << ": reference written to " << referenceFile << "\n";
+            }
+            continue;
+        }
+
+        Image ref;
+        if(!loadPFM(referenceFile, ref) || ref.width!=img.width || ref.height!=img.height)
+        {
+            std::cout << c.name << ": FAILED, no valid " << width << "x" << width << " reference " << referenceFile << "\n";
+            ++nbFailed;
+            continue;
+        }
+
+        double se = 0., relSe = 0.;
+        int nbBadPixels = 0;
+        std::vector<float> diff(img.data.size()), toneMappedDiff(img.data.size());
+        for(size_t p=0; p<img.data.size(); p+=3)
+        {
+            bool bad = false;
+            for(int ch=0; ch<3; ++ch)
+            {
+                float a = img.data[p+ch], b = ref.data[p+ch];
+                float d = std::abs(toneMap(a) - toneMap(b));
+                se += d*d;
+                relSe += double(a-b)*(a-b) / (double(b)*b + 0.01);
+                diff[p+ch] = std::abs(a-b);
+                toneMappedDiff[p+ch] = 10.f*d;
+                bad = bad || d > pixelTolerance;
+            }
+            if(bad)
+                ++nbBadPixels;
+        }
+        double rmse = std::sqrt(se/img.data.size());
+        double relMSE = relSe/img.data.size();
+        double badFraction = double(nbBadPixels)/(img.width*img.height);
+        bool passed = rmse<=maxRMSE && relMSE<=maxRelMSE && badFraction<=maxBadPixels;
+        std::cout << c.name << ": " << (passed ? "passed" : "FAILED") << ", RMSE " << rmse << ", relMSE " << relMSE
+                  << ", " << nbBadPixels << " pixels out of tolerance\n";
+        if(!passed)
+        {
+            ++nbFailed;
+            Image diffImg = img;
+            diffImg.data = diff;
+            savePFM(outputDir + "/" + c.name + "_test.pfm", img);
+            savePFM(outputDir + "/" + c.name + "_diff.pfm", diffImg);
+            savePPM(outputDir + "/" + c.name + "_diff.ppm", img.width, img.height, toneMappedDiff);
+        }
+    }
+
+    if(!update && (selected.empty() || std::find(selected.begin(), selected.end(), std::string("mesh_cache"))!=selected.end()))
+    {
+        bool passed = checkMeshCache(outputDir + "/mesh_cache.obj");
+        std::cout << "mesh_cache: " << (passed ? "passed" : "FAILED") << "\n";
+        ++nbRun;
+        if(!passed)
+            ++nbFailed;
+    }
+
+    std::cout << nbRun-nbFailed << "/" << nbRun << " cases passed\n";
+    return nbFailed ? 1 : 0;
+}
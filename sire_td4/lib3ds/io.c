@@ -266,6 +266,65 @@ lib3ds_io_read_float(Lib3dsIo *io)
 }
 
 
+/*!
+ * \ingroup io
+ *
+ * Read an array of n floats from a file stream in little endian format,
+ * using a single read for the whole array.
+ */
+Lib3dsBool
+lib3ds_io_read_float_array(Lib3dsIo *io, Lib3dsFloat *v, int n)
+{
+  Lib3dsByte *b=(Lib3dsByte*)v;
+  union {
+    float fvalue;
+    unsigned int bytes;
+  } value;
+  int i;
+
+  ASSERT(io);
+  ASSERT(sizeof(Lib3dsFloat)==4);
+  if (lib3ds_io_read(io, b, 4*n)!=4*n) {
+    return(LIB3DS_FALSE);
+  }
+  /* decode in place */
+  for (i=0; i<n; ++i, b+=4) {
+    value.bytes =
+      ((unsigned int)b[3] << 24) |
+      ((unsigned int)b[2] << 16) |
+      ((unsigned int)b[1] << 8) |
+      ((unsigned int)b[0]);
+    v[i]=value.fvalue;
+  }
+  return(LIB3DS_TRUE);
+}
+
+
+/*!
+ * \ingroup io
+ *
+ * Read an array of n words from a file stream in little endian format,
+ * using a single read for the whole array.
+ */
+Lib3dsBool
+lib3ds_io_read_word_array(Lib3dsIo *io, Lib3dsWord *w, int n)
+{
+  Lib3dsByte *b=(Lib3dsByte*)w;
+  int i;
+
+  ASSERT(io);
+  ASSERT(sizeof(Lib3dsWord)==2);
+  if (lib3ds_io_read(io, b, 2*n)!=2*n) {
+    return(LIB3DS_FALSE);
+  }
+  /* decode in place */
+  for (i=0; i<n; ++i, b+=2) {
+    w[i]=((Lib3dsWord)b[1] << 8) | ((Lib3dsWord)b[0]);
+  }
+  return(LIB3DS_TRUE);
+}
+
+
 /*!
  * \ingroup io
  * \ingroup vector
@@ -60,12 +60,26 @@ face_array_read(Lib3dsMesh *mesh, Lib3dsIo *io)
       LIB3DS_ERROR_LOG;
       return(LIB3DS_FALSE);
     }
-    for (i=0; i<faces; ++i) {
-      strcpy(mesh->faceL[i].material, "");
-      mesh->faceL[i].points[0]=lib3ds_io_read_word(io);
-      mesh->faceL[i].points[1]=lib3ds_io_read_word(io);
-      mesh->faceL[i].points[2]=lib3ds_io_read_word(io);
-      mesh->faceL[i].flags=lib3ds_io_read_word(io);
+    {
+      /* read the whole array at once, then scatter it into the faces */
+      Lib3dsWord *words=(Lib3dsWord*)malloc(4*faces*sizeof(Lib3dsWord));
+      if (!words) {
+        LIB3DS_ERROR_LOG;
+        return(LIB3DS_FALSE);
+      }
+      if (!lib3ds_io_read_word_array(io, words, 4*faces)) {
+        free(words);
+        LIB3DS_ERROR_LOG;
+        return(LIB3DS_FALSE);
+      }
+      for (i=0; i<faces; ++i) {
+        strcpy(mesh->faceL[i].material, "");
+        mesh->faceL[i].points[0]=words[4*i];
+        mesh->faceL[i].points[1]=words[4*i+1];
+        mesh->faceL[i].points[2]=words[4*i+2];
+        mesh->faceL[i].flags=words[4*i+3];
+      }
+      free(words);
     }
     lib3ds_chunk_read_tell(&c, io);
 
@@ -554,7 +568,6 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
         break;
       case LIB3DS_POINT_ARRAY:
         {
-          unsigned i,j;
           unsigned points;
           
           lib3ds_mesh_free_point_list(mesh);
@@ -564,10 +577,10 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
               LIB3DS_ERROR_LOG;
               return(LIB3DS_FALSE);
             }
-            for (i=0; i<mesh->points; ++i) {
-              for (j=0; j<3; ++j) {
-                mesh->pointL[i].pos[j]=lib3ds_io_read_float(io);
-              }
+            ASSERT(sizeof(Lib3dsPoint)==3*sizeof(Lib3dsFloat));
+            if (!lib3ds_io_read_float_array(io, &mesh->pointL[0].pos[0], 3*mesh->points)) {
+              LIB3DS_ERROR_LOG;
+              return(LIB3DS_FALSE);
             }
             ASSERT((!mesh->flags) || (mesh->points==mesh->flags));
             ASSERT((!mesh->texels) || (mesh->points==mesh->texels));
@@ -628,7 +641,6 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
         break;
       case LIB3DS_TEX_VERTS:
         {
-          unsigned i;
           unsigned texels;
           
           lib3ds_mesh_free_texel_list(mesh);
@@ -638,9 +650,9 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
               LIB3DS_ERROR_LOG;
               return(LIB3DS_FALSE);
             }
-            for (i=0; i<mesh->texels; ++i) {
-              mesh->texelL[i][0]=lib3ds_io_read_float(io);
-              mesh->texelL[i][1]=lib3ds_io_read_float(io);
+            if (!lib3ds_io_read_float_array(io, &mesh->texelL[0][0], 2*mesh->texels)) {
+              LIB3DS_ERROR_LOG;
+              return(LIB3DS_FALSE);
             }
             ASSERT((!mesh->points) || (mesh->texels==mesh->points));
             ASSERT((!mesh->flags) || (mesh->texels==mesh->flags));
@@ -1,4 +1,5 @@
 #include "Light.h"
+#include <Eigen/Geometry>
 
 class AreaLight : public PointLight
 {
@@ -1,11 +1,56 @@
 
 #include "BVH.h"
 #include "Mesh.h"
+#include "RenderStatistics.h"
+#include "Trace.h"
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unistd.h>
+
+static inline float surfaceArea(const Eigen::AlignedBox3f& box)
+{
+    if(box.isEmpty())
+        return 0.f;
+    Eigen::Vector3f d = box.sizes();
+    return 2.f * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
+}
+
+bool BVH::BuildSettings::operator==(const BuildSettings& other) const
+{
+    if(method!=other.method || maxLeafSize!=other.maxLeafSize || optimizationPasses!=other.optimizationPasses)
+        return false;
+    if(method==SPATIAL)
+        return spatialBudget==other.spatialBudget;
+    return maxDepth==other.maxDepth;
+}
+
+void BVH::build(const Mesh* pMesh, const BuildSettings& settings)
+{
+    if(settings.method==LINEAR)
+        buildLinear(pMesh, settings.maxLeafSize, settings.maxDepth);
+    else if(settings.method==SPATIAL)
+        buildSpatial(pMesh, settings.maxLeafSize, settings.spatialBudget);
+    else
+        build(pMesh, settings.maxLeafSize, settings.maxDepth);
+    if(settings.optimizationPasses>0)
+        optimize(settings.optimizationPasses);
+}
 
 void BVH::build(const Mesh* pMesh, int targetCellSize, int maxDepth)
 {
+    SIRE_TRACE_ZONE("BVH::build");
     mpMesh = pMesh;
+    mSettings = BuildSettings();
+    mSettings.maxLeafSize = targetCellSize;
+    mSettings.maxDepth = maxDepth;
+    mNodes.clear();
+    mCompressedNodes.clear();
+    mFaces.clear();
+    mFile.close();
     mNodes.resize(1);
     mNodes.reserve( std::min<int>(2<<maxDepth, std::log(mpMesh->nbFaces()/targetCellSize) ) );
     // compute centroids and initialize the face list
@@ -13,42 +58,1172 @@ void BVH::build(const Mesh* pMesh, int targetCellSize, int maxDepth)
     mFaces.resize(mpMesh->nbFaces());
     for(int i=0; i<mpMesh->nbFaces(); ++i)
     {
-        mCentroids[i] = (mpMesh->vertexOfFace(i, 0).position + mpMesh->vertexOfFace(i, 1).position + mpMesh->vertexOfFace(i, 2).position)/3.f;
+        mCentroids[i] = (mpMesh->positionOfFace(i, 0) + mpMesh->positionOfFace(i, 1) + mpMesh->positionOfFace(i, 2))/3.f;
         mFaces[i] = i;
     }
+    updateMemoryAccount();
 
     buildNode(0, 0, mpMesh->nbFaces(), 0, targetCellSize, maxDepth);
+    // the centroids are only needed during the construction
+    std::vector<Eigen::Vector3f>().swap(mCentroids);
+    gatherTriangles();
+    mReferenceCost = sahCost();
+}
+
+float BVH::optimize(int nbPasses)
+{
+    SIRE_TRACE_ZONE("BVH::optimize");
+    float before = sahCost();
+    if(hasCompressedNodes() || mNodes.empty())
+        return before;
+    mSettings.optimizationPasses += nbPasses;
+    for(int pass=0; pass<nbPasses; ++pass)
+    {
+        Node* nodes = mNodes.data();
+        int nbNodes = mNodes.size();
+        // group the inner nodes by height, the subtrees of the nodes of the same height being disjoint
+        std::vector<int> heights(nbNodes, 0);
+        std::vector< std::vector<int> > levels;
+        for(int n=nbNodes-1; n>=0; --n)
+        {
+            if(nodes[n].is_leaf)
+                continue;
+            heights[n] = 1 + std::max(heights[nodes[n].first_child_id], heights[nodes[n].first_child_id+1]);
+            if(int(levels.size()) <= heights[n])
+                levels.resize(heights[n]+1);
+            levels[heights[n]].push_back(n);
+        }
+        // the treelets of the nodes of height 1 only have two leaves
+        int nbModified = 0;
+        for(size_t h=2; h<levels.size(); ++h)
+        {
+            const std::vector<int>& level = levels[h];
+            int nbLevelNodes = level.size();
+#pragma omp parallel for schedule(dynamic, 16) reduction(+:nbModified)
+            for(int i=0; i<nbLevelNodes; ++i)
+                if(optimizeTreelet(nodes, level[i]))
+                    ++nbModified;
+        }
+        if(nbModified==0)
+            break;
+
+        // the children are not necessarily stored after their parent anymore
+        std::vector<Node> newNodes;
+        newNodes.reserve(nbNodes);
+        newNodes.resize(1);
+        layoutNode(0, newNodes, 0);
+        mNodes.swap(newNodes);
+    }
+    mReferenceCost = sahCost();
+    updateMemoryAccount();
+    return before;
+}
+
+/// union of the boxes of the treelet leaves, cost and best partition of each subset of leaves
+struct TreeletSubsets
+{
+    enum { MAX_LEAVES = 7, MAX_SUBSETS = 1<<MAX_LEAVES };
+    Eigen::AlignedBox3f boxes[MAX_SUBSETS];
+    float costs[MAX_SUBSETS];
+    int partitions[MAX_SUBSETS];
+};
+
+bool BVH::optimizeTreelet(Node* nodes, int nodeId)
+{
+    // grow the treelet by expanding its leaf of largest area
+    int leaves[TreeletSubsets::MAX_LEAVES];
+    int pairs[TreeletSubsets::MAX_LEAVES-1];
+    int nbLeaves = 2, nbPairs = 1;
+    leaves[0] = nodes[nodeId].first_child_id;
+    leaves[1] = nodes[nodeId].first_child_id+1;
+    pairs[0] = nodes[nodeId].first_child_id;
+    float currentCost = surfaceArea(nodes[nodeId].box);
+    while(nbLeaves < TreeletSubsets::MAX_LEAVES)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for(int i=0; i<nbLeaves; ++i)
+        {
+            float area = surfaceArea(nodes[leaves[i]].box);
+            if(!nodes[leaves[i]].is_leaf && area>bestArea)
+            {
+                best = i;
+                bestArea = area;
+            }
+        }
+        if(best<0)
+            break;
+        int id = leaves[best];
+        currentCost += bestArea;
+        pairs[nbPairs++] = nodes[id].first_child_id;
+        leaves[best] = nodes[id].first_child_id;
+        leaves[nbLeaves++] = nodes[id].first_child_id+1;
+    }
+    if(nbLeaves < 3)
+        return false;
+
+    // find the topology of minimal cost by dynamic programming over the subsets of leaves,
+    // the cost of the subtrees below the leaves being the same for all of them
+    TreeletSubsets subsets;
+    const int full = (1<<nbLeaves) - 1;
+    for(int s=1; s<=full; ++s)
+    {
+        subsets.boxes[s].setNull();
+        for(int i=0; i<nbLeaves; ++i)
+            if(s & (1<<i))
+                subsets.boxes[s].extend(nodes[leaves[i]].box);
+        subsets.costs[s] = 0.f;
+        subsets.partitions[s] = 0;
+        if((s & (s-1))==0)
+            continue;
+        // each partition is enumerated once, as the part containing the lowest leaf of s
+        int lowest = s & -s;
+        float best = std::numeric_limits<float>::max();
+        for(int p=(s-1)&s; p>0; p=(p-1)&s)
+        {
+            if(!(p & lowest))
+                continue;
+            float cost = subsets.costs[p] + subsets.costs[s^p];
+            if(cost < best)
+            {
+                best = cost;
+                subsets.partitions[s] = p;
+            }
+        }
+        subsets.costs[s] = surfaceArea(subsets.boxes[s]) + best;
+    }
+    if(subsets.costs[full] >= currentCost * (1.f - 1e-5f))
+        return false;
+
+    // rebuild the treelet in depth-first order, such that the pairs of children follow their parent
+    Node leafNodes[TreeletSubsets::MAX_LEAVES];
+    for(int i=0; i<nbLeaves; ++i)
+        leafNodes[i] = nodes[leaves[i]];
+    std::sort(pairs, pairs+nbPairs);
+    int stack[TreeletSubsets::MAX_LEAVES*2][2];    // (subset, node id)
+    int stackSize = 0, nextPair = 0;
+    stack[stackSize][0] = full;
+    stack[stackSize++][1] = nodeId;
+    while(stackSize>0)
+    {
+        --stackSize;
+        int s = stack[stackSize][0];
+        int id = stack[stackSize][1];
+        if((s & (s-1))==0)
+        {
+            int i = 0;
+            while(!(s & (1<<i))) ++i;
+            nodes[id] = leafNodes[i];
+            continue;
+        }
+        Node& node = nodes[id];
+        node.is_leaf = false;
+        node.box = subsets.boxes[s];
+        node.first_child_id = pairs[nextPair++];
+        int p = subsets.partitions[s];
+        // the first child is popped first
+        stack[stackSize][0] = s^p;
+        stack[stackSize++][1] = node.first_child_id+1;
+        stack[stackSize][0] = p;
+        stack[stackSize++][1] = node.first_child_id;
+    }
+    return true;
+}
+
+void BVH::layoutNode(int nodeId, std::vector<Node>& nodes, int newId) const
+{
+    const Node& node = mNodes[nodeId];
+    nodes[newId] = node;
+    if(node.is_leaf)
+        return;
+    int child_id = nodes[newId].first_child_id = nodes.size();
+    nodes.resize(nodes.size()+2);
+    layoutNode(node.first_child_id,   nodes, child_id);
+    layoutNode(node.first_child_id+1, nodes, child_id+1);
+}
+
+/// \returns the number of leading zero bits of \a x, which must not be 0
+static inline int countLeadingZeros(unsigned long long x)
+{
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    for(; !(x & (1ULL<<63)); x <<= 1) ++n;
+    return n;
+#endif
+}
+
+/// spreads the 21 lowest bits of \a x such that there are two zero bits between them
+static inline unsigned long long spreadBits(unsigned long long x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fULL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2)  & 0x1249249249249249ULL;
+    return x;
+}
+
+/** Sorts \a keys, and \a values accordingly, by a parallel LSD radix sort on the \a nbBits lowest bits of the keys.
+  * The input is split into blocks, each of them being counted and scattered by a single thread. */
+static void radixSort(std::vector<unsigned long long>& keys, std::vector<int>& values, int nbBits)
+{
+    const int n = keys.size();
+    const int nbBlocks = std::max(1, std::min(64, n/16384));
+    const int blockSize = (n + nbBlocks-1) / nbBlocks;
+    std::vector<unsigned long long> tmpKeys(n);
+    std::vector<int> tmpValues(n);
+    std::vector<int> offsets(256*nbBlocks);
+    for(int shift=0; shift<nbBits; shift+=8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+#pragma omp parallel for
+        for(int b=0; b<nbBlocks; ++b)
+        {
+            int* count = &offsets[256*b];
+            for(int i=b*blockSize; i<std::min(n, (b+1)*blockSize); ++i)
+                ++count[(keys[i] >> shift) & 0xff];
+        }
+        // the digits are ordered before the blocks, such that the sort is stable
+        int sum = 0;
+        for(int d=0; d<256; ++d)
+            for(int b=0; b<nbBlocks; ++b)
+            {
+                int c = offsets[256*b+d];
+                offsets[256*b+d] = sum;
+                sum += c;
+            }
+#pragma omp parallel for
+        for(int b=0; b<nbBlocks; ++b)
+        {
+            int* offset = &offsets[256*b];
+            for(int i=b*blockSize; i<std::min(n, (b+1)*blockSize); ++i)
+            {
+                int dst = offset[(keys[i] >> shift) & 0xff]++;
+                tmpKeys[dst] = keys[i];
+                tmpValues[dst] = values[i];
+            }
+        }
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+    }
+}
+
+/** \returns the length of the common prefix of the sorted keys \a i and \a j, or -1 if \a j is out of range.
+  * Duplicate keys are distinguished by their index. */
+static inline int commonPrefix(const std::vector<unsigned long long>& keys, int i, int j)
+{
+    if(j<0 || j>=int(keys.size()))
+        return -1;
+    unsigned long long x = keys[i] ^ keys[j];
+    if(x==0)
+        return 64 + countLeadingZeros((unsigned long long)(i ^ j));
+    return countLeadingZeros(x);
+}
+
+void BVH::buildLinear(const Mesh* pMesh, int maxLeafSize, int mortonBits)
+{
+    SIRE_TRACE_ZONE("BVH::buildLinear");
+    mpMesh = pMesh;
+    mSettings = BuildSettings();
+    mSettings.method = LINEAR;
+    mSettings.maxLeafSize = maxLeafSize;
+    mSettings.maxDepth = mortonBits;
+    mNodes.clear();
+    mCompressedNodes.clear();
+    mFaces.clear();
+    mFile.close();
+    maxLeafSize = std::max(1, std::min(maxLeafSize, 65535));
+    const int n = mpMesh->nbFaces();
+    const int bitsPerAxis = mortonBits>30 ? 21 : 10;
+
+    // quantize the centroids relative to their bounding box
+    mCentroids.resize(n);
+#pragma omp parallel for
+    for(int i=0; i<n; ++i)
+        mCentroids[i] = (mpMesh->positionOfFace(i, 0) + mpMesh->positionOfFace(i, 1) + mpMesh->positionOfFace(i, 2))/3.f;
+    Eigen::AlignedBox3f bounds;
+    bounds.setNull();
+    for(int i=0; i<n; ++i)
+        bounds.extend(mCentroids[i]);
+    const int maxValue = (1<<bitsPerAxis) - 1;
+    Eigen::Array3f scale = float(maxValue) / (bounds.max() - bounds.min()).array().max(std::numeric_limits<float>::min());
+    std::vector<unsigned long long> codes(n);
+    std::vector<int> faces(n);
+#pragma omp parallel for
+    for(int i=0; i<n; ++i)
+    {
+        Eigen::Array3f q = ((mCentroids[i] - bounds.min()).array() * scale).min(float(maxValue));
+        codes[i] = (spreadBits((unsigned long long)(q.x())) << 2) | (spreadBits((unsigned long long)(q.y())) << 1)
+                 | spreadBits((unsigned long long)(q.z()));
+        faces[i] = i;
+    }
+    std::vector<Eigen::Vector3f>().swap(mCentroids);
+    radixSort(codes, faces, 3*bitsPerAxis);
+
+    // the internal node i covers a range of sorted faces starting or ending at i, which is split after splits[i]
+    std::vector<int> splits(std::max(n-1, 0));
+#pragma omp parallel for
+    for(int i=0; i<n-1; ++i)
+    {
+        // direction of the range
+        int d = commonPrefix(codes, i, i+1) > commonPrefix(codes, i, i-1) ? 1 : -1;
+        // find the other end of the range by exponential and then binary search
+        int minPrefix = commonPrefix(codes, i, i-d);
+        int maxLength = 2;
+        while(commonPrefix(codes, i, i+maxLength*d) > minPrefix)
+            maxLength *= 2;
+        int length = 0;
+        for(int t=maxLength/2; t>=1; t/=2)
+            if(commonPrefix(codes, i, i+(length+t)*d) > minPrefix)
+                length += t;
+        int nodePrefix = commonPrefix(codes, i, i+length*d);
+        // find the split position by binary search
+        int s = 0;
+        for(int t=(length+1)/2; ; t=(t+1)/2)
+        {
+            if(commonPrefix(codes, i, i+(s+t)*d) > nodePrefix)
+                s += t;
+            if(t==1)
+                break;
+        }
+        splits[i] = i + s*d + std::min(d, 0);
+    }
+
+    mFaces.swap(faces);
+    mNodes.reserve(2*(n/maxLeafSize) + 1);
+    mNodes.resize(1);
+    emitLinearNode(0, 0, n-1, 0, splits, maxLeafSize);
+    refitNodes();
+    gatherTriangles();
+    mReferenceCost = sahCost();
+}
+
+void BVH::emitLinearNode(int nodeId, int first, int last, int internalId, const std::vector<int>& splits, int maxLeafSize)
+{
+    Node& node = mNodes[nodeId];
+    if(last-first+1 <= maxLeafSize)
+    {
+        node.is_leaf = true;
+        node.first_face_id = first;
+        node.nb_faces = last-first+1;
+        return;
+    }
+    node.is_leaf = false;
+    int split = splits[internalId];
+    int child_id = node.first_child_id = mNodes.size();
+    mNodes.resize(mNodes.size()+2);
+    // node is not a valid reference anymore !
+
+    // the children covering more than one face are the internal nodes split and split+1
+    emitLinearNode(child_id,   first, split, split, splits, maxLeafSize);
+    emitLinearNode(child_id+1, split+1, last, split+1, splits, maxLeafSize);
+}
+
+/// number of bins used to evaluate the object and spatial splits of buildSpatial()
+enum { OBJECT_SPLIT_BINS = 32, SPATIAL_SPLIT_BINS = 16 };
+/// spatial splits are only tried if the overlap of the object split is larger than this fraction of the root area
+static const float s_spatialSplitMinOverlap = 1e-5f;
+
+/// a split evaluated by buildSpatialNode()
+struct SplitCandidate
+{
+    SplitCandidate() : cost(std::numeric_limits<float>::max()), dim(-1), pos(0.f) {}
+    bool isValid() const { return dim>=0; }
+    float cost;
+    int dim;
+    float pos;  ///< plane of a spatial split, or first bin of the right child of an object split
+};
+
+void BVH::buildSpatial(const Mesh* pMesh, int maxLeafSize, float memoryBudget)
+{
+    SIRE_TRACE_ZONE("BVH::buildSpatial");
+    mpMesh = pMesh;
+    mSettings = BuildSettings();
+    mSettings.method = SPATIAL;
+    mSettings.maxLeafSize = maxLeafSize;
+    mSettings.spatialBudget = memoryBudget;
+    mNodes.clear();
+    mCompressedNodes.clear();
+    mFaces.clear();
+    mFile.close();
+    const int n = mpMesh->nbFaces();
+
+    std::vector<Reference> refs(n);
+    Eigen::AlignedBox3f rootBox;
+    rootBox.setNull();
+    for(int i=0; i<n; ++i)
+    {
+        refs[i].face = i;
+        refs[i].box.setNull();
+        for(int k=0; k<3; ++k)
+            refs[i].box.extend(mpMesh->positionOfFace(i, k));
+        rootBox.extend(refs[i].box);
+    }
+
+    SpatialBuild state;
+    state.maxLeafSize = std::max(1, std::min(maxLeafSize, 65535));
+    state.maxReferences = size_t(n * (1.f + std::max(0.f, memoryBudget)));
+    state.nbReferences = n;
+    state.rootArea = surfaceArea(rootBox);
+    mFaces.reserve(state.maxReferences);
+    mNodes.resize(1);
+    buildSpatialNode(0, refs, 0, state);
+    gatherTriangles();
+    mReferenceCost = sahCost();
+}
+
+void BVH::splitReference(const Reference& ref, int dim, float pos, Reference& left, Reference& right) const
+{
+    left.face = right.face = ref.face;
+    left.box.setNull();
+    right.box.setNull();
+    Eigen::Vector3f v[3];
+    for(int k=0; k<3; ++k)
+        v[k] = mpMesh->positionOfFace(ref.face, k);
+    for(int k=0; k<3; ++k)
+    {
+        const Eigen::Vector3f& a = v[k];
+        const Eigen::Vector3f& b = v[(k+1)%3];
+        if(a[dim] <= pos) left.box.extend(a);
+        if(a[dim] >= pos) right.box.extend(a);
+        // the edge crosses the plane
+        if((a[dim] < pos && b[dim] > pos) || (a[dim] > pos && b[dim] < pos))
+        {
+            Eigen::Vector3f p = a + (pos - a[dim]) / (b[dim] - a[dim]) * (b - a);
+            p[dim] = pos;
+            left.box.extend(p);
+            right.box.extend(p);
+        }
+    }
+    left.box = left.box.intersection(ref.box);
+    right.box = right.box.intersection(ref.box);
+}
+
+void BVH::buildSpatialNode(int nodeId, std::vector<Reference>& refs, int level, SpatialBuild& state)
+{
+    const int n = refs.size();
+    Eigen::AlignedBox3f aabb, centroids;
+    aabb.setNull();
+    centroids.setNull();
+    for(int i=0; i<n; ++i)
+    {
+        aabb.extend(refs[i].box);
+        centroids.extend(refs[i].box.center());
+    }
+    mNodes[nodeId].box = aabb;
+    const float area = surfaceArea(aabb);
+
+    // the costs are relative to the area of the node, with a cost of 1 per traversal and per intersection
+    SplitCandidate objectSplit, spatialSplit;
+    Eigen::AlignedBox3f objectLeft, objectRight;
+    if(n>1 && level<64 && area>0)
+    {
+        // object splits, binning the references by their centroid
+        for(int dim=0; dim<3; ++dim)
+        {
+            float extent = centroids.max()[dim] - centroids.min()[dim];
+            if(extent<=0)
+                continue;
+            float scale = OBJECT_SPLIT_BINS / extent;
+            int counts[OBJECT_SPLIT_BINS] = { 0 };
+            Eigen::AlignedBox3f boxes[OBJECT_SPLIT_BINS];
+            for(int b=0; b<OBJECT_SPLIT_BINS; ++b)
+                boxes[b].setNull();
+            for(int i=0; i<n; ++i)
+            {
+                int b = std::min(OBJECT_SPLIT_BINS-1, int((refs[i].box.center()[dim] - centroids.min()[dim]) * scale));
+                ++counts[b];
+                boxes[b].extend(refs[i].box);
+            }
+            // sweep from the right, and then evaluate the planes from the left
+            Eigen::AlignedBox3f rightBoxes[OBJECT_SPLIT_BINS];
+            int rightCounts[OBJECT_SPLIT_BINS];
+            rightBoxes[OBJECT_SPLIT_BINS-1] = boxes[OBJECT_SPLIT_BINS-1];
+            rightCounts[OBJECT_SPLIT_BINS-1] = counts[OBJECT_SPLIT_BINS-1];
+            for(int b=OBJECT_SPLIT_BINS-2; b>=0; --b)
+            {
+                rightBoxes[b] = rightBoxes[b+1];
+                rightBoxes[b].extend(boxes[b]);
+                rightCounts[b] = rightCounts[b+1] + counts[b];
+            }
+            Eigen::AlignedBox3f leftBox;
+            leftBox.setNull();
+            int leftCount = 0;
+            for(int b=1; b<OBJECT_SPLIT_BINS; ++b)
+            {
+                leftBox.extend(boxes[b-1]);
+                leftCount += counts[b-1];
+                if(leftCount==0 || rightCounts[b]==0)
+                    continue;
+                float cost = 1.f + (surfaceArea(leftBox)*leftCount + surfaceArea(rightBoxes[b])*rightCounts[b]) / area;
+                if(cost < objectSplit.cost)
+                {
+                    objectSplit.cost = cost;
+                    objectSplit.dim = dim;
+                    objectSplit.pos = b;
+                    objectLeft = leftBox;
+                    objectRight = rightBoxes[b];
+                }
+            }
+        }
+
+        // spatial splits, only if the children of the object split overlap and the memory budget is not exhausted
+        float overlap = objectSplit.isValid() ? surfaceArea(objectLeft.intersection(objectRight)) : state.rootArea;
+        if(overlap > s_spatialSplitMinOverlap * state.rootArea && state.nbReferences < state.maxReferences && n > state.maxLeafSize)
+        {
+            for(int dim=0; dim<3; ++dim)
+            {
+                float extent = aabb.max()[dim] - aabb.min()[dim];
+                if(extent<=0)
+                    continue;
+                float binSize = extent / SPATIAL_SPLIT_BINS;
+                int entries[SPATIAL_SPLIT_BINS] = { 0 }, exits[SPATIAL_SPLIT_BINS] = { 0 };
+                Eigen::AlignedBox3f boxes[SPATIAL_SPLIT_BINS];
+                for(int b=0; b<SPATIAL_SPLIT_BINS; ++b)
+                    boxes[b].setNull();
+                for(int i=0; i<n; ++i)
+                {
+                    int first = std::max(0, std::min(SPATIAL_SPLIT_BINS-1, int((refs[i].box.min()[dim] - aabb.min()[dim]) / binSize)));
+                    int last  = std::max(first, std::min(SPATIAL_SPLIT_BINS-1, int((refs[i].box.max()[dim] - aabb.min()[dim]) / binSize)));
+                    ++entries[first];
+                    ++exits[last];
+                    // clip the reference by the planes of the bins it overlaps
+                    Reference current = refs[i], left, right;
+                    for(int b=first; b<last; ++b)
+                    {
+                        splitReference(current, dim, aabb.min()[dim] + (b+1)*binSize, left, right);
+                        boxes[b].extend(left.box);
+                        current = right;
+                    }
+                    boxes[last].extend(current.box);
+                }
+                Eigen::AlignedBox3f rightBoxes[SPATIAL_SPLIT_BINS];
+                int rightCounts[SPATIAL_SPLIT_BINS];
+                rightBoxes[SPATIAL_SPLIT_BINS-1] = boxes[SPATIAL_SPLIT_BINS-1];
+                rightCounts[SPATIAL_SPLIT_BINS-1] = exits[SPATIAL_SPLIT_BINS-1];
+                for(int b=SPATIAL_SPLIT_BINS-2; b>=0; --b)
+                {
+                    rightBoxes[b] = rightBoxes[b+1];
+                    rightBoxes[b].extend(boxes[b]);
+                    rightCounts[b] = rightCounts[b+1] + exits[b];
+                }
+                Eigen::AlignedBox3f leftBox;
+                leftBox.setNull();
+                int leftCount = 0;
+                for(int b=1; b<SPATIAL_SPLIT_BINS; ++b)
+                {
+                    leftBox.extend(boxes[b-1]);
+                    leftCount += entries[b-1];
+                    // the references straddling the plane are duplicated, which must fit within the budget
+                    if(leftCount==0 || rightCounts[b]==0 || state.nbReferences + (leftCount + rightCounts[b] - n) > state.maxReferences)
+                        continue;
+                    float cost = 1.f + (surfaceArea(leftBox)*leftCount + surfaceArea(rightBoxes[b])*rightCounts[b]) / area;
+                    if(cost < spatialSplit.cost)
+                    {
+                        spatialSplit.cost = cost;
+                        spatialSplit.dim = dim;
+                        spatialSplit.pos = aabb.min()[dim] + b*binSize;
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<Reference> left, right;
+    if(spatialSplit.isValid() && spatialSplit.cost < objectSplit.cost
+        && (n > state.maxLeafSize || spatialSplit.cost < n))
+    {
+        int dim = spatialSplit.dim;
+        float pos = spatialSplit.pos;
+        for(int i=0; i<n; ++i)
+        {
+            if(refs[i].box.max()[dim] <= pos)
+                left.push_back(refs[i]);
+            else if(refs[i].box.min()[dim] >= pos)
+                right.push_back(refs[i]);
+            else
+            {
+                Reference l, r;
+                splitReference(refs[i], dim, pos, l, r);
+                if(!l.box.isEmpty()) left.push_back(l);
+                if(!r.box.isEmpty()) right.push_back(r);
+            }
+        }
+        // the clipping may classify the references slightly differently than the bins
+        if(left.empty() || right.empty() || state.nbReferences + (left.size() + right.size() - n) > state.maxReferences)
+        {
+            left.clear();
+            right.clear();
+        }
+    }
+    if(left.empty() && objectSplit.isValid() && (n > state.maxLeafSize || objectSplit.cost < n))
+    {
+        int dim = objectSplit.dim;
+        float scale = OBJECT_SPLIT_BINS / (centroids.max()[dim] - centroids.min()[dim]);
+        for(int i=0; i<n; ++i)
+        {
+            int b = std::min(OBJECT_SPLIT_BINS-1, int((refs[i].box.center()[dim] - centroids.min()[dim]) * scale));
+            (b < objectSplit.pos ? left : right).push_back(refs[i]);
+        }
+    }
+    if(left.empty() && n > 65535)
+    {
+        // too many references for a leaf, which can only happen if all of them have the same centroid
+        left.assign(refs.begin(), refs.begin() + n/2);
+        right.assign(refs.begin() + n/2, refs.end());
+    }
+
+    if(left.empty())
+    {
+        // we got a leaf !
+        Node& node = mNodes[nodeId];
+        node.is_leaf = true;
+        node.first_face_id = mFaces.size();
+        node.nb_faces = n;
+        for(int i=0; i<n; ++i)
+            mFaces.push_back(refs[i].face);
+        std::vector<Reference>().swap(refs);
+        return;
+    }
+
+    state.nbReferences += left.size() + right.size() - n;
+    std::vector<Reference>().swap(refs);
+    mNodes[nodeId].is_leaf = false;
+    int child_id = mNodes[nodeId].first_child_id = mNodes.size();
+    mNodes.resize(mNodes.size()+2);
+    buildSpatialNode(child_id,   left,  level+1, state);
+    buildSpatialNode(child_id+1, right, level+1, state);
+}
+
+void BVH::releaseFaceList()
+{
+    mFaces.clear();
+    std::vector<Eigen::Vector3f>().swap(mTriangles);
+    updateMemoryAccount();
+}
+
+void BVH::refit()
+{
+    SIRE_TRACE_ZONE("BVH::refit");
+    if(hasCompressedNodes())
+    {
+        // the tree is expanded back, refitted, and quantized again relative to the new boxes
+        mNodes.resize(1);
+        decompressNode(0, 0);
+        mCompressedNodes.clear();
+        refitNodes();
+        compressNodes();
+    }
+    else if(!mNodes.empty())
+        refitNodes();
+    gatherTriangles();
+}
+
+void BVH::refitNodes()
+{
+    Node* nodes = mNodes.data();
+    int nbNodes = mNodes.size();
+#pragma omp parallel for schedule(dynamic, 64)
+    for(int n=0; n<nbNodes; ++n)
+    {
+        Node& node = nodes[n];
+        if(!node.is_leaf)
+            continue;
+        Eigen::AlignedBox3f aabb;
+        aabb.setNull();
+        for(int i=node.first_face_id; i<node.first_face_id+node.nb_faces; ++i)
+            for(int k=0; k<3; ++k)
+                aabb.extend(mpMesh->positionOfFace(faceAt(i), k));
+        node.box = aabb;
+    }
+    // the children of a node are created after it, so that a reverse order visits them first
+    for(int n=nbNodes-1; n>=0; --n)
+    {
+        Node& node = nodes[n];
+        if(node.is_leaf)
+            continue;
+        node.box = nodes[node.first_child_id].box;
+        node.box.extend(nodes[node.first_child_id+1].box);
+    }
+}
+
+float BVH::sahCost() const
+{
+    float rootArea;
+    double cost = 0;
+    if(hasCompressedNodes())
+    {
+        rootArea = surfaceArea(mRootBox);
+        cost = compressedSAHCost(0, mRootBox);
+    }
+    else
+    {
+        const NodeList& nodes = mNodes;
+        if(nodes.empty())
+            return 0.f;
+        rootArea = surfaceArea(nodes[0].box);
+        for(size_t n=0; n<nodes.size(); ++n)
+            cost += surfaceArea(nodes[n].box) * (nodes[n].is_leaf ? nodes[n].nb_faces : 1);
+    }
+    return rootArea>0 ? float(cost / rootArea) : 0.f;
+}
+
+float BVH::compressedSAHCost(int nodeId, const Eigen::AlignedBox3f& box) const
+{
+    const CompressedNode& node = mCompressedNodes[nodeId];
+    float cost = surfaceArea(box);
+    for(int k=0; k<2; ++k)
+    {
+        Eigen::AlignedBox3f childBox = decodeBox(node, k, box);
+        if(node.child[k]<0)
+            cost += surfaceArea(childBox) * node.nb_faces[k];
+        else
+            cost += compressedSAHCost(node.child[k], childBox);
+    }
+    return cost;
+}
+
+void BVH::compressNodes()
+{
+    SIRE_TRACE_ZONE("BVH::compressNodes");
+    const NodeList& nodes = mNodes;
+    if(nodes.empty() || nodes[0].is_leaf)
+        return;
+    mRootBox = nodes[0].box;
+    mCompressedNodes.clear();
+    // each inner node has two children
+    mCompressedNodes.reserve(nodes.size()/2);
+    mCompressedNodes.resize(1);
+    compressNode(0, 0, mRootBox);
+    mNodes.clear();
+    updateMemoryAccount();
+}
+
+void BVH::compressNode(int nodeId, int compressedId, const Eigen::AlignedBox3f& box)
+{
+    const NodeList& nodes = mNodes;
+    const Node& node = nodes[nodeId];
+    Eigen::Array3f scale = (box.max() - box.min()).array() * (1.f/255.f);
+    for(int k=0; k<2; ++k)
+    {
+        const Node& child = nodes[node.first_child_id+k];
+        CompressedNode& c = mCompressedNodes[compressedId];
+        for(int i=0; i<3; ++i)
+        {
+            int qmin = 0, qmax = 255;
+            if(scale[i]>0)
+            {
+                qmin = std::max(0, std::min(255, int(std::floor((child.box.min()[i] - box.min()[i]) / scale[i]))));
+                qmax = std::max(0, std::min(255, int(std::ceil ((child.box.max()[i] - box.min()[i]) / scale[i]))));
+            }
+            c.qmin[k][i] = qmin;
+            c.qmax[k][i] = qmax;
+        }
+        // the decoding may still round the bounds inward by an ulp
+        Eigen::AlignedBox3f decoded = decodeBox(c, k, box);
+        for(int i=0; i<3; ++i)
+        {
+            while(c.qmin[k][i]>0 && decoded.min()[i]>child.box.min()[i])
+            {
+                --c.qmin[k][i];
+                decoded = decodeBox(c, k, box);
+            }
+            while(c.qmax[k][i]<255 && decoded.max()[i]<child.box.max()[i])
+            {
+                ++c.qmax[k][i];
+                decoded = decodeBox(c, k, box);
+            }
+        }
+
+        if(child.is_leaf)
+        {
+            c.child[k] = ~child.first_face_id;
+            c.nb_faces[k] = child.nb_faces;
+        }
+        else
+        {
+            int id = mCompressedNodes.size();
+            c.child[k] = id;
+            c.nb_faces[k] = 0;
+            mCompressedNodes.resize(id+1);
+            // c is not a valid reference anymore !
+            compressNode(node.first_child_id+k, id, decoded);
+        }
+    }
+}
+
+void BVH::decompressNode(int compressedId, int nodeId)
+{
+    const CompressedNode& c = mCompressedNodes[compressedId];
+    int child_id = mNodes.size();
+    mNodes[nodeId].is_leaf = false;
+    mNodes[nodeId].first_child_id = child_id;
+    mNodes.resize(mNodes.size()+2);
+    for(int k=0; k<2; ++k)
+    {
+        if(c.child[k]<0)
+        {
+            Node& child = mNodes[child_id+k];
+            child.is_leaf = true;
+            child.first_face_id = ~c.child[k];
+            child.nb_faces = c.nb_faces[k];
+        }
+        else
+            decompressNode(c.child[k], child_id+k);
+    }
+}
+
+void BVH::gatherTriangles()
+{
+    std::vector<Eigen::Vector3f>().swap(mTriangles);
+    // a private copy of the triangles would defeat the sharing of an attached tree
+    if(mGatherTriangles && !mFaces.empty() && !isAttached())
+    {
+        mTriangles.resize(3*mFaces.size());
+        int nbFaces = mFaces.size();
+#pragma omp parallel for
+        for(int i=0; i<nbFaces; ++i)
+            for(int k=0; k<3; ++k)
+                mTriangles[3*i+k] = mpMesh->positionOfFace(mFaces[i], k);
+    }
+    // all the builds, refits and attachments end here
+    updateMemoryAccount();
+}
+
+void BVH::updateMemoryAccount()
+{
+    mMemory.set(mNodes.memoryFootprint() + mFaces.memoryFootprint() + mCompressedNodes.memoryFootprint()
+              + (mCentroids.capacity() + mTriangles.capacity())*sizeof(Eigen::Vector3f));
+}
+
+/// header of the serialized BVH, followed by the nodes and the face list
+struct BVHDataHeader
+{
+    enum { VERSION = 3 };
+
+    char magic[8];                  ///< "SIRE_BVH"
+    int version;
+    int nodeSize;                   ///< sizeof(BVH::Node), to detect incompatible builds
+    int nbNodes;
+    int nbFaces;
+    int buildMethod;                ///< BVH::BuildSettings the tree has been built with
+    int maxLeafSize;
+    int maxDepth;
+    int optimizationPasses;
+    float spatialBudget;
+    int padding;
+    unsigned long long meshHash;    ///< hash of the geometry the BVH has been built for
+};
+
+static const char s_bvhMagic[8] = { 'S', 'I', 'R', 'E', '_', 'B', 'V', 'H' };
+
+bool BVH::write(FILE* f, unsigned long long meshHash) const
+{
+    if(hasCompressedNodes())
+    {
+        std::cerr << "BVH::write: compressed nodes cannot be written" << std::endl;
+        return false;
+    }
+    BVHDataHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_bvhMagic, 8);
+    header.version = BVHDataHeader::VERSION;
+    header.nodeSize = sizeof(Node);
+    header.nbNodes = mNodes.size();
+    header.nbFaces = mFaces.size();
+    header.buildMethod = mSettings.method;
+    header.maxLeafSize = mSettings.maxLeafSize;
+    header.maxDepth = mSettings.maxDepth;
+    header.optimizationPasses = mSettings.optimizationPasses;
+    header.spatialBudget = mSettings.spatialBudget;
+    header.meshHash = meshHash;
+    return fwrite(&header, sizeof(header), 1, f)==1
+        && fwrite(mNodes.data(), sizeof(Node), mNodes.size(), f)==mNodes.size()
+        && fwrite(mFaces.data(), sizeof(int), mFaces.size(), f)==mFaces.size();
+}
+
+size_t BVH::attach(const Mesh* pMesh, const char* data, size_t size, unsigned long long meshHash)
+{
+    if(size < sizeof(BVHDataHeader))
+        return 0;
+    const BVHDataHeader* header = reinterpret_cast<const BVHDataHeader*>(data);
+    size_t total = sizeof(BVHDataHeader) + size_t(header->nbNodes)*sizeof(Node) + size_t(header->nbFaces)*sizeof(int);
+    if(memcmp(header->magic, s_bvhMagic, 8)!=0
+            || header->version!=BVHDataHeader::VERSION
+            || header->nodeSize!=int(sizeof(Node))
+            || header->meshHash!=meshHash
+            || header->nbNodes<=0 || header->nbFaces<0 || total>size
+            || header->buildMethod<MIDPOINT || header->buildMethod>SPATIAL)
+        return 0;
+
+    // the traversal does not check the indices, they must not lead out of the arrays
+    const Node* nodes = reinterpret_cast<const Node*>(data + sizeof(BVHDataHeader));
+    const int* faces = reinterpret_cast<const int*>(data + sizeof(BVHDataHeader) + size_t(header->nbNodes)*sizeof(Node));
+    const int nbNodes = header->nbNodes, nbFaces = header->nbFaces, nbMeshFaces = pMesh->nbFaces();
+    // without face list, the leaves refer directly to the faces of the mesh
+    const long long nbLeafFaces = nbFaces>0 ? nbFaces : nbMeshFaces;
+    int nbErrors = 0;
+#pragma omp parallel for reduction(+:nbErrors)
+    for(int i=0; i<nbNodes; ++i)
+    {
+        // the children are stored after their parent, which also excludes cycles
+        if(nodes[i].is_leaf ? nodes[i].first_face_id<0 || (long long)nodes[i].first_face_id + nodes[i].nb_faces > nbLeafFaces
+                            : nodes[i].first_child_id<=i || nodes[i].first_child_id>=nbNodes-1)
+            ++nbErrors;
+    }
+#pragma omp parallel for reduction(+:nbErrors)
+    for(int i=0; i<nbFaces; ++i)
+        if(faces[i]<0 || faces[i]>=nbMeshFaces)
+            ++nbErrors;
+    if(nbErrors!=0)
+        return 0;
+
+    mpMesh = pMesh;
+    mCentroids.clear();
+    mCompressedNodes.clear();
+    mNodes.setExternal(nodes, nbNodes);
+    mFaces.setExternal(faces, nbFaces);
+    mSettings.method = BuildMethod(header->buildMethod);
+    mSettings.maxLeafSize = header->maxLeafSize;
+    mSettings.maxDepth = header->maxDepth;
+    mSettings.optimizationPasses = header->optimizationPasses;
+    mSettings.spatialBudget = header->spatialBudget;
+    gatherTriangles();
+    mReferenceCost = sahCost();
+    return total;
+}
+
+bool BVH::save(const std::string& filename, unsigned long long meshHash) const
+{
+    SIRE_TRACE_ZONE("BVH::save");
+    // the temporary name is specific to the process, since several processes may write the same file concurrently
+    std::ostringstream tmpName;
+    tmpName << filename << ".tmp" << getpid();
+    FILE* f = fopen(tmpName.str().c_str(), "wb");
+    if(!f)
+        return false;
+    bool ok = write(f, meshHash);
+    ok = (fclose(f)==0) && ok;
+    if(!ok || rename(tmpName.str().c_str(), filename.c_str())!=0)
+    {
+        std::cerr << "BVH: unable to write " << filename << std::endl;
+        remove(tmpName.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool BVH::load(const Mesh* pMesh, const std::string& filename, unsigned long long meshHash, const BuildSettings& settings)
+{
+    SIRE_TRACE_ZONE("BVH::load");
+    mNodes.clear();
+    mFaces.clear();
+    mFile.close();
+    if(!mFile.open(filename))
+        return false;
+    if(attach(pMesh, mFile.data(), mFile.size(), meshHash)==0)
+    {
+        std::cerr << "BVH: " << filename << " is not valid for this mesh" << std::endl;
+        mFile.close();
+        return false;
+    }
+    if(mSettings!=settings)
+    {
+        std::cerr << "BVH: " << filename << " has been built with other settings" << std::endl;
+        mNodes.clear();
+        mFaces.clear();
+        mFile.close();
+        return false;
+    }
+    return true;
+}
+
+BVH::Statistics BVH::statistics() const
+{
+    Statistics stats;
+    stats.nbNodes = stats.nbLeaves = stats.nbReferences = stats.maxDepth = 0;
+    stats.siblingOverlap = 0.f;
+    stats.sahCost = sahCost();
+    if(hasCompressedNodes())
+        compressedNodeStatistics(0, mRootBox, 0, stats);
+    else if(!mNodes.empty())
+        nodeStatistics(0, 0, stats);
+    int nbInnerNodes = stats.nbNodes - stats.nbLeaves;
+    if(nbInnerNodes>0)
+        stats.siblingOverlap /= nbInnerNodes;
+    stats.memory = (mNodes.isExternal() ? mNodes.size()*sizeof(Node) : mNodes.memoryFootprint())
+                 + (mFaces.isExternal() ? mFaces.size()*sizeof(int) : mFaces.memoryFootprint())
+                 + mCompressedNodes.memoryFootprint() + mTriangles.capacity()*sizeof(Eigen::Vector3f);
+    return stats;
+}
+
+void BVH::leafStatistics(int nbFaces, int depth, Statistics& stats)
+{
+    ++stats.nbNodes;
+    ++stats.nbLeaves;
+    stats.nbReferences += nbFaces;
+    stats.maxDepth = std::max(stats.maxDepth, depth);
+    if(int(stats.depthHistogram.size()) <= depth)
+        stats.depthHistogram.resize(depth+1, 0);
+    ++stats.depthHistogram[depth];
+    // bins of 0, 1, 2, 3-4, 5-8... faces
+    int bin = 0;
+    while(bin<32 && nbFaces > (bin==0 ? 0 : 1<<(bin-1)))
+        ++bin;
+    if(int(stats.leafSizeHistogram.size()) <= bin)
+        stats.leafSizeHistogram.resize(bin+1, 0);
+    ++stats.leafSizeHistogram[bin];
+}
+
+void BVH::nodeStatistics(int nodeId, int depth, Statistics& stats) const
+{
+    const Node& node = mNodes[nodeId];
+    if(node.is_leaf)
+    {
+        leafStatistics(node.nb_faces, depth, stats);
+        return;
+    }
+    ++stats.nbNodes;
+    const Eigen::AlignedBox3f& left = mNodes[node.first_child_id].box;
+    const Eigen::AlignedBox3f& right = mNodes[node.first_child_id+1].box;
+    float area = surfaceArea(node.box);
+    if(area>0)
+        stats.siblingOverlap += surfaceArea(left.intersection(right)) / area;
+    nodeStatistics(node.first_child_id,   depth+1, stats);
+    nodeStatistics(node.first_child_id+1, depth+1, stats);
+}
+
+void BVH::compressedNodeStatistics(int nodeId, const Eigen::AlignedBox3f& box, int depth, Statistics& stats) const
+{
+    const CompressedNode& node = mCompressedNodes[nodeId];
+    ++stats.nbNodes;
+    Eigen::AlignedBox3f boxes[2] = { decodeBox(node, 0, box), decodeBox(node, 1, box) };
+    float area = surfaceArea(box);
+    if(area>0)
+        stats.siblingOverlap += surfaceArea(boxes[0].intersection(boxes[1])) / area;
+    for(int k=0; k<2; ++k)
+    {
+        if(node.child[k]<0)
+            leafStatistics(node.nb_faces[k], depth+1, stats);
+        else
+            compressedNodeStatistics(node.child[k], boxes[k], depth+1, stats);
+    }
+}
+
+void BVH::printStatistics(std::ostream& out) const
+{
+    Statistics stats = statistics();
+    out << "BVH: " << stats.nbNodes << " nodes, " << stats.nbLeaves << " leaves, " << stats.nbReferences << " face references, "
+        << "max depth " << stats.maxDepth << ", SAH cost " << stats.sahCost << ", sibling overlap " << stats.siblingOverlap
+        << ", " << (stats.memory >> 10) << "KB" << (hasCompressedNodes() ? " (compressed nodes)" : "") << "\n";
+    out << "  leaves per depth:";
+    for(size_t d=0; d<stats.depthHistogram.size(); ++d)
+        if(stats.depthHistogram[d])
+            out << " " << d << ":" << stats.depthHistogram[d];
+    out << "\n  leaves per size:";
+    for(size_t b=0; b<stats.leafSizeHistogram.size(); ++b)
+    {
+        if(!stats.leafSizeHistogram[b])
+            continue;
+        out << " ";
+        if(b<=2)
+            out << b;
+        else
+            out << (1<<(b-2))+1 << "-" << (1<<(b-1));
+        out << ":" << stats.leafSizeHistogram[b];
+    }
+    out << "\n";
 }
 
 bool BVH::intersect(const Ray& ray, Hit& hit) const
 {
+    SIRE_COUNT(BOX_TESTS, ray.type(), 1);
     float tMin, tMax;
+    if(hasCompressedNodes())
+    {
+        ::intersect(ray, mRootBox, tMin, tMax);
+        if(tMax>0 && tMax>=tMin && tMin<hit.t() && !std::isinf(tMin) && !std::isinf(tMax))
+            return intersectCompressedNode(0, mRootBox, ray, hit);
+        return false;
+    }
     ::intersect(ray, mNodes[0].box, tMin, tMax);
     if(tMax>0 && tMax>=tMin && tMin<hit.t())
         return intersectNode(0, tMin, tMax, ray, hit);
     return false;
 }
 
+bool BVH::intersectLeaf(int start, int end, const Ray& ray, Hit& hit) const
+{
+    bool ret = false;
+    if(!mTriangles.empty())
+    {
+        for(int i=start; i<end; ++i)
+        {
+            const Eigen::Vector3f* v = &mTriangles[3*i];
+            ret = mpMesh->intersectTriangle(ray, hit, mFaces[i], v[0], v[1], v[2]) || ret;
+        }
+    }
+    else
+    {
+        for(int i=start; i<end; ++i)
+        {
+            ret = mpMesh->intersectFace(ray, hit, faceAt(i)) || ret;
+        }
+    }
+    return ret;
+}
+
+bool BVH::intersectCompressedNode(int nodeId, const Eigen::AlignedBox3f& box, const Ray& ray, Hit& hit) const
+{
+    SIRE_COUNT(NODES_VISITED, ray.type(), 1);
+    SIRE_COUNT(BOX_TESTS, ray.type(), 2);
+    const CompressedNode& node = mCompressedNodes[nodeId];
+    Eigen::AlignedBox3f boxes[2] = { decodeBox(node, 0, box), decodeBox(node, 1, box) };
+    float tMin[2], tMax[2];
+    ::intersect(ray, boxes[0], tMin[0], tMax[0]);
+    ::intersect(ray, boxes[1], tMin[1], tMax[1]);
+    int first = tMin[0] > tMin[1] ? 1 : 0;
+
+    bool ret = false;
+    for(int j=0; j<2; ++j)
+    {
+        int k = first ^ j;
+        if(tMin[k] < hit.t() && tMin[k]<=tMax[k] && tMax[k]>0 && !std::isinf(tMin[k]) && !std::isinf(tMax[k]))
+        {
+            if(node.child[k]<0)
+            {
+                SIRE_COUNT(NODES_VISITED, ray.type(), 1);
+                ret = intersectLeaf(~node.child[k], ~node.child[k]+node.nb_faces[k], ray, hit) || ret;
+            }
+            else
+                ret = intersectCompressedNode(node.child[k], boxes[k], ray, hit) || ret;
+        }
+    }
+    return ret;
+}
+
 bool BVH::intersectNode(int nodeId, float tMin, float tMax, const Ray& ray, Hit& hit) const
 {
     if(std::isinf(tMin) || std::isinf(tMax))
         return false;
 
+    SIRE_COUNT(NODES_VISITED, ray.type(), 1);
     const Node& node = mNodes[nodeId];
+    bool ret = false;
 
     if(node.is_leaf)
     {
-        int end = node.first_child_id+node.nb_faces;
-        for(int i=node.first_child_id; i<end; ++i)
-        {
-            mpMesh->intersectFace(ray, hit, mFaces[i]);
-        }
+        ret = intersectLeaf(node.first_face_id, node.first_face_id+node.nb_faces, ray, hit);
     }
     else
     {
         float tMin1, tMax1, tMin2, tMax2;
         int child_id1 = node.first_child_id;
         int child_id2 = node.first_child_id+1;
+        SIRE_COUNT(BOX_TESTS, ray.type(), 2);
         ::intersect(ray, mNodes[child_id1].box, tMin1, tMax1);
         ::intersect(ray, mNodes[child_id2].box, tMin2, tMax2);
         if(tMin1 > tMin2)
@@ -60,13 +1235,14 @@ bool BVH::intersectNode(int nodeId, float tMin, float tMax, const Ray& ray, Hit&
 
         if(tMin1 < hit.t() && tMin1<=tMax1 && tMax1>0)
         {
-            intersectNode(child_id1, tMin1, tMax1, ray, hit);
+            ret = intersectNode(child_id1, tMin1, tMax1, ray, hit) || ret;
         }
         if(tMin2 < hit.t() && tMin2<=tMax2 && tMax2>0)
         {
-            intersectNode(child_id2, tMin2, tMax2, ray, hit);
+            ret = intersectNode(child_id2, tMin2, tMax2, ray, hit) || ret;
         }
     }
+    return ret;
 }
 
 /** Sorts the faces with respect to their centroid along the dimension \a dim and spliting value \a split_value.
@@ -75,18 +1251,18 @@ bool BVH::intersectNode(int nodeId, float tMin, float tMax, const Ray& ray, Hit&
 int BVH::split(int start, int end, int dim, float split_value)
 {
     int l(start), r(end-1);
-    while(l<r)
+    while(l<=r)
     {
-        // find the first on the left
-        while(l<end && mCentroids[l](dim) < split_value) ++l;
-        while(r>=start && mCentroids[r](dim) >= split_value) --r;
-        if(l>r) break;
-        std::swap(mCentroids[l], mCentroids[r]);
-        std::swap(mFaces[l], mFaces[r]);
-        ++l;
-        --r;
+        if(mCentroids[l](dim) < split_value)
+            ++l;
+        else
+        {
+            std::swap(mCentroids[l], mCentroids[r]);
+            std::swap(mFaces[l], mFaces[r]);
+            --r;
+        }
     }
-    return mCentroids[l][dim]<split_value ? l+1 : l;
+    return l;
 }
 
 void BVH::buildNode(int nodeId, int start, int end, int level, int targetCellSize, int maxDepth)
@@ -98,9 +1274,9 @@ void BVH::buildNode(int nodeId, int start, int end, int level, int targetCellSiz
     aabb.setNull();
     for(int i=start; i<end; ++i)
     {
-        aabb.extend(mpMesh->vertexOfFace(mFaces[i], 0).position);
-        aabb.extend(mpMesh->vertexOfFace(mFaces[i], 1).position);
-        aabb.extend(mpMesh->vertexOfFace(mFaces[i], 2).position);
+        aabb.extend(mpMesh->positionOfFace(mFaces[i], 0));
+        aabb.extend(mpMesh->positionOfFace(mFaces[i], 1));
+        aabb.extend(mpMesh->positionOfFace(mFaces[i], 2));
     }
     node.box = aabb;
 
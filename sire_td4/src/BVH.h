@@ -4,7 +4,13 @@
 
 #include <Eigen/Geometry>
 #include <vector>
+#include <cstdio>
+#include <string>
+#include <iostream>
 #include "Ray.h"
+#include "DataArray.h"
+#include "MappedFile.h"
+#include "MemoryStatistics.h"
 class Mesh;
 
 class BVH
@@ -20,27 +26,254 @@ class BVH
     short is_leaf;
   };
   
-  typedef std::vector<Node> NodeList;
+  typedef DataArray<Node> NodeList;
+  
+  /** An inner node (24 bytes) storing the boxes of its two children quantized to 8 bits per coordinate
+    * relative to its own box, which is decoded from its parent during the traversal (see compressNodes()).
+    * Minimums are rounded down and maximums up, such that the decoded boxes always enclose the exact ones. */
+  struct CompressedNode {
+    unsigned char qmin[2][3];
+    unsigned char qmax[2][3];
+    int child[2];                 // index of an inner node, or ~first_face_id for a leaf
+    unsigned short nb_faces[2];   // for leaves
+  };
+  
+  typedef DataArray<CompressedNode> CompressedNodeList;
   
 public:
   
+  /// construction algorithms, see build() and buildLinear()
+  enum BuildMethod {
+    MIDPOINT,   ///< top-down split at the middle of the largest axis
+    LINEAR,     ///< linear BVH built from Morton codes, faster to build but of lower quality
+    SPATIAL     ///< SAH build with spatial splits, slower to build but with less overlap between siblings
+  };
+  
+  /** the algorithm and parameters a tree is built with. They are stored with the tree by write(),
+    * such that a file built with other parameters is not reused (see load()). */
+  struct BuildSettings {
+    BuildSettings() : method(MIDPOINT), maxLeafSize(10), maxDepth(100), spatialBudget(0.3f), optimizationPasses(0) {}
+    BuildMethod method;
+    int maxLeafSize;          ///< target cell size of build(), maximal leaf size of buildLinear() and buildSpatial()
+    int maxDepth;             ///< maximal depth of build(), number of Morton bits of buildLinear()
+    float spatialBudget;      ///< memory budget of buildSpatial()
+    int optimizationPasses;   ///< see optimize()
+    
+    /// \returns true if \a other builds the same tree, the parameters not used by the method being ignored
+    bool operator==(const BuildSettings& other) const;
+    bool operator!=(const BuildSettings& other) const { return !(*this==other); }
+  };
+  
+  BVH() : mpMesh(0), mGatherTriangles(false), mReferenceCost(0), mMemory(MemoryStatistics::BVHS) {}
+  
+  /// quality of a tree, see statistics()
+  struct Statistics {
+    int nbNodes;
+    int nbLeaves;
+    int nbReferences;                     ///< number of faces in the leaves, counting the duplicates
+    int maxDepth;
+    std::vector<int> depthHistogram;      ///< number of leaves at each depth
+    std::vector<int> leafSizeHistogram;   ///< number of leaves of 0, 1, 2, 3-4, 5-8, ... faces
+    float sahCost;                        ///< see sahCost()
+    float siblingOverlap;                 ///< average over the inner nodes of the area of the intersection of the children relative to the node area
+    size_t memory;                        ///< bytes of the nodes, face list and gathered triangles, mapped ones included
+  };
+  
+  /** If \a enabled (disabled by default), the vertex positions of the faces are copied in leaf order
+    * at the end of the builds, such that the traversal reads them sequentially instead of going through
+    * the face indices. This costs 36 bytes per face, and is thus not done for the trees used in place
+    * from a file (see attach()), whose memory is shared. */
+  void setGatherTriangles(bool enabled) { mGatherTriangles = enabled; }
+  
   void build(const Mesh* pMesh, int targetCellSize, int maxDepth);
+  
+  /// builds the tree with the algorithm and parameters \a settings, followed by its optimization passes if any
+  void build(const Mesh* pMesh, const BuildSettings& settings);
+  
+  /// \returns the algorithm and parameters the tree has been built with, see BuildSettings
+  const BuildSettings& buildSettings() const { return mSettings; }
+  
+  /** Builds a linear BVH: the centroids of the faces are sorted along a Morton curve of \a mortonBits bits (30 or 63)
+    * by a parallel radix sort, and the hierarchy is derived from the sorted codes in linear time (Karras 2012).
+    * Subtrees of at most \a maxLeafSize faces become leaves.
+    * This is much faster than build(), e.g., to rebuild the BVH of an animated mesh at each frame. */
+  void buildLinear(const Mesh* pMesh, int maxLeafSize, int mortonBits = 30);
+  
+  /** Builds a spatial split BVH (SBVH, Stich et al. 2009): each node is split either by partitioning its faces
+    * (binned SAH), or by a plane clipping the faces which straddle it, these faces being then referenced by both children.
+    * Spatial splits are only considered when the children of the object split overlap, and as long as the number
+    * of references stays below (1 + \a memoryBudget) times the number of faces.
+    * This reduces the overlap of the siblings for meshes with long and thin triangles. The face list then holds
+    * duplicate references, see faceList(). */
+  void buildSpatial(const Mesh* pMesh, int maxLeafSize, float memoryBudget = 0.3f);
+  
+  
   bool intersect(const Ray& ray, Hit& hit) const;
   
+  /** writes the nodes and the face list to \a f (see attach()), tagged with the hash \a meshHash
+    * of the geometry they have been built for (see Mesh::geometryHash()) and with their build settings
+    * \returns false if an error occured */
+  bool write(FILE* f, unsigned long long meshHash) const;
+  
+  /** uses in place the nodes and the face list stored at \a data by write().
+    * The \a size bytes starting at \a data must outlive the BVH. The indices of the nodes are checked,
+    * such that corrupted data cannot make the traversal read out of the nodes, the face list or the faces of \a pMesh.
+    * \returns the number of bytes used, or 0 if the data are not valid, have been written by another version,
+    * or have been built for another geometry than \a meshHash */
+  size_t attach(const Mesh* pMesh, const char* data, size_t size, unsigned long long meshHash);
+  
+  /** writes the BVH to the file \a filename (see write()). The file is written under a temporary name
+    * and then renamed, such that other processes never map a partial file.
+    * \returns false if an error occured */
+  bool save(const std::string& filename, unsigned long long meshHash) const;
+  
+  /** maps the file \a filename written by save() and uses its nodes and face list in place (see attach()).
+    * The mapping is read-only and shared, such that all the processes loading the same file share its physical memory.
+    * \returns false if the file does not exist, is not valid for the geometry \a meshHash,
+    * or has been built with other settings than \a settings */
+  bool load(const Mesh* pMesh, const std::string& filename, unsigned long long meshHash, const BuildSettings& settings);
+  
+  /// \returns true if the nodes are used in place from external memory (see attach())
+  bool isAttached() const { return mNodes.isExternal(); }
+  
+  /** \returns the faces in the order of the leaves, empty if they have been released (see releaseFaceList()).
+    * A face may appear several times if the BVH has been built by buildSpatial(). */
+  const DataArray<int>& faceList() const { return mFaces; }
+  
+  /** releases the face list, once the faces of the mesh have been sorted in the order of the leaves:
+    * the faces of a leaf are then directly the faces [first_face_id, first_face_id+nb_faces) of the mesh. */
+  void releaseFaceList();
+  
+  /** recomputes the boxes of the nodes from the current vertex positions of the mesh, keeping the tree unchanged.
+    * The leaves are refitted in parallel, and then the inner nodes from the bottom up. */
+  void refit();
+  
+  /// \returns the quality statistics of the tree
+  Statistics statistics() const;
+  void printStatistics(std::ostream& out) const;
+  
+  /** Improves the tree built by any of the builders by restructuring treelets of up to 7 subtrees such that
+    * their SAH cost is minimal (Karras and Aila 2013). At each of the \a nbPasses passes, the treelets are processed
+    * from the bottom up, those rooted at nodes of the same height in parallel, and the nodes are then laid out
+    * again in depth-first order. Does nothing on compressed nodes.
+    * \returns the SAH cost before the passes, the one after being given by sahCost() */
+  float optimize(int nbPasses = 3);
+  
+  /** \returns the surface area heuristic cost of the tree, i.e., the expected cost of tracing a random ray
+    * hitting the root box, with a cost of 1 per node traversal and per triangle intersection */
+  float sahCost() const;
+  
+  /** \returns the ratio between the current SAH cost and the one of the tree when it has been built or attached.
+    * It grows when refit() is called on a deforming mesh, and a rebuild is advised once it exceeds 1.5 or so. */
+  float sahDegradation() const { return mReferenceCost>0 ? sahCost()/mReferenceCost : 1.f; }
+  
+  /** Replaces the nodes by compressed nodes, storing the boxes of the children quantized to 8 bits
+    * relative to the box of their parent (24 bytes per pair of children instead of 64 bytes for their two 32-byte nodes).
+    * The boxes are slightly enlarged, which costs a few more node visits. Only the box of the root is kept in full precision.
+    * Does nothing if the root is a leaf. */
+  void compressNodes();
+  
+  /// \returns true if the nodes are stored in compressed form (see compressNodes())
+  bool hasCompressedNodes() const { return !mCompressedNodes.empty(); }
+  
   
   
 protected:
   
   bool intersectNode(int nodeId, float tMin, float tMax, const Ray& ray, Hit& hit) const;
+  /// traversal of the compressed nodes, \a box being the decoded box of the node \a nodeId
+  bool intersectCompressedNode(int nodeId, const Eigen::AlignedBox3f& box, const Ray& ray, Hit& hit) const;
+  /// intersects the faces [\a start, \a end) of the leaves
+  bool intersectLeaf(int start, int end, const Ray& ray, Hit& hit) const;
   
   int split(int start, int end, int dim, float split_value);
   
   void buildNode(int nodeId, int start, int end, int level, int targetCellSize, int maxDepth);
   
+  /// a face referenced during a spatial split build, possibly clipped to \a box
+  struct Reference {
+    Eigen::AlignedBox3f box;
+    int face;
+  };
+  
+  /// parameters and counters of buildSpatial()
+  struct SpatialBuild {
+    int maxLeafSize;
+    size_t maxReferences;
+    size_t nbReferences;
+    float rootArea;
+  };
+  
+  /// creates the node \a nodeId and its subtree for the references \a refs, which are released
+  void buildSpatialNode(int nodeId, std::vector<Reference>& refs, int level, SpatialBuild& state);
+  
+  /** splits the reference \a ref by the plane of coordinate \a pos along the axis \a dim.
+    * The boxes of \a left and \a right enclose the parts of the face on each side, clipped by the box of \a ref. */
+  void splitReference(const Reference& ref, int dim, float pos, Reference& left, Reference& right) const;
+  
+  /** creates the node \a nodeId and its subtree for the sorted faces [\a first, \a last],
+    * covered by the internal node \a internalId of the LBVH split at \a splits[internalId] */
+  void emitLinearNode(int nodeId, int first, int last, int internalId, const std::vector<int>& splits, int maxLeafSize);
+  
+  /// fills mTriangles from the current face list
+  void gatherTriangles();
+  /// reports the memory owned by the nodes, face list, centroids and triangles to MemoryStatistics
+  void updateMemoryAccount();
+  
+  /// \returns the index of the face of the mesh stored at the position \a i of the leaves
+  int faceAt(int i) const { return mFaces.empty() ? i : mFaces[i]; }
+  
+  /// restructures the treelet rooted at the inner node \a nodeId of \a nodes, \returns true if it has been modified
+  static bool optimizeTreelet(Node* nodes, int nodeId);
+  /// appends the node \a nodeId of mNodes and its subtree to \a nodes in depth-first order
+  void layoutNode(int nodeId, std::vector<Node>& nodes, int newId) const;
+  
+  void nodeStatistics(int nodeId, int depth, Statistics& stats) const;
+  void compressedNodeStatistics(int nodeId, const Eigen::AlignedBox3f& box, int depth, Statistics& stats) const;
+  /// accounts for a leaf of \a nbFaces faces at depth \a depth
+  static void leafStatistics(int nbFaces, int depth, Statistics& stats);
+  
+  /// refits all the nodes of mNodes, children being stored after their parent
+  void refitNodes();
+  
+  /// \returns the sum of the area of the nodes below the compressed node \a nodeId weighted by their cost
+  float compressedSAHCost(int nodeId, const Eigen::AlignedBox3f& box) const;
+  
+  /// quantizes the children of the node \a nodeId into the compressed node \a compressedId, \a box being its decoded box
+  void compressNode(int nodeId, int compressedId, const Eigen::AlignedBox3f& box);
+  /// rebuilds the uncompressed node \a nodeId from the compressed node \a compressedId, without the boxes
+  void decompressNode(int compressedId, int nodeId);
+  /** \returns the box of the child \a k of \a node, decoded relative to \a box.
+    * A code of 0 or 255 decodes exactly to the corresponding bound of \a box. */
+  static Eigen::AlignedBox3f decodeBox(const CompressedNode& node, int k, const Eigen::AlignedBox3f& box)
+  {
+    Eigen::Array3f scale = (box.max() - box.min()).array() * (1.f/255.f);
+    Eigen::AlignedBox3f res;
+    for(int i=0; i<3; ++i)
+    {
+      res.min()[i] = node.qmin[k][i]==0   ? box.min()[i] : box.min()[i] + float(node.qmin[k][i]) * scale[i];
+      res.max()[i] = node.qmax[k][i]==255 ? box.max()[i] : box.min()[i] + float(node.qmax[k][i]) * scale[i];
+    }
+    return res;
+  }
+  
   const Mesh* mpMesh;
   NodeList mNodes;
-  std::vector<int> mFaces;
+  /// empty unless compressNodes() has been called, mNodes is then empty
+  CompressedNodeList mCompressedNodes;
+  Eigen::AlignedBox3f mRootBox;
+  DataArray<int> mFaces;
   std::vector<Eigen::Vector3f> mCentroids;
+  BuildSettings mSettings;
+  bool mGatherTriangles;
+  /// the 3 vertex positions of each entry of mFaces, empty if the triangles are not gathered
+  std::vector<Eigen::Vector3f> mTriangles;
+  /// file mapped by load(), mNodes and mFaces may refer to
+  MappedFile mFile;
+  /// SAH cost when the tree has been built or attached, see sahDegradation()
+  float mReferenceCost;
+  /// the memory owned by the arrays above, the mapped ones are not counted
+  MemoryAccount mMemory;
   
 };
 
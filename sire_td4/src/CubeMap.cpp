@@ -1,51 +1,403 @@
 #include "CubeMap.h"
+#include "Trace.h"
 
-bool CubeMap::load(const QString& filename)
+#include <QImage>
+#include <math.h>
+
+//--------------------------------------------------------------------------------
+// texel encodings
+//--------------------------------------------------------------------------------
+
+static unsigned short floatToHalf(float value)
 {
-    if (filename.endsWith(".hdr"))
+    union { float f; unsigned int u; } bits;
+    bits.f = value;
+    unsigned int sign = (bits.u >> 16) & 0x8000;
+    int exponent = int((bits.u >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits.u & 0x7fffff;
+    if(exponent <= 0)       // too small: flush to zero
+        return sign;
+    if(exponent >= 31)      // too large, inf or nan: clamp to the largest half
+        return sign | 0x7bff;
+    unsigned int h = sign | (exponent << 10) | (mantissa >> 13);
+    // round to nearest
+    if((mantissa & 0x1000) && (h & 0x7fff) < 0x7bff)
+        ++h;
+    return h;
+}
+
+static float halfToFloat(unsigned short h)
+{
+    union { float f; unsigned int u; } bits;
+    unsigned int exponent = (h >> 10) & 0x1f;
+    bits.u = (h & 0x8000) << 16;
+    // denormals are never produced by floatToHalf
+    if(exponent != 0)
+        bits.u |= ((exponent - 15 + 127) << 23) | ((h & 0x3ff) << 13);
+    return bits.f;
+}
+
+static void floatToRGBE(unsigned char rgbe[4], float r, float g, float b)
+{
+    float v = std::max(r, std::max(g, b));
+    if(v < 1e-32)
     {
-        FILE* f = fopen(filename.toStdString().c_str(), "rb");
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int e;
+    v = float(frexp(v, &e)) * 256.0f / v;
+    rgbe[0] = (unsigned char)(r * v);
+    rgbe[1] = (unsigned char)(g * v);
+    rgbe[2] = (unsigned char)(b * v);
+    rgbe[3] = (unsigned char)(e + 128);
+}
 
-        // Read image header
-        if(RGBE_ReadHeader(f, &m_sizeX, &m_sizeY, 0)!=0){
-            return false;
+/// same convention as rgbe2float in rgbe.cpp
+static void rgbeToFloat(const unsigned char rgbe[4], float* rgb)
+{
+    if(rgbe[3])
+    {
+        float f = float(ldexp(1.0f, rgbe[3] - int(128+8)));
+        rgb[0] = rgbe[0] * f;
+        rgb[1] = rgbe[1] * f;
+        rgb[2] = rgbe[2] * f;
+    }
+    else
+        rgb[0] = rgb[1] = rgb[2] = 0.f;
+}
+
+//--------------------------------------------------------------------------------
+// loading
+//--------------------------------------------------------------------------------
+
+int CubeMap::faceOfCell(int cx, int cy)
+{
+    static const int cells[4][3] = {
+        { -1, TOP,    -1    },
+        { LEFT, FRONT, RIGHT },
+        { -1, BOTTOM, -1    },
+        { -1, BACK,   -1    } };
+    if(cx<0 || cx>=3 || cy<0 || cy>=4)
+        return -1;
+    return cells[cy][cx];
+}
+
+void CubeMap::allocate(int sizeX, int sizeY, Storage storage)
+{
+    if(sizeX%3 != 0 || sizeY%4 != 0)
+        std::cerr << "CubeMap: the cross size (" << sizeX << "x" << sizeY << ") is not a multiple of 3x4" << std::endl;
+
+    m_storage = storage;
+    m_texelSize = storage==FLOAT32 ? 3*sizeof(float) : storage==HALF16 ? 3*sizeof(unsigned short) : 4;
+    // release the previous image before allocating the new one
+    m_levels.clear();
+    m_levels.resize(1);
+    m_levels[0].width  = sizeX / 3;
+    m_levels[0].height = sizeY / 4;
+    m_levels[0].data.resize(size_t(NB_FACES) * m_levels[0].width * m_levels[0].height * m_texelSize);
+    m_memory.set(memoryFootprint());
+}
+
+void CubeMap::buildMipmaps()
+{
+    SIRE_TRACE_ZONE("CubeMap::buildMipmaps");
+    // each level is a 2x2 box filtering of the previous one
+    while(m_levels.back().width>1 || m_levels.back().height>1)
+    {
+        int src = m_levels.size()-1;
+        Level level;
+        level.width  = std::max(1, m_levels[src].width/2);
+        level.height = std::max(1, m_levels[src].height/2);
+        level.data.resize(size_t(NB_FACES) * level.width * level.height * m_texelSize);
+        m_levels.push_back(level);
+
+        int srcWidth = m_levels[src].width, srcHeight = m_levels[src].height;
+        for(int face=0; face<NB_FACES; ++face)
+        {
+#pragma omp parallel for
+            for(int y=0; y<level.height; ++y)
+            {
+                int y0 = std::min(2*y, srcHeight-1), y1 = std::min(2*y+1, srcHeight-1);
+                for(int x=0; x<level.width; ++x)
+                {
+                    int x0 = std::min(2*x, srcWidth-1), x1 = std::min(2*x+1, srcWidth-1);
+                    Eigen::Array3f c = 0.25f * (texel(src, face, x0, y0) + texel(src, face, x1, y0)
+                                              + texel(src, face, x0, y1) + texel(src, face, x1, y1));
+                    storeTexel(texelData(src+1, face, x, y), c[0], c[1], c[2]);
+                }
+            }
         }
+    }
+    m_memory.set(memoryFootprint());
+}
+
+size_t CubeMap::memoryFootprint() const
+{
+    size_t bytes = 0;
+    for(size_t l=0; l<m_levels.size(); ++l)
+        bytes += m_levels[l].data.size();
+    return bytes;
+}
+
+void CubeMap::storeCrossTexel(int x, int y, const unsigned char rgbe[4])
+{
+    const Level& level = m_levels[0];
+    int face = faceOfCell(x / level.width, y / level.height);
+    if(face<0)
+        return;
+    unsigned char* dst = texelData(0, face, x % level.width, y % level.height);
+    if(m_storage==RGBE8)
+    {
+        dst[0] = rgbe[0]; dst[1] = rgbe[1]; dst[2] = rgbe[2]; dst[3] = rgbe[3];
+        return;
+    }
+    float rgb[3];
+    rgbeToFloat(rgbe, rgb);
+    storeCrossTexel(x, y, rgb[0], rgb[1], rgb[2]);
+}
+
+void CubeMap::storeCrossTexel(int x, int y, float r, float g, float b)
+{
+    const Level& level = m_levels[0];
+    int face = faceOfCell(x / level.width, y / level.height);
+    if(face<0)
+        return;
+    storeTexel(texelData(0, face, x % level.width, y % level.height), r, g, b);
+}
+
+void CubeMap::storeTexel(unsigned char* dst, float r, float g, float b) const
+{
+    switch(m_storage)
+    {
+    case FLOAT32:
+    {
+        float* f = reinterpret_cast<float*>(dst);
+        f[0] = r; f[1] = g; f[2] = b;
+        break;
+    }
+    case HALF16:
+    {
+        unsigned short* h = reinterpret_cast<unsigned short*>(dst);
+        h[0] = floatToHalf(r); h[1] = floatToHalf(g); h[2] = floatToHalf(b);
+        break;
+    }
+    case RGBE8:
+        floatToRGBE(dst, r, g, b);
+        break;
+    }
+}
 
-        m_image = new float[sizeof(float)*3*m_sizeX*m_sizeY];
-        // Read image data
-        if(RGBE_ReadPixels_RLE(f, reinterpret_cast<float*>(m_image), m_sizeX, m_sizeY)!=0){
+/** Decodes a run length encoded scanline (see RGBE_ReadPixels_RLE) into 4 planar channels.
+  * The data must have been validated beforehand.
+  */
+static void decodeScanlineRLE(const unsigned char* src, unsigned char* dst, int width)
+{
+    src += 4; // skip the scanline header
+    for(int c=0; c<4; ++c)
+    {
+        unsigned char* ptr = dst + c*width;
+        unsigned char* ptr_end = ptr + width;
+        while(ptr < ptr_end)
+        {
+            int count = *src++;
+            if(count > 128)
+            {
+                // a run of the same value
+                count -= 128;
+                std::fill(ptr, ptr+count, *src++);
+            }
+            else
+            {
+                // a non-run
+                std::copy(src, src+count, ptr);
+                src += count;
+            }
+            ptr += count;
+        }
+    }
+}
+
+bool CubeMap::loadHDR(FILE* f, int sizeX, int sizeY)
+{
+    // read the whole pixel data at once
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long end = ftell(f);
+    fseek(f, start, SEEK_SET);
+    std::vector<unsigned char> buffer(std::max(0L, end-start));
+    if(buffer.empty() || fread(&buffer[0], 1, buffer.size(), f) != buffer.size())
+    {
+        std::cerr << "CubeMap: unable to read the pixel data" << std::endl;
+        return false;
+    }
+
+    allocate(sizeX, sizeY, m_storage);
+
+    // First pass: locate the scanlines by skipping over the runs.
+    // This only touches the run headers and is cheap compared to the decoding itself.
+    std::vector<size_t> scanlines(sizeY);
+    bool rle = sizeX>=8 && sizeX<=0x7fff;
+    size_t p = 0;
+    for(int y=0; rle && y<sizeY; ++y)
+    {
+        if(p+4 > buffer.size() || buffer[p]!=2 || buffer[p+1]!=2 || (buffer[p+2] & 0x80))
+        {
+            if(y>0)
+            {
+                std::cerr << "CubeMap: bad scanline data" << std::endl;
+                return false;
+            }
+            // not run length encoded
+            rle = false;
+            break;
+        }
+        if(((int(buffer[p+2])<<8) | buffer[p+3]) != sizeX)
+        {
+            std::cerr << "CubeMap: wrong scanline width" << std::endl;
             return false;
         }
+        scanlines[y] = p;
+        p += 4;
+        for(int c=0; c<4; ++c)
+        {
+            int n = 0;
+            while(n < sizeX)
+            {
+                int count = p<buffer.size() ? buffer[p] : 0;
+                if(count > 128)
+                {
+                    count -= 128;
+                    p += 2;
+                }
+                else
+                    p += 1 + count;
+                n += count;
+                if(count==0 || n>sizeX || p>buffer.size())
+                {
+                    std::cerr << "CubeMap: bad scanline data" << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+
+    if(!rle)
+    {
+        // flat or old-style encoded file: let the reference implementation handle it
+        fseek(f, start, SEEK_SET);
+        std::vector<unsigned char>().swap(buffer);
+        std::vector<float> cross(3*size_t(sizeX)*sizeY);
+        if(RGBE_ReadPixels_RLE(f, &cross[0], sizeX, sizeY) != RGBE_RETURN_SUCCESS)
+            return false;
+        for(int y=0; y<sizeY; ++y)
+            for(int x=0; x<sizeX; ++x)
+            {
+                const float* rgb = &cross[3*(size_t(y)*sizeX + x)];
+                storeCrossTexel(x, y, rgb[0], rgb[1], rgb[2]);
+            }
         return true;
     }
 
+    // Second pass: decode blocks of scanlines in parallel
+    const int blockSize = 16;
+    int nbBlocks = (sizeY + blockSize - 1) / blockSize;
+#pragma omp parallel
+    {
+        std::vector<unsigned char> scanline(4*sizeX);
+#pragma omp for schedule(dynamic)
+        for(int b=0; b<nbBlocks; ++b)
+        {
+            int yEnd = std::min(sizeY, (b+1)*blockSize);
+            for(int y=b*blockSize; y<yEnd; ++y)
+            {
+                decodeScanlineRLE(&buffer[scanlines[y]], &scanline[0], sizeX);
+                for(int x=0; x<sizeX; ++x)
+                {
+                    unsigned char rgbe[4] = { scanline[x], scanline[x+sizeX], scanline[x+2*sizeX], scanline[x+3*sizeX] };
+                    storeCrossTexel(x, y, rgbe);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool CubeMap::load(const QString& filename, Storage storage, bool mipmaps)
+{
+    SIRE_TRACE_ZONE("CubeMap::load");
+    m_storage = storage;
+    m_levels.clear();
+    m_memory.set(0);
+
+    if (filename.endsWith(".hdr"))
+    {
+        FILE* f = fopen(filename.toStdString().c_str(), "rb");
+        if(!f)
+        {
+            qWarning("Could not open: %s", qPrintable(filename));
+            return false;
+        }
+
+        // Read image header
+        int sizeX, sizeY;
+        bool ok = RGBE_ReadHeader(f, &sizeX, &sizeY, 0)==RGBE_RETURN_SUCCESS
+               && loadHDR(f, sizeX, sizeY);
+        fclose(f);
+        if(ok && mipmaps)
+            buildMipmaps();
+        return ok;
+    }
+
     QImage image;
     if (image.load(filename)){
-        for(int x = 0; x < m_sizeX; ++x)
-            for(int y = 0; y < m_sizeY; ++y){
-                QRgb c = image.pixel(x,y);
-                m_image[ 3 * ( x + m_sizeX * y )    ] = qRed(c)/255.f;
-                m_image[ 3 * ( x + m_sizeX * y ) + 1] = qGreen(c)/255.f;
-                m_image[ 3 * ( x + m_sizeX * y ) + 2] = qBlue(c)/255.f;
-            }
+        image = image.convertToFormat(QImage::Format_RGB32);
+        allocate(image.width(), image.height(), storage);
+        for(int y = 0; y < image.height(); ++y)
+        {
+            const QRgb* line = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+            for(int x = 0; x < image.width(); ++x)
+                storeCrossTexel(x, y, qRed(line[x])/255.f, qGreen(line[x])/255.f, qBlue(line[x])/255.f);
+        }
+        if(mipmaps)
+            buildMipmaps();
         return true;
     }
     qWarning("Could not open: %s", qPrintable(filename));
     return false;
 }
 
-float* CubeMap::getPixel(int x, int y) const
+//--------------------------------------------------------------------------------
+// lookups
+//--------------------------------------------------------------------------------
+
+Eigen::Array3f CubeMap::texel(int level, int face, int x, int y) const
 {
-    return &m_image[(x + y*m_sizeX) * 3];
+    const unsigned char* src = texelData(level, face, x, y);
+    switch(m_storage)
+    {
+    case HALF16:
+    {
+        const unsigned short* h = reinterpret_cast<const unsigned short*>(src);
+        return Eigen::Array3f(halfToFloat(h[0]), halfToFloat(h[1]), halfToFloat(h[2]));
+    }
+    case RGBE8:
+    {
+        Eigen::Array3f rgb;
+        rgbeToFloat(src, rgb.data());
+        return rgb;
+    }
+    default:
+        return Eigen::Array3f::Map(reinterpret_cast<const float*>(src));
+    }
 }
 
-Eigen::Array3f CubeMap::intensity(const Eigen::Vector3f& dir) const
+Eigen::Array3f CubeMap::intensity(const Eigen::Vector3f& dir, float footprint) const
 {
-    assert(m_image.isInitialized());
+    assert(!m_levels.empty());
 
-    // cross is 3 faces wide, 4 faces high
-    int face_width  = m_sizeX / 3;
-    int face_height = m_sizeY / 4;
+    // a texel of the finest level covers about 2/width radians near the center of a face
+    float lod = footprint>0.f ? std::log(footprint * m_levels[0].width * 0.5f) / std::log(2.f) : 0.f;
 
     Eigen::Array3f outputColor;
 
@@ -57,17 +409,16 @@ Eigen::Array3f CubeMap::intensity(const Eigen::Vector3f& dir) const
         if (tdir[0] > 0.0f)
         {
             // right
-            outputColor = readTexture(2*face_width, face_height,
+            outputColor = readTexture(RIGHT,
                                       1.0f - (tdir[2] / tdir[0]+ 1.0f) * 0.5f,
-                    (tdir[1] / tdir[0]+ 1.0f) * 0.5f, face_width, face_height);
+                    (tdir[1] / tdir[0]+ 1.0f) * 0.5f, lod);
         }
         else if (tdir[0] < 0.0f)
         {
             // left
-            outputColor = readTexture(0, face_height,
+            outputColor = readTexture(LEFT,
                                       1.0f - (tdir[2] / tdir[0]+ 1.0f) * 0.5f,
-                    1.0f - ( tdir[1] / tdir[0] + 1.0f) * 0.5f,
-                    face_width, face_height);
+                    1.0f - ( tdir[1] / tdir[0] + 1.0f) * 0.5f, lod);
         }
     }
     else if ((fabsf(tdir[1]) >= fabsf(tdir[0])) && (fabsf(tdir[1]) >= fabsf(tdir[2])))
@@ -75,16 +426,16 @@ Eigen::Array3f CubeMap::intensity(const Eigen::Vector3f& dir) const
         if (tdir[1] > 0.0f)
         {
             // bottom
-            outputColor = readTexture(face_width, 2*face_height,
+            outputColor = readTexture(BOTTOM,
                                       (tdir[0] / tdir[1] + 1.0f) * 0.5f,
-                    1.0f - (tdir[2]/ tdir[1] + 1.0f) * 0.5f, face_width, face_height);
+                    1.0f - (tdir[2]/ tdir[1] + 1.0f) * 0.5f, lod);
         }
         else if (tdir[1] < 0.0f)
         {
             // top
-            outputColor = readTexture(face_width, 0,
+            outputColor = readTexture(TOP,
                                       1.0f - (tdir[0] / tdir[1] + 1.0f) * 0.5f,
-                    1.0f - (tdir[2]/tdir[1] + 1.0f) * 0.5f, face_width, face_height);
+                    1.0f - (tdir[2]/tdir[1] + 1.0f) * 0.5f, lod);
         }
     }
     else if ((fabsf(tdir[2]) >= fabsf(tdir[0]))
@@ -93,23 +444,35 @@ Eigen::Array3f CubeMap::intensity(const Eigen::Vector3f& dir) const
         if (tdir[2] > 0.0f)
         {
             // Front
-            outputColor = readTexture(face_width, face_height,
+            outputColor = readTexture(FRONT,
                                       (tdir[0] / tdir[2] + 1.0f) * 0.5f,
-                    (tdir[1]/tdir[2] + 1.0f) * 0.5f, face_width, face_height);
+                    (tdir[1]/tdir[2] + 1.0f) * 0.5f, lod);
         }
         else if (tdir[2] < 0.0f)
         {
             // Back
-            outputColor = readTexture(face_width, 3*face_height,
+            outputColor = readTexture(BACK,
                                       1.0f - (tdir[0] / tdir[2] + 1.0f) * 0.5f,
-                    (tdir[1] /tdir[2]+1) * 0.5f, face_width, face_height);
+                    (tdir[1] /tdir[2]+1) * 0.5f, lod);
         }
     }
     return outputColor;
 }
 
-Eigen::Array3f CubeMap::readTexture(int startX, int startY, float u, float v, int sizeU, int sizeV) const
+Eigen::Array3f CubeMap::readTexture(int face, float u, float v, float lod) const
+{
+    lod = std::min(std::max(lod, 0.f), float(m_levels.size()-1));
+    int l0 = int(lod);
+    float t = lod - l0;
+    if(t==0.f || l0+1>=int(m_levels.size()))
+        return readLevel(l0, face, u, v);
+    return (1.f-t) * readLevel(l0, face, u, v) + t * readLevel(l0+1, face, u, v);
+}
+
+Eigen::Array3f CubeMap::readLevel(int level, int face, float u, float v) const
 {
+    int sizeU = m_levels[level].width;
+    int sizeV = m_levels[level].height;
     u = fabsf(u);
     v = fabsf(v);
     int umin = int(sizeU * u);
@@ -126,14 +489,10 @@ Eigen::Array3f CubeMap::readTexture(int startX, int startY, float u, float v, in
     vmax = fmin(fmax(vmax, 0), sizeV - 1);
 
     // Bilinear interpolation along u and v
-    const float* t1 = getPixel(startX+umin,startY+vmin);
-    const float* t2 = getPixel(startX+umax,startY+vmin);
-    const float* t3 = getPixel(startX+umin,startY+vmax);
-    const float* t4 = getPixel(startX+umax,startY+vmax);
     Eigen::Array3f output =
-            (1.0f - vcoef) * ((1.0f - ucoef) * Eigen::Array3f(*t1,*(t1+1),*(t1+2))
-                              + ucoef * Eigen::Array3f(*t2,*(t2+1),*(t2+2)))
-            + vcoef * ((1.0f - ucoef) * Eigen::Array3f(*t3,*(t3+1),*(t3+2))
-                       + ucoef * Eigen::Array3f(*t4,*(t4+1),*(t4+2)));
+            (1.0f - vcoef) * ((1.0f - ucoef) * texel(level, face, umin, vmin)
+                              + ucoef * texel(level, face, umax, vmin))
+            + vcoef * ((1.0f - ucoef) * texel(level, face, umin, vmax)
+                       + ucoef * texel(level, face, umax, vmax));
     return output;
 }
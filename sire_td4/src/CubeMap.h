@@ -1,8 +1,8 @@
-
 #ifndef SIRE_CUBEMAP_H
 #define SIRE_CUBEMAP_H
 
 #include "rgbe.h"
+#include "MemoryStatistics.h"
 
 #include <Eigen/Core>
 #include <Eigen/Geometry>
@@ -10,21 +10,83 @@
 #include <QMessageBox>
 #include <QDomElement>
 #include <iostream>
+#include <vector>
 
+/** An environment map loaded from a vertical cross image (3 faces wide, 4 faces high).
+  * Only the six faces of the cross are kept in memory, packed one after the other.
+  */
 class CubeMap
 {
 public:
-    bool load(const QString& filename);
+    /// in-memory encoding of the texels
+    enum Storage {
+        FLOAT32,    ///< 3 floats per texel (12 bytes)
+        HALF16,     ///< 3 half floats per texel (6 bytes)
+        RGBE8       ///< shared exponent, as in the .hdr file (4 bytes)
+    };
+
+    CubeMap() : m_storage(FLOAT32), m_texelSize(0), m_memory(MemoryStatistics::CUBEMAPS) {}
+
+    /** Loads the cross image \a filename (.hdr or any format supported by QImage)
+      * and stores its faces using the encoding \a storage.
+      * If \a mipmaps is true, a mip chain is built for each face (+33% of memory),
+      * such that the lookups of rays with differentials are filtered. */
+    bool load(const QString& filename, Storage storage = FLOAT32, bool mipmaps = false);
+
+    /** \returns the intensity in the direction \a dir.
+      * \a footprint is the angular width (in radians) of the lookup, used to select the mip level,
+      * it is ignored if the cube map has been loaded without mipmaps */
+    Eigen::Array3f intensity(const Eigen::Vector3f& dir, float footprint = 0.f) const;
+
+    /// \returns true if no image has been loaded
+    bool isNull() const { return m_levels.empty(); }
 
-    Eigen::Array3f intensity(const Eigen::Vector3f& dir) const;
+    /// \returns the number of bytes used to store the faces
+    size_t memoryFootprint() const;
 
 protected:
-    Eigen::Array3f readTexture(int startX, int startY, float u, float v, int sizeU, int sizeV) const;
-    float* getPixel(int x, int y) const;
+    /// faces of the cube, see faceOfCell() for their position in the cross
+    enum Face { RIGHT, LEFT, BOTTOM, TOP, FRONT, BACK, NB_FACES };
+
+    /// \returns the face stored in the cell (\a cx, \a cy) of the cross, or -1 for the unused cells
+    static int faceOfCell(int cx, int cy);
+
+    bool loadHDR(FILE* f, int sizeX, int sizeY);
+    void allocate(int sizeX, int sizeY, Storage storage);
+    void buildMipmaps();
+    /// stores the texel of coordinates (\a x, \a y) in the cross, does nothing if it lies outside of a face
+    void storeCrossTexel(int x, int y, const unsigned char rgbe[4]);
+    void storeCrossTexel(int x, int y, float r, float g, float b);
+    void storeTexel(unsigned char* dst, float r, float g, float b) const;
+
+    /// trilinear lookup, \a lod being the (fractional) mip level
+    Eigen::Array3f readTexture(int face, float u, float v, float lod) const;
+    Eigen::Array3f readLevel(int level, int face, float u, float v) const;
+    Eigen::Array3f texel(int level, int face, int x, int y) const;
+
+    /// the six faces of a given mip level
+    struct Level
+    {
+        int width, height;
+        std::vector<unsigned char> data;
+    };
+
+    unsigned char* texelData(int level, int face, int x, int y)
+    {
+        Level& l = m_levels[level];
+        return &l.data[((size_t(face) * l.height + y) * l.width + x) * m_texelSize];
+    }
+    const unsigned char* texelData(int level, int face, int x, int y) const
+    {
+        const Level& l = m_levels[level];
+        return &l.data[((size_t(face) * l.height + y) * l.width + x) * m_texelSize];
+    }
 
 private:
-    float* m_image;
-    int m_sizeX, m_sizeY;
+    Storage m_storage;
+    int m_texelSize;
+    std::vector<Level> m_levels;
+    MemoryAccount m_memory;     ///< memoryFootprint(), updated when the levels are (re)allocated
 };
 
 #endif // SIRE_CUBEMAP_H
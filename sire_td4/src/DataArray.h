@@ -0,0 +1,116 @@
+#ifndef SIRE_DATAARRAY_H
+#define SIRE_DATAARRAY_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+/** A contiguous array of elements which either owns its elements, like a std::vector,
+  * or refers to read-only memory owned by someone else, typically a MappedFile.
+  *
+  * In the latter case the elements are used in place: they are only copied once the array
+  * is accessed through one of its non-const methods.
+  */
+template<typename T>
+class DataArray
+{
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    DataArray() : mpExternal(0), mpData(0), mSize(0) {}
+    DataArray(const DataArray& other) : mOwned(other.mOwned), mpExternal(other.mpExternal), mSize(other.mSize) { update(); }
+
+    DataArray& operator=(const DataArray& other)
+    {
+        mOwned = other.mOwned;
+        mpExternal = other.mpExternal;
+        mSize = other.mSize;
+        update();
+        return *this;
+    }
+
+    /// makes the array refer to the \a n elements starting at \a data, which must outlive the array
+    void setExternal(const T* data, size_t n)
+    {
+        std::vector<T>().swap(mOwned);
+        mpExternal = data;
+        mSize = n;
+        update();
+    }
+    /// \returns true if the elements are not owned by the array
+    bool isExternal() const { return mpExternal!=0; }
+
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize==0; }
+
+    const T* data() const { return mpData; }
+    T* data() { detach(); return mSize ? &mOwned[0] : 0; }
+
+    const T& operator[](size_t i) const { return mpData[i]; }
+    T& operator[](size_t i) { detach(); return mOwned[i]; }
+
+    const_iterator begin() const { return mpData; }
+    const_iterator end() const { return mpData + mSize; }
+    iterator begin() { return data(); }
+    iterator end() { return data() + mSize; }
+
+    const T& back() const { return mpData[mSize-1]; }
+    T& back() { detach(); return mOwned.back(); }
+
+    void push_back(const T& value) { detach(); mOwned.push_back(value); update(); }
+    void resize(size_t n) { detach(); mOwned.resize(n); update(); }
+    void reserve(size_t n) { detach(); mOwned.reserve(n); update(); }
+    void clear() { mpExternal = 0; std::vector<T>().swap(mOwned); update(); }
+
+    /// takes the ownership of the content of \a elements, which receives the previously owned elements
+    void swap(std::vector<T>& elements)
+    {
+        mpExternal = 0;
+        mOwned.swap(elements);
+        update();
+    }
+
+    void swap(DataArray& other)
+    {
+        mOwned.swap(other.mOwned);
+        std::swap(mpExternal, other.mpExternal);
+        std::swap(mSize, other.mSize);
+        update();
+        other.update();
+    }
+
+    /// copies the external elements, if any, so that the array owns them
+    void detach()
+    {
+        if(mpExternal)
+        {
+            mOwned.assign(mpExternal, mpExternal + mSize);
+            mpExternal = 0;
+            update();
+        }
+    }
+
+    /// \returns the number of bytes owned by the array
+    size_t memoryFootprint() const { return mOwned.capacity() * sizeof(T); }
+
+private:
+    void update()
+    {
+        if(mpExternal)
+            mpData = mpExternal;
+        else
+        {
+            mSize = mOwned.size();
+            mpData = mSize ? &mOwned[0] : 0;
+        }
+    }
+
+    std::vector<T> mOwned;
+    const T* mpExternal;
+    const T* mpData;
+    size_t mSize;
+};
+
+#endif // SIRE_DATAARRAY_H
@@ -2,6 +2,7 @@
 #ifndef SIRE_LIGHT_H
 #define SIRE_LIGHT_H
 
+#include <vector>
 #include <Eigen/Core>
 #include <QMessageBox>
 #include <QDomElement>
@@ -0,0 +1,40 @@
+#include "MappedFile.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd<0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st)!=0 || st.st_size==0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid once the descriptor is closed
+    ::close(fd);
+    if(data==MAP_FAILED)
+        return false;
+
+    mData = static_cast<const char*>(data);
+    mSize = st.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(mData)
+        munmap(const_cast<char*>(mData), mSize);
+    mData = 0;
+    mSize = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef SIRE_MAPPEDFILE_H
+#define SIRE_MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+/** A read-only memory mapping of a whole file.
+  * The mapping is shared: several processes mapping the same file share the same physical pages.
+  */
+class MappedFile
+{
+public:
+    MappedFile() : mData(0), mSize(0) {}
+    ~MappedFile() { close(); }
+
+    /// maps the file \a filename, \returns false if it cannot be opened or is empty
+    bool open(const std::string& filename);
+    void close();
+
+    bool isOpen() const { return mData!=0; }
+    const char* data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    // non copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* mData;
+    size_t mSize;
+};
+
+#endif // SIRE_MAPPEDFILE_H
@@ -1,5 +1,6 @@
 #include "Material.h"
 #include "DomUtils.h"
+#include "TextureCache.h"
 
 #include <QMessageBox>
 
@@ -38,7 +39,7 @@ BlinnPhong::BlinnPhong(const QDomElement &e)
                     setTextureScaleU(e.attribute("scaleU", "1.0").toFloat());
                 if (e.hasAttribute("scaleV"))
                     setTextureScaleV(e.attribute("scaleV", "1.0").toFloat());
-                loadTextureFromFile(e.attribute("file"));
+                loadTextureFromFile(e.attribute("file"), e.attribute("lazy", "false") == "true");
                 if (e.attribute("mode") == "MODULATE") setTextureMode(MODULATE);
                 if (e.attribute("mode") == "BLEND")    setTextureMode(BLEND);
                 if (e.attribute("mode") == "REPLACE")  setTextureMode(REPLACE);
@@ -53,11 +54,44 @@ BlinnPhong::BlinnPhong(const QDomElement &e)
     }
 }
 
-void Material::loadTextureFromFile(const QString& fileName)
+void Material::loadTextureFromFile(const QString& fileName, bool lazy)
 {
     if (fileName.isNull())
         QMessageBox::warning(NULL, "Material texture error", "Material error : no texture file name provided");
+    else if (lazy)
+    {
+        m_cachedTexture = TextureCache::instance().addTexture(SIRE_DIR"/data/" + fileName);
+        if (m_cachedTexture<0)
+            QMessageBox::warning(NULL, "Material texture error", "Unable to load Material texture from "+fileName);
+    }
     else
         if (!m_texture.load(SIRE_DIR"/data/" + fileName))
             QMessageBox::warning(NULL, "Material texture error", "Unable to load Material texture from "+fileName);
 }
+
+Eigen::Array3f Material::textureColor(const Eigen::Vector2f& uv, const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const
+{
+    Eigen::Vector2f scale(m_textureScaleU, m_textureScaleV);
+    Eigen::Vector2f st = uv.cwiseProduct(scale);
+    if (m_cachedTexture>=0)
+    {
+        TextureCache& cache = TextureCache::instance();
+        return cache.sample(m_cachedTexture, st, cache.lod(m_cachedTexture, duvdx.cwiseProduct(scale), duvdy.cwiseProduct(scale)));
+    }
+    return m_texture.sample(st, m_texture.lod(duvdx.cwiseProduct(scale), duvdy.cwiseProduct(scale)));
+}
+
+Eigen::Array3f Material::applyTexture(const Eigen::Array3f& color, const Eigen::Vector2f& uv,
+                                      const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const
+{
+    if (!hasTexture())
+        return color;
+    Eigen::Array3f texColor = textureColor(uv, duvdx, duvdy);
+    switch (m_textureMode)
+    {
+    case MODULATE: return color * texColor;
+    case BLEND:    return 0.5f * (color + texColor);
+    case REPLACE:  return texColor;
+    }
+    return color;
+}
@@ -2,13 +2,15 @@
 #define SIRE_MATERIAL_H
 
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <QDomElement>
-#include <QImage>
 #include <math.h>
+#include "Texture.h"
 
 class Material
 {
 public:
+    Material() : m_textureMode(MODULATE), m_cachedTexture(-1), m_textureScaleU(1.f), m_textureScaleV(1.f) {}
 
     virtual Eigen::Array3f ambientColor() const = 0;
 
@@ -24,10 +26,21 @@ public:
     float textureScaleU() const { return m_textureScaleU; }
     float textureScaleV() const { return m_textureScaleV; }
     TextureMode textureMode() const { return m_textureMode; }
-    const QImage& texture() const { return m_texture; }
-
-    void setTexture(const QImage& texture) { m_texture = texture; }
-    void loadTextureFromFile(const QString& fileName);
+    const Texture& texture() const { return m_texture; }
+    bool hasTexture() const { return !m_texture.isNull() || m_cachedTexture>=0; }
+
+    /** \returns the texture color at \a uv (scaled by the texture scales).
+      * \a duvdx and \a duvdy are the derivatives of \a uv w.r.t. the image coordinates, used to filter the texture */
+    Eigen::Array3f textureColor(const Eigen::Vector2f& uv,
+                                const Eigen::Vector2f& duvdx = Eigen::Vector2f::Zero(), const Eigen::Vector2f& duvdy = Eigen::Vector2f::Zero()) const;
+    /// combines the shaded \a color with the texture color at \a uv according to the texture mode
+    Eigen::Array3f applyTexture(const Eigen::Array3f& color, const Eigen::Vector2f& uv,
+                                const Eigen::Vector2f& duvdx = Eigen::Vector2f::Zero(), const Eigen::Vector2f& duvdy = Eigen::Vector2f::Zero()) const;
+
+    void setTexture(const QImage& texture) { m_texture.setImage(texture); }
+    /** loads the texture \a fileName from the data directory.
+      * If \a lazy is true, the texture is only registered in the TextureCache and its tiles are loaded on demand. */
+    void loadTextureFromFile(const QString& fileName, bool lazy = false);
     void setTextureScale(float textureScale) { setTextureScaleU(textureScale); setTextureScaleV(textureScale); }
     void setTextureScaleU(float textureScaleU) { if (fabs(textureScaleU) > 1e-3) m_textureScaleU = textureScaleU; }
     void setTextureScaleV(float textureScaleV) { if (fabs(textureScaleV) > 1e-3) m_textureScaleV = textureScaleV; }
@@ -35,7 +48,8 @@ public:
 
 private:
     TextureMode m_textureMode;
-    QImage m_texture;
+    Texture m_texture;
+    int m_cachedTexture;    ///< id of the texture in the TextureCache, -1 if none
     float m_textureScaleU, m_textureScaleV;
 };
 
@@ -93,7 +107,7 @@ public:
 
         return m_diffuseColor / M_PI +
                 (m_specularColor / (4.0f * M_PI * m_ax * m_ay * sqrt(fmax(lightDir.dot(normal) * viewDir.dot(normal), 1e-8)))) *
-                exp(-(((h.dot(x) / m_ax) * (h.dot(x) / m_ax)) + ((h.dot(y) / m_ay) * (h.dot(y) / m_ay))) / (h.dot(normal)) * (h.dot(normal)));
+                exp(-(((h.dot(x) / m_ax) * (h.dot(x) / m_ax)) + ((h.dot(y) / m_ay) * (h.dot(y) / m_ay))) / (h.dot(normal) * h.dot(normal)));
     }
 
     Eigen::Array3f brdfReflect(const Eigen::Vector3f& /*viewDir*/, const Eigen::Vector3f& /*normal*/) const
@@ -0,0 +1,64 @@
+#include "MemoryStatistics.h"
+
+#include <algorithm>
+
+long long MemoryStatistics::ms_current[MemoryStatistics::NB_CATEGORIES];
+long long MemoryStatistics::ms_peak[MemoryStatistics::NB_CATEGORIES];
+long long MemoryStatistics::ms_currentTotal = 0;
+long long MemoryStatistics::ms_peakTotal = 0;
+
+void MemoryStatistics::add(Category category, long long bytes)
+{
+    // the reports are rare (loading, building), a critical section is cheap enough
+#pragma omp critical(MemoryStatistics)
+    {
+        ms_current[category] += bytes;
+        ms_peak[category] = std::max(ms_peak[category], ms_current[category]);
+        ms_currentTotal += bytes;
+        ms_peakTotal = std::max(ms_peakTotal, ms_currentTotal);
+    }
+}
+
+size_t MemoryStatistics::current(Category category)
+{
+    return size_t(ms_current[category]);
+}
+
+size_t MemoryStatistics::peak(Category category)
+{
+    return size_t(ms_peak[category]);
+}
+
+size_t MemoryStatistics::currentTotal()
+{
+    return size_t(ms_currentTotal);
+}
+
+size_t MemoryStatistics::peakTotal()
+{
+    return size_t(ms_peakTotal);
+}
+
+void MemoryStatistics::resetPeaks()
+{
+#pragma omp critical(MemoryStatistics)
+    {
+        for(int c=0; c<NB_CATEGORIES; ++c)
+            ms_peak[c] = ms_current[c];
+        ms_peakTotal = ms_currentTotal;
+    }
+}
+
+const char* MemoryStatistics::categoryName(int category)
+{
+    static const char* names[NB_CATEGORIES] = { "meshes", "BVHs", "cube maps", "textures", "texture cache", "framebuffers" };
+    return names[category];
+}
+
+void MemoryStatistics::print(std::ostream& out, const char* when)
+{
+    out << "Memory " << when << ": " << (currentTotal() >> 10) << "KB (peak " << (peakTotal() >> 10) << "KB)";
+    for(int c=0; c<NB_CATEGORIES; ++c)
+        out << ", " << categoryName(c) << " " << (current(Category(c)) >> 10) << "KB (peak " << (peak(Category(c)) >> 10) << "KB)";
+    out << "\n";
+}
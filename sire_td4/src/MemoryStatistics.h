@@ -0,0 +1,84 @@
+#ifndef SIRE_MEMORYSTATISTICS_H
+#define SIRE_MEMORYSTATISTICS_H
+
+#include <cstddef>
+#include <iostream>
+
+/** Accounting of the memory allocated by the subsystems, by category, with the peak of each category and of the total.
+  *
+  * The subsystems report their allocations through a MemoryAccount member, such that their contribution
+  * is removed when they are destroyed. Only the heap memory is counted: the data used in place from
+  * mapped files (binary caches, BVH files) is shared with the page cache and is not.
+  */
+class MemoryStatistics
+{
+public:
+    enum Category {
+        MESHES,             ///< vertices and faces, compressed or not
+        BVHS,               ///< nodes, face indices and gathered triangles
+        CUBEMAPS,           ///< environment map faces and their mip chains
+        TEXTURES,           ///< mip chains of the material and light textures
+        TEXTURE_CACHE,      ///< tiles resident in the TextureCache
+        FRAMEBUFFERS,       ///< images and buffers being rendered
+        NB_CATEGORIES
+    };
+
+    /// adds \a bytes (which may be negative) to the memory used by \a category, and updates the peaks
+    static void add(Category category, long long bytes);
+
+    /// \returns the number of bytes currently used by \a category
+    static size_t current(Category category);
+    /// \returns the maximal number of bytes used by \a category since the start or the last resetPeaks()
+    static size_t peak(Category category);
+    static size_t currentTotal();
+    /// \returns the maximal total number of bytes used, which may be less than the sum of the peaks of the categories
+    static size_t peakTotal();
+    /// sets the peaks to the current values
+    static void resetPeaks();
+
+    static const char* categoryName(int category);
+
+    /// prints the current and peak use of each category and of the total, \a when tells at which step of the program
+    static void print(std::ostream& out, const char* when);
+
+private:
+    static long long ms_current[NB_CATEGORIES];
+    static long long ms_peak[NB_CATEGORIES];
+    static long long ms_currentTotal;
+    static long long ms_peakTotal;
+};
+
+/** The memory reported by an object for one category of MemoryStatistics.
+  * Copying it reports the same amount again, as for the data of the copied object, and destroying it removes the amount. */
+class MemoryAccount
+{
+public:
+    explicit MemoryAccount(MemoryStatistics::Category category) : m_category(category), m_bytes(0) {}
+    MemoryAccount(const MemoryAccount& other) : m_category(other.m_category), m_bytes(0) { set(other.m_bytes); }
+    MemoryAccount& operator=(const MemoryAccount& other)
+    {
+        if(this!=&other)
+        {
+            set(0);
+            m_category = other.m_category;
+            set(other.m_bytes);
+        }
+        return *this;
+    }
+    ~MemoryAccount() { set(0); }
+
+    /// sets the number of bytes used by the object to \a bytes
+    void set(size_t bytes)
+    {
+        if(bytes!=m_bytes)
+            MemoryStatistics::add(m_category, (long long)bytes - (long long)m_bytes);
+        m_bytes = bytes;
+    }
+    size_t bytes() const { return m_bytes; }
+
+private:
+    MemoryStatistics::Category m_category;
+    size_t m_bytes;
+};
+
+#endif // SIRE_MEMORYSTATISTICS_H
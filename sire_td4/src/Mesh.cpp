@@ -7,19 +7,36 @@
 #include <iostream>
 #include <fstream>
 #include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <QCoreApplication>
 #include <Eigen/Geometry>
-#include <ObjFormat/ObjFormat.h>
+#include <ObjFormat/ObjUtil.h>
 #include <lib3ds/mesh.h>
 #include <lib3ds/file.h>
+#include <lib3ds/io.h>
 #include "BVH.h"
+#include "TextParser.h"
+#include "RenderStatistics.h"
+#include "Trace.h"
 
 using namespace Eigen;
 
 Mesh::Mesh(const std::string& filename)
-    : mIsInitialized(false), mBVH(0)
+    : mIsInitialized(false), mVerticesModified(false), mBVH(0), mBVHBuildMethod(BVH::MIDPOINT), mBVHOptimizationPasses(0), mBVHSpatialBudget(0.3f), mBVHGatherTriangles(false), mQuantizationBits(0),
+      mMemory(MemoryStatistics::MESHES), mCachePending(false)
 {
+    if(loadCache(filename))
+    {
+        mSourceFilename = filename;
+        return;
+    }
+
     std::string ext = filename.substr(filename.size()-3,3);
     if(ext=="off" || ext=="OFF")
         loadOFF(filename);
@@ -28,112 +45,709 @@ Mesh::Mesh(const std::string& filename)
     else if(ext=="3ds" || ext=="3DS")
         load3DS(filename);
     else
+    {
         std::cerr << "Mesh: extension \'" << ext << "\' not supported." << std::endl;
+        return;
+    }
+
+    // the cache is written once the BVH is known, see buildBVH()
+    if(!mFaces.empty())
+    {
+        mSourceFilename = filename;
+        mCachePending = true;
+    }
+}
+
+//--------------------------------------------------------------------------------
+// binary cache
+//--------------------------------------------------------------------------------
+
+/** Header of the binary cache of a mesh. It is followed by the vertex positions, the vertex attributes, the faces,
+  * and optionally the BVH (see BVH::write()), each of them starting at an offset multiple of 16.
+  */
+struct MeshCacheHeader
+{
+    enum { VERSION = 4 };
+
+    char magic[8];              ///< "SIREMESH"
+    int version;
+    int attributeSize;          ///< sizeof(Mesh::VertexAttributes), to detect incompatible builds
+    int faceSize;
+    int padding;
+    long long sourceSize;       ///< size of the source file
+    long long sourceTime;       ///< modification time of the source file
+    long long nbVertices, nbFaces;
+    long long positionsOffset, attributesOffset, facesOffset;
+    long long bvhOffset;        ///< 0 if the BVH has not been stored
+    unsigned long long geometryHash;
+    float aabb[6];
+};
+
+static const char s_meshCacheMagic[8] = { 'S', 'I', 'R', 'E', 'M', 'E', 'S', 'H' };
+
+static bool writePadding(FILE* f, long alignment)
+{
+    static const char zeros[16] = { 0 };
+    long pos = ftell(f);
+    long n = (alignment - pos % alignment) % alignment;
+    return n==0 || fwrite(zeros, 1, n, f)==size_t(n);
+}
+
+bool Mesh::loadCache(const std::string& filename)
+{
+    SIRE_TRACE_ZONE("Mesh::loadCache");
+    struct stat st;
+    if(stat(filename.c_str(), &st)!=0 || !mCacheFile.open(cacheFilename(filename)))
+        return false;
+
+    const char* data = mCacheFile.data();
+    size_t size = mCacheFile.size();
+    const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(data);
+    if(size < sizeof(MeshCacheHeader)
+            || memcmp(header->magic, s_meshCacheMagic, 8)!=0
+            || header->version != MeshCacheHeader::VERSION
+            || header->attributeSize != int(sizeof(VertexAttributes))
+            || header->faceSize != int(sizeof(FaceIndex))
+            || header->sourceSize != (long long)st.st_size
+            || header->sourceTime != (long long)st.st_mtime
+            || header->nbVertices < 0 || header->nbFaces <= 0
+            || size_t(header->positionsOffset + header->nbVertices*sizeof(Vector3f)) > size
+            || size_t(header->attributesOffset + header->nbVertices*sizeof(VertexAttributes)) > size
+            || size_t(header->facesOffset + header->nbFaces*sizeof(FaceIndex)) > size
+            || size_t(header->bvhOffset) > size)
+    {
+        mCacheFile.close();
+        return false;
+    }
+
+    // use the data in place
+    mPositions.setExternal(reinterpret_cast<const Vector3f*>(data + header->positionsOffset), header->nbVertices);
+    mAttributes.setExternal(reinterpret_cast<const VertexAttributes*>(data + header->attributesOffset), header->nbVertices);
+    mFaces.setExternal(reinterpret_cast<const FaceIndex*>(data + header->facesOffset), header->nbFaces);
+    mAABB = Eigen::AlignedBox3f(Vector3f(header->aabb), Vector3f(header->aabb+3));
+
+    delete mBVH;
+    mBVH = 0;
+    if(header->bvhOffset)
+    {
+        mBVH = new BVH;
+        if(!mBVH->attach(this, data + header->bvhOffset, size - header->bvhOffset, header->geometryHash))
+        {
+            std::cerr << "Mesh: invalid BVH in " << cacheFilename(filename) << std::endl;
+            delete mBVH;
+            mBVH = 0;
+        }
+    }
+    return true;
+}
+
+bool Mesh::saveCache(const std::string& filename) const
+{
+    SIRE_TRACE_ZONE("Mesh::saveCache");
+    struct stat st;
+    if(isCompressed() || stat(filename.c_str(), &st)!=0)
+        return false;
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, s_meshCacheMagic, 8);
+    header.version = MeshCacheHeader::VERSION;
+    header.attributeSize = sizeof(VertexAttributes);
+    header.faceSize = sizeof(FaceIndex);
+    header.sourceSize = st.st_size;
+    header.sourceTime = st.st_mtime;
+    header.nbVertices = mPositions.size();
+    header.nbFaces = mFaces.size();
+    header.geometryHash = geometryHash();
+    Vector3f::Map(header.aabb) = mAABB.min();
+    Vector3f::Map(header.aabb+3) = mAABB.max();
+
+    // write into a temporary file renamed once complete, such that other processes never map a partial cache
+    std::string cacheName = cacheFilename(filename);
+    std::ostringstream tmpStream;
+    tmpStream << cacheName << ".tmp" << getpid();
+    std::string tmpName = tmpStream.str();
+    FILE* f = fopen(tmpName.c_str(), "wb");
+    if(!f)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, f)==1 && writePadding(f, 16);
+    header.positionsOffset = ftell(f);
+    ok = ok && fwrite(mPositions.data(), sizeof(Vector3f), mPositions.size(), f)==mPositions.size() && writePadding(f, 16);
+    header.attributesOffset = ftell(f);
+    ok = ok && fwrite(mAttributes.data(), sizeof(VertexAttributes), mAttributes.size(), f)==mAttributes.size() && writePadding(f, 16);
+    header.facesOffset = ftell(f);
+    ok = ok && fwrite(mFaces.data(), sizeof(FaceIndex), mFaces.size(), f)==mFaces.size() && writePadding(f, 16);
+    if(mBVH)
+    {
+        header.bvhOffset = ftell(f);
+        ok = ok && mBVH->write(f, header.geometryHash);
+    }
+    // rewrite the header with the offsets
+    ok = ok && fseek(f, 0, SEEK_SET)==0 && fwrite(&header, sizeof(header), 1, f)==1;
+    ok = (fclose(f)==0) && ok;
+
+    if(!ok || rename(tmpName.c_str(), cacheName.c_str())!=0)
+    {
+        std::cerr << "Mesh: unable to write " << cacheName << std::endl;
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// \returns the hash \a h combined with the \a size bytes at \a data
+static unsigned long long hashBytes(unsigned long long h, const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for(; size>=8; size-=8, p+=8)
+    {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for(; size>0; --size, ++p)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+unsigned long long Mesh::geometryHash() const
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int counts[3] = { nbVertices(), nbFaces(), mQuantizationBits };
+    h = hashBytes(h, counts, sizeof(counts));
+    if(isCompressed())
+    {
+        h = hashBytes(h, mAABB.min().data(), sizeof(Vector3f));
+        h = hashBytes(h, mQuantizationScale.data(), sizeof(Array3f));
+        h = hashBytes(h, mQuantized16.data(), mQuantized16.size()*sizeof(unsigned short));
+        h = hashBytes(h, mQuantized21.data(), mQuantized21.size()*sizeof(unsigned long long));
+        h = hashBytes(h, mLocalIndices.data(), mLocalIndices.size()*sizeof(unsigned short));
+        h = hashBytes(h, mVertexBases.data(), mVertexBases.size()*sizeof(int));
+    }
+    else
+    {
+        h = hashBytes(h, mPositions.data(), mPositions.size()*sizeof(Vector3f));
+        h = hashBytes(h, mFaces.data(), mFaces.size()*sizeof(FaceIndex));
+    }
+    return h;
+}
+
+/** Returns true if the line starting at \a p contains data, i.e., is neither empty nor a comment */
+static inline bool isDataLine(const char* p, const char* end)
+{
+    p = TextParser::skipSpaces(p, end);
+    return p<end && *p!='\n' && *p!='#';
 }
 
 void Mesh::loadOFF(const std::string& filename)
 {
-    std::ifstream in(filename.c_str(),std::ios::in);
-    if(!in)
+    SIRE_TRACE_ZONE("Mesh::loadOFF");
+    MappedFile file;
+    if(!file.open(filename))
     {
         std::cerr << "File not found " << filename << std::endl;
         return;
     }
+    const char* p = file.data();
+    const char* end = p + file.size();
 
-    std::string header;
-    in >> header;
+    // skip the comments preceding the header
+    while(p<end && !isDataLine(p, end))
+        p = TextParser::nextLine(p, end);
 
     // check the header file
-    if(header != "OFF")
+    p = TextParser::skipSpaces(p, end);
+    if(size_t(end-p)<3 || strncmp(p, "OFF", 3)!=0)
+    {
+        std::cerr << "Wrong header = " << std::string(p, TextParser::endOfLine(p, end)) << std::endl;
+        return;
+    }
+    p += 3;
+
+    // the counts may be on the same line as the header, or on the next data line
+    int nofVertices, nofFaces, nofEdges;
+    const char* q = TextParser::parseInt(p, end, nofVertices);
+    while(!q && p<end)
+    {
+        p = TextParser::nextLine(p, end);
+        if(isDataLine(p, end))
+            q = TextParser::parseInt(p, end, nofVertices);
+    }
+    if(!q || !(q = TextParser::parseInt(q, end, nofFaces)) || nofVertices<0 || nofFaces<0)
     {
-        std::cerr << "Wrong header = " << header << std::endl;
+        std::cerr << "Mesh::loadOFF: invalid header in " << filename << std::endl;
         return;
     }
+    TextParser::parseInt(q, end, nofEdges);
+    const char* dataBegin = TextParser::nextLine(q, end);
+
+    // The data is split into line aligned chunks parsed in parallel, in three passes:
+    //  1 - count the data lines of each chunk, which gives the index of the first element of each chunk,
+    //  2 - parse the vertices and count the triangles of the faces,
+    //  3 - parse and triangulate the faces.
+    std::vector<const char*> chunks;
+    TextParser::splitLines(dataBegin, end, 1<<20, chunks);
+    int nbChunks = int(chunks.size())-1;
+    std::vector<long long> firstLine(nbChunks+1, 0), firstTriangle(nbChunks+1, 0);
+
+#pragma omp parallel for schedule(dynamic)
+    for(int c=0; c<nbChunks; ++c)
+    {
+        long long count = 0;
+        for(const char* l=chunks[c]; l<chunks[c+1]; l=TextParser::nextLine(l, chunks[c+1]))
+            if(isDataLine(l, chunks[c+1]))
+                ++count;
+        firstLine[c+1] = count;
+    }
+    for(int c=0; c<nbChunks; ++c)
+        firstLine[c+1] += firstLine[c];
 
-    int nofVertices, nofFaces, inull;
-    int nb, id0, id1, id2;
-    Vector3 v;
+    if(firstLine[nbChunks] < (long long)nofVertices + nofFaces)
+    {
+        std::cerr << "Mesh::loadOFF: " << filename << " is truncated" << std::endl;
+        return;
+    }
 
-    in >> nofVertices >> nofFaces >> inull;
+    clear();
+    resizeVertices(nofVertices);
+    Vector3f* positions = mPositions.data();
+    int nbErrors = 0;
 
-    for(int i=0 ; i<nofVertices ; ++i)
+#pragma omp parallel for schedule(dynamic) reduction(+:nbErrors)
+    for(int c=0; c<nbChunks; ++c)
     {
-        in >> v.x() >> v.y() >> v.z();
-        mVertices.push_back(v);
+        long long line = firstLine[c];
+        long long nbTriangles = 0;
+        const char* chunkEnd = chunks[c+1];
+        for(const char* l=chunks[c]; l<chunkEnd && line<(long long)nofVertices+nofFaces; l=TextParser::nextLine(l, chunkEnd))
+        {
+            if(!isDataLine(l, chunkEnd))
+                continue;
+            if(line<nofVertices)
+            {
+                Vector3f& v = positions[line];
+                if(!(l = TextParser::parseFloat(l, chunkEnd, v.x()))
+                        || !(l = TextParser::parseFloat(l, chunkEnd, v.y()))
+                        || !(l = TextParser::parseFloat(l, chunkEnd, v.z())))
+                {
+                    ++nbErrors;
+                    break;
+                }
+            }
+            else
+            {
+                int nb;
+                if(!(l = TextParser::parseInt(l, chunkEnd, nb)))
+                {
+                    ++nbErrors;
+                    break;
+                }
+                if(nb>=3)
+                    nbTriangles += nb-2;
+            }
+            ++line;
+        }
+        firstTriangle[c+1] = nbTriangles;
     }
+    for(int c=0; c<nbChunks; ++c)
+        firstTriangle[c+1] += firstTriangle[c];
 
-    for(int i=0 ; i<nofFaces ; ++i)
+    if(nbErrors==0)
     {
-        in >> nb >> id0 >> id1 >> id2;
-        assert(nb==3);
-        mFaces.push_back(FaceIndex(id0, id1, id2));
+        mFaces.resize(firstTriangle[nbChunks]);
+        FaceIndex* faces = mFaces.data();
+
+#pragma omp parallel for schedule(dynamic) reduction(+:nbErrors)
+        for(int c=0; c<nbChunks; ++c)
+        {
+            long long line = firstLine[c];
+            FaceIndex* face = faces + firstTriangle[c];
+            const char* chunkEnd = chunks[c+1];
+            for(const char* l=chunks[c]; l<chunkEnd && line<(long long)nofVertices+nofFaces; l=TextParser::nextLine(l, chunkEnd))
+            {
+                if(!isDataLine(l, chunkEnd))
+                    continue;
+                if(line++<nofVertices)
+                    continue;
+
+                // fan triangulation of the polygon
+                int nb, id0, id1, id2;
+                l = TextParser::parseInt(l, chunkEnd, nb);
+                for(int k=0; k<nb && nbErrors==0; ++k)
+                {
+                    int id;
+                    if(!(l = TextParser::parseInt(l, chunkEnd, id)) || id<0 || id>=nofVertices)
+                        ++nbErrors;
+                    else if(k==0)
+                        id0 = id;
+                    else if(k==1)
+                        id1 = id;
+                    else
+                    {
+                        id2 = id;
+                        *face++ = FaceIndex(id0, id1, id2);
+                        id1 = id2;
+                    }
+                }
+                if(nbErrors)
+                    break;
+            }
+        }
     }
 
-    in.close();
+    if(nbErrors!=0)
+    {
+        std::cerr << "Mesh::loadOFF: syntax error in " << filename << std::endl;
+        clear();
+        return;
+    }
 
     computeNormals();
     computeAABB();
+    updateMemoryAccount();
 }
 
-void Mesh::loadOBJ(const std::string& filename)
+/** Kinds of OBJ statements handled by Mesh::loadOBJ() */
+enum ObjStatement { OBJ_OTHER, OBJ_POSITION, OBJ_TEXCOORD, OBJ_NORMAL, OBJ_FACE };
+
+/** Reads the keyword of the line starting at \a p, and moves \a p after it */
+static inline ObjStatement objStatement(const char*& p, const char* end)
 {
-    ObjMesh* pRawObjMesh = ObjMesh::LoadFromFile(filename);
+    p = TextParser::skipSpaces(p, end);
+    if(end-p<2)
+        return OBJ_OTHER;
+    ObjStatement statement = OBJ_OTHER;
+    int length = 1;
+    if(p[0]=='f')
+        statement = OBJ_FACE;
+    else if(p[0]=='v')
+    {
+        if(p[1]=='t')       { statement = OBJ_TEXCOORD; length = 2; }
+        else if(p[1]=='n')  { statement = OBJ_NORMAL; length = 2; }
+        else                statement = OBJ_POSITION;
+    }
+    if(statement==OBJ_OTHER || p+length>=end || !TextParser::isSpace(p[length]))
+        return OBJ_OTHER;
+    p += length;
+    return statement;
+}
 
-    if (!pRawObjMesh)
+/** Parses a face corner "v", "v/vt", "v//vn" or "v/vt/vn". Missing indices are set to 0 */
+static inline const char* parseObjCorner(const char* p, const char* end, Vector3i& corner)
+{
+    corner.setZero();
+    if(!(p = TextParser::parseInt(p, end, corner(0))))
+        return 0;
+    if(p<end && *p=='/')
     {
-        std::cerr << "Mesh::loadObj: error loading file " << filename << "." << std::endl;
-        return;
+        ++p;
+        if(p<end && *p!='/' && !(p = TextParser::parseInt(p, end, corner(1))))
+            return 0;
+        if(p<end && *p=='/' && !(p = TextParser::parseInt(p+1, end, corner(2))))
+            return 0;
     }
+    return p;
+}
 
-    // Makes sure we have an indexed face set
-    ObjMesh* pObjMesh = pRawObjMesh->createIndexedFaceSet(Obj::Options(Obj::AllAttribs|Obj::Triangulate));
-    delete pRawObjMesh;
-    pRawObjMesh = 0;
+/** Converts the 1-based or relative (negative) OBJ index \a id to a 0-based index, -1 if missing.
+  * \a count is the number of elements defined so far, \returns false if the index is out of range */
+static inline bool resolveObjIndex(int& id, long long count, long long total)
+{
+    if(id>0)
+        --id;
+    else if(id<0)
+        id = int(count + id);
+    else
+    {
+        id = -1;
+        return true;
+    }
+    return id>=0 && id<total;
+}
 
-    // copy vertices
-    mVertices.resize(pObjMesh->positions.size());
+/** Number of elements of each kind found in a chunk of an OBJ file */
+struct ObjChunkCounts
+{
+    ObjChunkCounts() : nbPositions(0), nbTexcoords(0), nbNormals(0), nbTriangles(0) {}
+    long long nbPositions, nbTexcoords, nbNormals, nbTriangles;
+};
 
-    for (int i=0 ; i<pObjMesh->positions.size() ; ++i)
+void Mesh::loadOBJ(const std::string& filename)
+{
+    SIRE_TRACE_ZONE("Mesh::loadOBJ");
+    MappedFile file;
+    if(!file.open(filename))
     {
-        mVertices[i] = Vertex(Vector3f(pObjMesh->positions[i]));
-
-        if(!pObjMesh->texcoords.empty())
-            mVertices[i].texcoord = Vector2f(pObjMesh->texcoords[i]);
+        std::cerr << "Mesh::loadObj: error loading file " << filename << "." << std::endl;
+        return;
+    }
 
-        if(!pObjMesh->normals.empty())
-            mVertices[i].normal = Vector3f(pObjMesh->normals[i]);
+    // The file is split into line aligned chunks parsed in parallel, in three passes:
+    //  1 - count the elements of each chunk, which gives the index of the first element of each chunk,
+    //  2 - parse the attributes and the triangulated faces,
+    //  3 - merge the (position, texcoord, normal) triplets into vertices.
+    // If the file only has positions, the positions and faces are directly written in the mesh
+    // and the last pass is skipped.
+    std::vector<const char*> chunks;
+    TextParser::splitLines(file.data(), file.data()+file.size(), 1<<20, chunks);
+    int nbChunks = int(chunks.size())-1;
+    std::vector<ObjChunkCounts> first(nbChunks+1);
+
+#pragma omp parallel for schedule(dynamic)
+    for(int c=0; c<nbChunks; ++c)
+    {
+        ObjChunkCounts& counts = first[c+1];
+        const char* chunkEnd = chunks[c+1];
+        for(const char* l=chunks[c]; l<chunkEnd; l=TextParser::nextLine(l, chunkEnd))
+        {
+            switch(objStatement(l, chunkEnd))
+            {
+            case OBJ_POSITION: ++counts.nbPositions; break;
+            case OBJ_TEXCOORD: ++counts.nbTexcoords; break;
+            case OBJ_NORMAL:   ++counts.nbNormals; break;
+            case OBJ_FACE:
+            {
+                // count the corners, up to a trailing comment
+                const char* eol = TextParser::endOfStatement(l, chunkEnd, '#');
+                int nbCorners = 0;
+                for(l=TextParser::skipSpaces(l, eol); l<eol; l=TextParser::skipSpaces(l, eol))
+                {
+                    ++nbCorners;
+                    while(l<eol && !TextParser::isSpace(*l)) ++l;
+                }
+                counts.nbTriangles += std::max(0, nbCorners-2);
+                break;
+            }
+            default: break;
+            }
+        }
     }
+    for(int c=0; c<nbChunks; ++c)
+    {
+        first[c+1].nbPositions += first[c].nbPositions;
+        first[c+1].nbTexcoords += first[c].nbTexcoords;
+        first[c+1].nbNormals   += first[c].nbNormals;
+        first[c+1].nbTriangles += first[c].nbTriangles;
+    }
+    const ObjChunkCounts& total = first[nbChunks];
+    bool positionsOnly = total.nbTexcoords==0 && total.nbNormals==0;
+
+    clear();
+    std::vector<Vector3f> positions, normals;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3i> corners;
+    if(positionsOnly)
+    {
+        resizeVertices(total.nbPositions);
+        mFaces.resize(total.nbTriangles);
+    }
+    else
+    {
+        positions.resize(total.nbPositions);
+        texcoords.resize(total.nbTexcoords);
+        normals.resize(total.nbNormals);
+        corners.resize(3*total.nbTriangles);
+    }
+    Vector3f* meshPositions = mPositions.data();
+    FaceIndex* faces = mFaces.data();
+    int nbErrors = 0;
 
-    // copy faces
-    for (int smi=0 ; smi<pObjMesh->getNofSubMeshes() ; ++smi)
+#pragma omp parallel for schedule(dynamic) reduction(+:nbErrors)
+    for(int c=0; c<nbChunks; ++c)
     {
-        const ObjSubMesh* pSrcSubMesh = pObjMesh->getSubMesh(smi);
+        ObjChunkCounts counts = first[c];
+        const char* chunkEnd = chunks[c+1];
+        // the next line is located first, since l is null after a syntax error
+        for(const char* l=chunks[c], *next; l<chunkEnd && nbErrors==0; l=next)
+        {
+            next = TextParser::nextLine(l, chunkEnd);
+            switch(objStatement(l, chunkEnd))
+            {
+            case OBJ_POSITION:
+            {
+                Vector3f& p = positionsOnly ? meshPositions[counts.nbPositions] : positions[counts.nbPositions];
+                ++counts.nbPositions;
+                if(!(l = TextParser::parseFloat(l, chunkEnd, p.x())) || !(l = TextParser::parseFloat(l, chunkEnd, p.y()))
+                        || !(l = TextParser::parseFloat(l, chunkEnd, p.z())))
+                    ++nbErrors;
+                break;
+            }
+            case OBJ_TEXCOORD:
+            {
+                Vector2f& t = texcoords[counts.nbTexcoords++];
+                if(!(l = TextParser::parseFloat(l, chunkEnd, t.x())) || !(l = TextParser::parseFloat(l, chunkEnd, t.y())))
+                    ++nbErrors;
+                break;
+            }
+            case OBJ_NORMAL:
+            {
+                Vector3f& n = normals[counts.nbNormals++];
+                if(!(l = TextParser::parseFloat(l, chunkEnd, n.x())) || !(l = TextParser::parseFloat(l, chunkEnd, n.y()))
+                        || !(l = TextParser::parseFloat(l, chunkEnd, n.z())))
+                    ++nbErrors;
+                break;
+            }
+            case OBJ_FACE:
+            {
+                // fan triangulation of the polygon, up to a trailing comment
+                const char* eol = TextParser::endOfStatement(l, chunkEnd, '#');
+                Vector3i corner, c0, c1;
+                for(int k=0; (l = TextParser::skipSpaces(l, eol))<eol; ++k)
+                {
+                    if(!(l = parseObjCorner(l, eol, corner))
+                            || !resolveObjIndex(corner(0), counts.nbPositions, total.nbPositions) || corner(0)<0
+                            || !resolveObjIndex(corner(1), counts.nbTexcoords, total.nbTexcoords)
+                            || !resolveObjIndex(corner(2), counts.nbNormals, total.nbNormals))
+                    {
+                        ++nbErrors;
+                        break;
+                    }
+                    if(k==0)
+                        c0 = corner;
+                    else if(k>=2)
+                    {
+                        if(positionsOnly)
+                            faces[counts.nbTriangles] = FaceIndex(c0(0), c1(0), corner(0));
+                        else
+                        {
+                            Vector3i* triangle = &corners[3*counts.nbTriangles];
+                            triangle[0] = c0;
+                            triangle[1] = c1;
+                            triangle[2] = corner;
+                        }
+                        ++counts.nbTriangles;
+                    }
+                    c1 = corner;
+                }
+                break;
+            }
+            default: break;
+            }
+        }
+    }
 
-        mFaces.reserve(pSrcSubMesh->getNofFaces());
+    if(nbErrors!=0)
+    {
+        std::cerr << "Mesh::loadObj: syntax error in " << filename << "." << std::endl;
+        clear();
+        return;
+    }
 
-        for (uint fid = 0 ; fid<pSrcSubMesh->getNofFaces() ; ++fid)
+    if(!positionsOnly)
+    {
+        // merge the identical corners using a flat hash table, in their order of appearance
+        ObjVertexTable table(total.nbPositions);
+        mFaces.resize(total.nbTriangles);
+        faces = mFaces.data();
+        for(long long i=0; i<total.nbTriangles; ++i)
+            for(int k=0; k<3; ++k)
+            {
+                const Vector3i& corner = corners[3*i+k];
+                faces[i](k) = table.insert(corner(0), corner(1), corner(2));
+            }
+        std::vector<Vector3i>().swap(corners);
+
+        resizeVertices(table.size());
+        meshPositions = mPositions.data();
+        VertexAttributes* attributes = mAttributes.data();
+        int nbVertices = int(table.size());
+#pragma omp parallel for
+        for(int i=0; i<nbVertices; ++i)
         {
-            ObjConstFaceHandle srcFace = pSrcSubMesh->getFace(fid);
-            mFaces.push_back(Vector3i(srcFace.vPositionId(0), srcFace.vPositionId(1), srcFace.vPositionId(2)));
+            const ObjVertexTable::Key& key = table.key(i);
+            meshPositions[i] = positions[key.position];
+            if(key.texcoord>=0)
+                attributes[i].texcoord = texcoords[key.texcoord];
+            if(key.normal>=0)
+                attributes[i].normal = normals[key.normal];
         }
     }
 
-    if(pObjMesh->normals.empty())
+    if(total.nbNormals==0)
     {
         std::cout << "compute normals\n";
         computeNormals();
     }
+    computeAABB();
+    updateMemoryAccount();
 }
 
-void Mesh::load3DS(const std::string& filename)
+/** Read-only in-memory stream given to lib3ds through lib3ds_io_new() */
+struct Lib3dsMemoryStream
 {
-    Lib3dsFile* pFile = lib3ds_file_load(filename.c_str());
+    const char* data;
+    long size;
+    long pos;
+    bool error;
+};
 
-    if(pFile==0)
+static Lib3dsBool memoryio_error_func(void* self)
+{
+    return static_cast<Lib3dsMemoryStream*>(self)->error;
+}
+
+static long memoryio_seek_func(void* self, long offset, Lib3dsIoSeek origin)
+{
+    Lib3dsMemoryStream* stream = static_cast<Lib3dsMemoryStream*>(self);
+    long pos = offset;
+    if(origin==LIB3DS_SEEK_CUR)
+        pos += stream->pos;
+    else if(origin==LIB3DS_SEEK_END)
+        pos += stream->size;
+    if(pos<0 || pos>stream->size)
+        return -1;
+    stream->pos = pos;
+    return 0;
+}
+
+static long memoryio_tell_func(void* self)
+{
+    return static_cast<Lib3dsMemoryStream*>(self)->pos;
+}
+
+static int memoryio_read_func(void* self, Lib3dsByte* buffer, int size)
+{
+    Lib3dsMemoryStream* stream = static_cast<Lib3dsMemoryStream*>(self);
+    if(size > stream->size - stream->pos)
+    {
+        size = int(stream->size - stream->pos);
+        stream->error = true;
+    }
+    memcpy(buffer, stream->data + stream->pos, size);
+    stream->pos += size;
+    return size;
+}
+
+static int memoryio_write_func(void*, const Lib3dsByte*, int)
+{
+    return 0;
+}
+
+void Mesh::load3DS(const std::string& filename)
+{
+    SIRE_TRACE_ZONE("Mesh::load3DS");
+    // lib3ds reads the file field by field, so rather than going through stdio, it reads from a mapping of the file
+    MappedFile file;
+    if(!file.open(filename))
     {
         std::cerr << "file not find !" << std::endl;
         return;
     }
+    Lib3dsMemoryStream stream = { file.data(), long(file.size()), 0, false };
+    Lib3dsIo* io = lib3ds_io_new(&stream, memoryio_error_func, memoryio_seek_func, memoryio_tell_func,
+                                 memoryio_read_func, memoryio_write_func);
+    Lib3dsFile* pFile = lib3ds_file_new();
+    if(!io || !pFile || !lib3ds_file_read(pFile, io))
+    {
+        std::cerr << "Mesh::load3DS: error loading file " << filename << "." << std::endl;
+        if(io) lib3ds_io_free(io);
+        if(pFile) lib3ds_file_free(pFile);
+        return;
+    }
+    lib3ds_io_free(io);
+    file.close();
 
     lib3ds_file_eval(pFile,0);
 
@@ -143,58 +757,82 @@ void Mesh::load3DS(const std::string& filename)
       1 triangle = liste de 3 indices
   */
 
-    // Parcours de tous les sous-objets
-
-    /* pointeur sur le sous-objet courrant */
+    // Allocation des tableaux pour tous les sous-objets
+    size_t nbVertices = 0, nbFaces = 0;
     Lib3dsMesh* pMesh = NULL;
+    for(pMesh = pFile->meshes ; pMesh!=NULL ; pMesh = pMesh->next)
+    {
+        nbVertices += pMesh->points;
+        nbFaces += pMesh->faces;
+    }
+    clear();
+    resizeVertices(nbVertices);
+    mFaces.resize(nbFaces);
+    Vector3f* positions = mPositions.data();
+    VertexAttributes* attributes = mAttributes.data();
+    FaceIndex* faces = mFaces.data();
 
+    // Parcours de tous les sous-objets
     /* pFile->meshes == pointeur sur le premier sous-objet */
     for(pMesh = pFile->meshes ; pMesh!=NULL ; pMesh = pMesh->next)
     {
         // pMesh->name == nom du sous-objet courrant
-        uint i;
-        uint offset_id = mVertices.size();
-
-        // Parcours de tous les points du sous-objet
-        for (i = 0; i < pMesh->points; i++)
+        int offset_id = int(positions - mPositions.data());
+        int nbPoints = pMesh->points;
+        int nbTriangles = pMesh->faces;
+        // si il y a autant de coordonées de texture que de sommets, alors elles sont disponibles
+        bool hasTexcoords = pMesh->texels == pMesh->points;
+
+        // Copie de tous les points du sous-objet
+#pragma omp parallel for if(nbPoints>65536)
+        for (int i = 0; i < nbPoints; i++)
         {
-            /* position du sommet i */
-            mVertices.push_back(Vector3(pMesh->pointL[i].pos));
-
-            // si il y a autant de coordonées de texture que de sommets ...
-            if (pMesh->texels == pMesh->points)
-            {
-                // ... alors les coordonnées de texture sont disponibles :
-                mVertices.back().texcoord[0] = pMesh->texelL[i][0]; // i = numéro du sommet
-                mVertices.back().texcoord[1] = pMesh->texelL[i][1];
-            }
+            positions[i] = Vector3f(pMesh->pointL[i].pos);
+            if(hasTexcoords)
+                attributes[i].texcoord = Vector2f(pMesh->texelL[i]);
         }
 
-        // Parcours de toutes les faces du sous-objet
-        for (i = 0; i < pMesh->faces; i++)
+        // Copie de toutes les faces du sous-objet
+#pragma omp parallel for if(nbTriangles>65536)
+        for (int i = 0; i < nbTriangles; i++)
         {
-            mFaces.push_back(FaceIndex(
-                                 offset_id + pMesh->faceL[i].points[0],
-                             offset_id + pMesh->faceL[i].points[1],
-                    offset_id + pMesh->faceL[i].points[2]));
+            const Lib3dsWord* points = pMesh->faceL[i].points;
+            faces[i] = FaceIndex(offset_id + points[0], offset_id + points[1], offset_id + points[2]);
         }
+
+        positions += nbPoints;
+        attributes += nbPoints;
+        faces += nbTriangles;
     }
+    lib3ds_file_free(pFile);
 
     computeNormals();
     computeAABB();
+    updateMemoryAccount();
 }
 
 void Mesh::loadRawData(float* positions, int nbVertices, int* indices, int nbTriangles)
 {
-    mVertices.resize(nbVertices);
+    detachFromSource();
+    clear();
+    resizeVertices(nbVertices);
     for(int i=0; i<nbVertices; ++i)
-        mVertices[i].position = Eigen::Vector3f::Map(positions+3*i);
+        mPositions[i] = Eigen::Vector3f::Map(positions+3*i);
     mFaces.resize(nbTriangles);
     for(int i=0; i<nbTriangles; ++i)
         mFaces[i] = Eigen::Vector3i::Map(indices+3*i);
 
     computeNormals();
     computeAABB();
+    updateMemoryAccount();
+}
+
+void Mesh::detachFromSource()
+{
+    if(mCachePending && !mSourceFilename.empty())
+        saveCache(mSourceFilename);
+    mCachePending = false;
+    mSourceFilename.clear();
 }
 
 Mesh::~Mesh()
@@ -204,74 +842,320 @@ Mesh::~Mesh()
         glDeleteBuffers(1,&mVertexBufferId);
         glDeleteBuffers(1,&mIndexBufferId);
     }
+    // no BVH has been built, the cache only stores the geometry
+    if(mCachePending && !mSourceFilename.empty())
+        saveCache(mSourceFilename);
     delete mBVH;
 }
 
 void Mesh::makeUnitary()
 {
+    if(isCompressed())
+    {
+        std::cerr << "Mesh::makeUnitary: the geometry is compressed" << std::endl;
+        return;
+    }
+    detachFromSource();
+
     // computes the lowest and highest coordinates of the axis aligned bounding box,
     // which are equal to the lowest and highest coordinates of the vertex positions.
     Eigen::Vector3f lowest, highest;
     lowest.fill(std::numeric_limits<float>::max());   // "fill" sets all the coefficients of the vector to the same value
     highest.fill(-std::numeric_limits<float>::max());
 
-    for(VertexArray::iterator v_iter = mVertices.begin() ; v_iter!=mVertices.end() ; ++v_iter)
+    for(PositionArray::iterator v_iter = mPositions.begin() ; v_iter!=mPositions.end() ; ++v_iter)
     {
-        // - v_iter is an iterator over the elements of mVertices,
+        // - v_iter is an iterator over the elements of mPositions,
         //   an iterator behaves likes a pointer, it has to be dereferenced (*v_iter, or v_iter->) to access the referenced element.
         // - Here the .aray().min(_) and .array().max(_) operators work per component.
         //
-        lowest  = lowest.array().min(v_iter->position.array());
-        highest = highest.array().max(v_iter->position.array());
+        lowest  = lowest.array().min(v_iter->array());
+        highest = highest.array().max(v_iter->array());
     }
 
-    // TODO: appliquer une transformation à tous les sommets de mVertices de telle sorte
+    // TODO: appliquer une transformation à tous les sommets de mPositions de telle sorte
     // que la boite englobante de l'objet soit centrée en (0,0,0)  et que sa plus grande dimension soit de 1
     Eigen::Vector3f center = (lowest+highest)/2.0;
     float m = (highest-lowest).maxCoeff();
-    for(VertexArray::iterator v_iter = mVertices.begin() ; v_iter!=mVertices.end() ; ++v_iter)
-        v_iter->position = (v_iter->position - center) / m;
+    for(PositionArray::iterator v_iter = mPositions.begin() ; v_iter!=mPositions.end() ; ++v_iter)
+        *v_iter = (*v_iter - center) / m;
 
     computeAABB();
+    // the positions mapped from the binary cache have been copied
+    updateMemoryAccount();
 }
 
 void Mesh::computeNormals()
 {
+    if(isCompressed())
+    {
+        std::cerr << "Mesh::computeNormals: the geometry is compressed" << std::endl;
+        return;
+    }
+    detachFromSource();
+
     // pass 1: set the normal to 0
-    for(VertexArray::iterator v_iter = mVertices.begin() ; v_iter!=mVertices.end() ; ++v_iter)
+    for(AttributeArray::iterator v_iter = mAttributes.begin() ; v_iter!=mAttributes.end() ; ++v_iter)
         v_iter->normal.setZero();
 
     // pass 2: compute face normals and accumulate
-    for(FaceIndexArray::iterator f_iter = mFaces.begin() ; f_iter!=mFaces.end() ; ++f_iter)
+    const PositionArray& positions = mPositions;
+    const FaceIndexArray& faces = mFaces;
+    for(FaceIndexArray::const_iterator f_iter = faces.begin() ; f_iter!=faces.end() ; ++f_iter)
     {
-        Vector3f v0 = mVertices[(*f_iter)(0)].position;
-        Vector3f v1 = mVertices[(*f_iter)(1)].position;
-        Vector3f v2 = mVertices[(*f_iter)(2)].position;
+        Vector3f v0 = positions[(*f_iter)(0)];
+        Vector3f v1 = positions[(*f_iter)(1)];
+        Vector3f v2 = positions[(*f_iter)(2)];
 
         Vector3f n = (v1-v0).cross(v2-v0).normalized();
 
-        mVertices[(*f_iter)(0)].normal += n;
-        mVertices[(*f_iter)(1)].normal += n;
-        mVertices[(*f_iter)(2)].normal += n;
+        mAttributes[(*f_iter)(0)].normal += n;
+        mAttributes[(*f_iter)(1)].normal += n;
+        mAttributes[(*f_iter)(2)].normal += n;
     }
 
     // pass 3: normalize
-    for(VertexArray::iterator v_iter = mVertices.begin() ; v_iter!=mVertices.end() ; ++v_iter)
+    for(AttributeArray::iterator v_iter = mAttributes.begin() ; v_iter!=mAttributes.end() ; ++v_iter)
         v_iter->normal.normalize();
+    // the attributes mapped from the binary cache have been copied
+    updateMemoryAccount();
 }
 
 void Mesh::computeAABB()
 {
+    // the bounding box is the reference of the quantized positions
+    if(isCompressed())
+        return;
     mAABB.setNull();
-    for(VertexArray::iterator v_iter = mVertices.begin() ; v_iter!=mVertices.end() ; ++v_iter)
-        mAABB.extend(v_iter->position);
+    const PositionArray& positions = mPositions;
+    for(PositionArray::const_iterator v_iter = positions.begin() ; v_iter!=positions.end() ; ++v_iter)
+        mAABB.extend(*v_iter);
 }
 
-void Mesh::buildBVH()
+void Mesh::buildBVH(const std::string& bvhFilename)
 {
+    SIRE_TRACE_ZONE("Mesh::buildBVH");
+    BVH::BuildSettings settings = bvhSettings();
+    // the BVH mapped from the binary cache is still valid
+    if(mBVH && mBVH->isAttached() && !mSourceFilename.empty() && mBVH->buildSettings()==settings)
+        return;
+    // the faces of a compressed mesh are already sorted for its BVH
+    if(mBVH && (isCompressed() || mBVH->hasCompressedNodes()))
+        return;
+
     delete mBVH;
     mBVH = new BVH;
-    mBVH->build(this, 10, 100);
+    mBVH->setGatherTriangles(mBVHGatherTriangles);
+    unsigned long long hash = bvhFilename.empty() ? 0 : geometryHash();
+    if(bvhFilename.empty() || !mBVH->load(this, bvhFilename, hash, settings))
+    {
+        mBVH->build(this, settings);
+        if(!bvhFilename.empty())
+            mBVH->save(bvhFilename, hash);
+    }
+
+    // the cache is written once per geometry, with its BVH
+    if(!mSourceFilename.empty())
+        saveCache(mSourceFilename);
+    mCachePending = false;
+}
+
+void Mesh::setPositions(const std::vector<Vector3f>& positions)
+{
+    if(isCompressed() || int(positions.size())!=nbVertices())
+    {
+        std::cerr << "Mesh::setPositions: the geometry is compressed or the number of vertices differs" << std::endl;
+        return;
+    }
+    detachFromSource();
+    std::vector<Vector3f> copy(positions);
+    mPositions.swap(copy);
+    computeAABB();
+    mVerticesModified = true;
+    updateMemoryAccount();
+}
+
+BVH::BuildSettings Mesh::bvhSettings() const
+{
+    BVH::BuildSettings settings;
+    settings.method = mBVHBuildMethod;
+    if(mBVHBuildMethod==BVH::LINEAR)
+    {
+        settings.maxLeafSize = 4;
+        settings.maxDepth = 30;
+    }
+    else if(mBVHBuildMethod==BVH::SPATIAL)
+    {
+        settings.maxLeafSize = 4;
+        settings.spatialBudget = mBVHSpatialBudget;
+    }
+    settings.optimizationPasses = mBVHOptimizationPasses;
+    return settings;
+}
+
+bool Mesh::refitBVH(float maxDegradation)
+{
+    SIRE_TRACE_ZONE("Mesh::refitBVH");
+    if(mBVH)
+    {
+        mBVH->refit();
+        if(mBVH->sahDegradation() <= maxDegradation)
+            return false;
+        delete mBVH;
+        mBVH = 0;
+    }
+    buildBVH();
+    return true;
+}
+
+void Mesh::compressBVH()
+{
+    if(!mBVH)
+        buildBVH();
+    mBVH->compressNodes();
+}
+
+void Mesh::interleavedVertices(std::vector<Vertex>& vertices) const
+{
+    vertices.resize(nbVertices());
+    for(int i=0; i<nbVertices(); ++i)
+    {
+        vertices[i].position = position(i);
+        vertices[i].normal   = mAttributes[i].normal;
+        vertices[i].texcoord = mAttributes[i].texcoord;
+    }
+}
+
+void Mesh::clear()
+{
+    mPositions.clear();
+    mAttributes.clear();
+    mFaces.clear();
+    mQuantizationBits = 0;
+    mQuantized16.clear();
+    mQuantized21.clear();
+    mLocalIndices.clear();
+    mVertexBases.clear();
+    delete mBVH;
+    mBVH = 0;
+    updateMemoryAccount();
+}
+
+void Mesh::updateMemoryAccount()
+{
+    mMemory.set(mPositions.memoryFootprint() + mAttributes.memoryFootprint() + mFaces.memoryFootprint()
+              + mQuantized16.memoryFootprint() + mQuantized21.memoryFootprint()
+              + mLocalIndices.memoryFootprint() + mVertexBases.memoryFootprint());
+}
+
+void Mesh::compress(int bits)
+{
+    SIRE_TRACE_ZONE("Mesh::compress");
+    if(isCompressed() || nbFaces()==0)
+        return;
+    if(bits!=16 && bits!=21)
+    {
+        std::cerr << "Mesh::compress: " << bits << " bits per coordinate is not supported, using 16" << std::endl;
+        bits = 16;
+    }
+    if(!mBVH)
+        buildBVH();
+    // the faces are sorted following the leaves, which requires each face to be referenced once
+    if(mBVH->faceList().size()!=size_t(nbFaces()))
+    {
+        // the spatial splits duplicate faces, the midpoint build is used instead with the same optimization passes
+        BVH::BuildSettings settings = bvhSettings();
+        if(settings.method==BVH::SPATIAL)
+        {
+            BVH::BuildSettings midpoint;
+            midpoint.optimizationPasses = settings.optimizationPasses;
+            settings = midpoint;
+        }
+        std::cerr << "Mesh::compress: the BVH references " << mBVH->faceList().size() << " faces instead of " << nbFaces()
+                  << ", it is replaced by a BVH without spatial splits" << std::endl;
+        delete mBVH;
+        mBVH = new BVH;
+        mBVH->build(this, settings);
+    }
+
+    // Renumber the vertices in the order they are referenced by the faces sorted in leaf order,
+    // such that the vertices of a group of faces are close to each other. A vertex referenced by a group
+    // too far from its previous copy is duplicated, such that the local indices of a group fit in 16 bits.
+    const int nbFacesTotal = nbFaces();
+    const int nbGroups = (nbFacesTotal + FACE_GROUP_SIZE-1) / FACE_GROUP_SIZE;
+    const DataArray<int>& faceOrder = mBVH->faceList();
+    const FaceIndexArray& faces = mFaces;
+    const PositionArray& positions = mPositions;
+    const AttributeArray& sourceAttributes = mAttributes;
+    std::vector<int> newIndex(nbVertices(), -1);
+    std::vector<int> origin;               // source vertex of each new vertex
+    origin.reserve(nbVertices());
+    std::vector<unsigned short> localIndices(3*nbFacesTotal);
+    std::vector<int> vertexBases(nbGroups);
+    for(int g=0; g<nbGroups; ++g)
+    {
+        int start = g*FACE_GROUP_SIZE;
+        int end = std::min(start+FACE_GROUP_SIZE, nbFacesTotal);
+        int farthest = int(origin.size()) - 32768;
+        int base = std::numeric_limits<int>::max();
+        for(int i=start; i<end; ++i)
+            for(int k=0; k<3; ++k)
+            {
+                int v = faces[faceOrder[i]](k);
+                if(newIndex[v]<0 || newIndex[v]<farthest)
+                {
+                    newIndex[v] = origin.size();
+                    origin.push_back(v);
+                }
+                base = std::min(base, newIndex[v]);
+            }
+        vertexBases[g] = base;
+        for(int i=start; i<end; ++i)
+            for(int k=0; k<3; ++k)
+                localIndices[3*i+k] = (unsigned short)(newIndex[faces[faceOrder[i]](k)] - base);
+    }
+    std::vector<int>().swap(newIndex);
+
+    // quantize the positions relative to the bounding box, and reorder the attributes
+    const int nbNewVertices = origin.size();
+    const float maxValue = float((1<<bits) - 1);
+    Eigen::Array3f extent = (mAABB.max() - mAABB.min()).array().max(std::numeric_limits<float>::min());
+    AttributeArray attributes;
+    attributes.resize(nbNewVertices);
+    if(bits==16)
+        mQuantized16.resize(3*nbNewVertices);
+    else
+        mQuantized21.resize(nbNewVertices);
+    unsigned short* q16 = mQuantized16.data();
+    unsigned long long* q21 = mQuantized21.data();
+    VertexAttributes* newAttributes = attributes.data();
+#pragma omp parallel for
+    for(int i=0; i<nbNewVertices; ++i)
+    {
+        Eigen::Array3f q = ((positions[origin[i]] - mAABB.min()).array() / extent * maxValue + 0.5f).min(maxValue);
+        if(bits==16)
+        {
+            q16[3*i]   = (unsigned short)(q.x());
+            q16[3*i+1] = (unsigned short)(q.y());
+            q16[3*i+2] = (unsigned short)(q.z());
+        }
+        else
+            q21[i] = (unsigned long long)(q.x()) | ((unsigned long long)(q.y())<<21) | ((unsigned long long)(q.z())<<42);
+        newAttributes[i] = sourceAttributes[origin[i]];
+    }
+    mQuantizationScale = extent / maxValue;
+    mQuantizationBits = bits;
+
+    mLocalIndices.swap(localIndices);
+    mVertexBases.swap(vertexBases);
+    mAttributes.swap(attributes);
+    mPositions.clear();
+    mFaces.clear();
+    updateMemoryAccount();
+
+    // the faces are now in leaf order, and the boxes must enclose the quantized positions
+    mBVH->releaseFaceList();
+    mBVH->refit();
 }
 
 void Mesh::drawGeometry(int prg_id) const
@@ -281,15 +1165,35 @@ void Mesh::drawGeometry(int prg_id) const
         mIsInitialized = true;
         // this is the first call to drawGeometry
         // => create the BufferObjects and copy the related data into them.
+        // the interleaved vertices are only built for the upload
+        std::vector<Vertex> vertices;
+        interleavedVertices(vertices);
         glGenBuffers(1,&mVertexBufferId);
         glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferId);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex)*mVertices.size(), mVertices[0].position.data(), GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex)*vertices.size(), vertices[0].position.data(), GL_STATIC_DRAW);
 
+        // compressed faces are expanded for the upload
+        std::vector<FaceIndex> faces;
+        if(isCompressed())
+        {
+            faces.resize(nbFaces());
+            for(int i=0; i<nbFaces(); ++i)
+                faces[i] = FaceIndex(vertexOfFace(i,0), vertexOfFace(i,1), vertexOfFace(i,2));
+        }
         glGenBuffers(1,&mIndexBufferId);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBufferId);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(FaceIndex)*mFaces.size(), mFaces[0].data(), GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(FaceIndex)*nbFaces(), isCompressed() ? faces[0].data() : mFaces[0].data(), GL_STATIC_DRAW);
 
         glGenVertexArrays(1,&mVertexArrayId);GL_TEST_ERR;
+        mVerticesModified = false;
+    }
+    else if(mVerticesModified)
+    {
+        mVerticesModified = false;
+        std::vector<Vertex> vertices;
+        interleavedVertices(vertices);
+        glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferId);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Vertex)*vertices.size(), vertices[0].position.data());
     }
 
     // bind the vertex array
@@ -322,7 +1226,7 @@ void Mesh::drawGeometry(int prg_id) const
     }
 
     // send the geometry
-    glDrawElements(GL_TRIANGLES, 3*mFaces.size(), GL_UNSIGNED_INT, (void*)0);GL_TEST_ERR;
+    glDrawElements(GL_TRIANGLES, 3*nbFaces(), GL_UNSIGNED_INT, (void*)0);GL_TEST_ERR;
 
     if(texcoord_loc>=0) glDisableVertexAttribArray(texcoord_loc);
     if(normal_loc>=0)   glDisableVertexAttribArray(normal_loc);
@@ -332,14 +1236,14 @@ void Mesh::drawGeometry(int prg_id) const
     glBindVertexArray(0);GL_TEST_ERR;
 }
 
-long int Mesh::ms_itersection_count = 0;
-
 bool Mesh::intersectFace(const Ray& ray, Hit& hit, int faceId) const
 {
-    ms_itersection_count++;
-    Vector3f v0 = mVertices[mFaces[faceId](0)].position;
-    Vector3f v1 = mVertices[mFaces[faceId](1)].position;
-    Vector3f v2 = mVertices[mFaces[faceId](2)].position;
+    return intersectTriangle(ray, hit, faceId, positionOfFace(faceId, 0), positionOfFace(faceId, 1), positionOfFace(faceId, 2));
+}
+
+bool Mesh::intersectTriangle(const Ray& ray, Hit& hit, int faceId, const Vector3f& v0, const Vector3f& v1, const Vector3f& v2) const
+{
+    SIRE_COUNT(TRIANGLE_TESTS, ray.type(), 1);
     Vector3f e1 = v1 - v0;
     Vector3f e2 = v2 - v0;
     Matrix3f M;
@@ -348,24 +1252,48 @@ bool Mesh::intersectFace(const Ray& ray, Hit& hit, int faceId) const
     float t = tuv(0), u = tuv(1), v = tuv(2);
     if(t>0 && u>=0 && v>=0 && (u+v)<=1 && t<hit.t())
     {
+        // the shading data are only computed for the closest hit, by surfaceInteraction()
         hit.setT(t);
+        hit.setPrimitive(faceId, Vector2f(u,v));
+        return true;
+    }
+    return false;
+}
 
-        if(ray.shadowRay)
-            return true;
+void Mesh::surfaceInteraction(const Ray& ray, Hit& hit) const
+{
+    int faceId = hit.primitive();
+    float t = hit.t(), u = hit.barycentrics()(0), v = hit.barycentrics()(1);
+    hit.setIntersection(ray.at(t));
 
-        Vector3f n0 = mVertices[mFaces[faceId](0)].normal;
-        Vector3f n1 = mVertices[mFaces[faceId](1)].normal;
-        Vector3f n2 = mVertices[mFaces[faceId](2)].normal;
-        hit.setNormal(u*n1 + v*n2 + (1.-u-v)*n0);
+    const VertexAttributes& a0 = mAttributes[vertexOfFace(faceId, 0)];
+    const VertexAttributes& a1 = mAttributes[vertexOfFace(faceId, 1)];
+    const VertexAttributes& a2 = mAttributes[vertexOfFace(faceId, 2)];
+    hit.setNormal(u*a1.normal + v*a2.normal + (1.-u-v)*a0.normal);
 
-        Vector2f tc0 = mVertices[mFaces[faceId](0)].texcoord;
-        Vector2f tc1 = mVertices[mFaces[faceId](1)].texcoord;
-        Vector2f tc2 = mVertices[mFaces[faceId](2)].texcoord;
-        hit.setTexcoord(u*tc1 + v*tc2 + (1.-u-v)*tc0);
+    const Vector2f& tc0 = a0.texcoord;
+    const Vector2f& tc1 = a1.texcoord;
+    const Vector2f& tc2 = a2.texcoord;
+    hit.setTexcoord(u*tc1 + v*tc2 + (1.-u-v)*tc0);
 
-        return true;
+    if(ray.hasDifferentials)
+    {
+        // express the footprint of the ray in the barycentric coordinates of the face
+        Vector3f e1 = positionOfFace(faceId, 1) - positionOfFace(faceId, 0);
+        Vector3f e2 = positionOfFace(faceId, 2) - positionOfFace(faceId, 0);
+        Vector3f dPdx, dPdy;
+        ray.hitDifferentials(t, e1.cross(e2), dPdx, dPdy);
+        float a = e1.dot(e1), b = e1.dot(e2), c = e2.dot(e2);
+        float det = a*c - b*b;
+        if(det != 0.f)
+        {
+            float dudx = (c*e1.dot(dPdx) - b*e2.dot(dPdx)) / det;
+            float dvdx = (a*e2.dot(dPdx) - b*e1.dot(dPdx)) / det;
+            float dudy = (c*e1.dot(dPdy) - b*e2.dot(dPdy)) / det;
+            float dvdy = (a*e2.dot(dPdy) - b*e1.dot(dPdy)) / det;
+            hit.setTexcoordDifferentials(dudx*(tc1-tc0) + dvdx*(tc2-tc0), dudy*(tc1-tc0) + dvdy*(tc2-tc0));
+        }
     }
-    return false;
 }
 
 bool Mesh::intersect(const Ray& ray, Hit& hit) const
@@ -380,9 +1308,10 @@ bool Mesh::intersect(const Ray& ray, Hit& hit) const
         // brute force !!
         bool ret = false;
         float tMin, tMax;
+        SIRE_COUNT(BOX_TESTS, ray.type(), 1);
         if( (!::intersect(ray, mAABB, tMin, tMax)) || tMin>hit.t())
             return false;
-        for(int i=0; i<mFaces.size(); ++i)
+        for(int i=0; i<nbFaces(); ++i)
         {
             ret = ret | intersectFace(ray, hit, i);
         }
@@ -8,6 +8,9 @@
 #include <Eigen/Geometry>
 #include "Shape.h"
 #include "BVH.h"
+#include "DataArray.h"
+#include "MappedFile.h"
+#include "MemoryStatistics.h"
 
 /** \class Mesh
   * A class to represent a 3D triangular mesh
@@ -15,9 +18,18 @@
 class Mesh : public Shape
 {
 public:
-    static long int ms_itersection_count;
+    /** Represents the attributes of a vertex which are only needed for shading */
+    struct VertexAttributes
+    {
+      VertexAttributes()
+        : normal(Eigen::Vector3f::Zero()), texcoord(Eigen::Vector2f::Zero())
+      {}
+      Eigen::Vector3f normal;
+      Eigen::Vector2f texcoord;
+    };
 
-    /** Represents a vertex of the mesh */
+    /** Represents a vertex of the mesh with its interleaved attributes, as sent to OpenGL (see interleavedVertices()).
+      * The mesh itself stores the positions and the other attributes in separate arrays. */
     struct Vertex
     {
       Vertex()
@@ -31,9 +43,12 @@ public:
       Eigen::Vector2f texcoord;
     };
   
-    Mesh() : mIsInitialized(false) {}
+    Mesh() : mIsInitialized(false), mVerticesModified(false), mBVH(0), mBVHBuildMethod(BVH::MIDPOINT), mBVHOptimizationPasses(0), mBVHSpatialBudget(0.3f), mBVHGatherTriangles(false), mQuantizationBits(0), mMemory(MemoryStatistics::MESHES), mCachePending(false) {}
 
-    /** Default constructor loading a triangular mesh from the file \a filename */
+    /** Default constructor loading a triangular mesh from the file \a filename.
+      * The binary cache of the file is used if it is up to date, otherwise it is written once: with the BVH
+      * by the first buildBVH(), or without it before the geometry is first modified (makeUnitary()...)
+      * or at the destruction of the mesh (see loadCache()). */
     Mesh(const std::string& filename);
 
     /** Destructor */
@@ -55,20 +70,108 @@ public:
     virtual void drawGeometry(int prg_id) const;
     
     virtual bool intersect(const Ray& ray, Hit& hit) const;
+    virtual void surfaceInteraction(const Ray& ray, Hit& hit) const;
 
     /// compute the intersection between a ray and a given triangular face
     bool intersectFace(const Ray& ray, Hit& hit, int faceId) const;
 
+    /** compute the intersection between a ray and the face \a faceId whose vertex positions are \a v0, \a v1, \a v2.
+      * This allows the caller to provide positions it has gathered itself, the attributes are read from the mesh. */
+    bool intersectTriangle(const Ray& ray, Hit& hit, int faceId,
+                           const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2) const;
+
     void makeUnitary();
     void computeNormals();
     void computeAABB();
-    void buildBVH();
+    /** Builds the BVH, or reuses the one of the binary cache if the geometry has not been modified since it has been loaded.
+      * If \a bvhFilename is given, the BVH is mapped from this file if it has been built for the current geometry
+      * (see BVH::load()), otherwise it is built and written to it. This allows several processes rendering
+      * the same transformed mesh to build its BVH once and share it. */
+    void buildBVH(const std::string& bvhFilename = std::string());
+
+    /// sets the algorithm used by buildBVH() and refitBVH() to build the BVH
+    void setBVHBuildMethod(BVH::BuildMethod method) { mBVHBuildMethod = method; }
+    /// sets the number of treelet optimization passes run after building the BVH (see BVH::optimize()), 0 by default
+    void setBVHOptimization(int nbPasses) { mBVHOptimizationPasses = nbPasses; }
+    /// sets the fraction of duplicate face references allowed by the spatial splits of the BVH::SPATIAL method, 0.3 by default
+    void setBVHSpatialBudget(float memoryBudget) { mBVHSpatialBudget = memoryBudget; }
+    /// sets whether the BVHs built by buildBVH() copy the triangles in leaf order, see BVH::setGatherTriangles()
+    void setGatherTriangles(bool enabled) { mBVHGatherTriangles = enabled; }
+    /** Replaces the vertex positions by \a positions, which must have nbVertices() elements,
+      * e.g., for a deforming mesh whose connectivity does not change. The BVH is not updated (see refitBVH()). */
+    void setPositions(const std::vector<Eigen::Vector3f>& positions);
+
+    /** Updates the boxes of the BVH after the positions have been modified, keeping its tree (see BVH::refit()).
+      * The BVH is rebuilt instead if its SAH cost becomes more than \a maxDegradation times the one of the fresh tree.
+      * \returns true if the BVH has been rebuilt */
+    bool refitBVH(float maxDegradation = 1.5f);
+
+    /// \returns the BVH, or 0 if it has not been built
+    const BVH* bvh() const { return mBVH; }
+
+    /// stores the nodes of the BVH (built if needed) with 8-bit quantized boxes, see BVH::compressNodes()
+    void compressBVH();
+
+    /** Switches to the compressed geometry mode, for very large meshes.
+      * The faces are reordered following the leaves of the BVH (built if needed, or rebuilt with the midpoint method and a message if it has spatial splits), the positions are quantized
+      * to \a bits (16 or 21) bits per axis relative to the bounding box, and the faces are stored as 16-bit
+      * indices relative to a vertex base shared by consecutive faces.
+      * The uncompressed positions and faces, as well as the face list of the BVH, are released.
+      * The geometry cannot be modified afterwards (makeUnitary(), computeNormals()...). */
+    void compress(int bits = 16);
+
+    /// \returns true if the geometry is stored in compressed form (see compress())
+    bool isCompressed() const { return mQuantizationBits!=0; }
+
+    /** \returns the name of the binary cache of the mesh file \a filename.
+      * The cache stores the vertices, the faces, and the BVH once it has been built. */
+    static std::string cacheFilename(const std::string& filename) { return filename + ".cache"; }
+
+    /** maps the binary cache of \a filename, whose data are then used in place.
+      * \returns false if the cache does not exist, is invalid, or is older than \a filename */
+    bool loadCache(const std::string& filename);
+
+    /// writes the binary cache of \a filename, \returns false if an error occured
+    bool saveCache(const std::string& filename) const;
+
+    /// \returns a hash of the vertex positions and the faces, used to detect a BVH built for another geometry
+    unsigned long long geometryHash() const;
 
     /// \returns  the number of faces
-    int nbFaces() const { return mFaces.size(); }
+    int nbFaces() const { return isCompressed() ? mLocalIndices.size()/3 : mFaces.size(); }
 
-    /// \returns a const references to the \a vertexId -th vertex of the \a faceId -th face. vertexId must be between 0 and 2 !!
-    const Vertex& vertexOfFace(int faceId, int vertexId) const { return mVertices[mFaces[faceId](vertexId)]; }
+    /// \returns  the number of vertices
+    int nbVertices() const { return mAttributes.size(); }
+
+    /// \returns the index of the \a vertexId -th vertex of the \a faceId -th face. vertexId must be between 0 and 2 !!
+    int vertexOfFace(int faceId, int vertexId) const
+    {
+        if(isCompressed())
+            return mVertexBases[faceId/FACE_GROUP_SIZE] + mLocalIndices[3*faceId+vertexId];
+        return mFaces[faceId](vertexId);
+    }
+
+    /// \returns the position of the vertex \a id
+    Eigen::Vector3f position(int id) const
+    {
+        if(!isCompressed())
+            return mPositions[id];
+        Eigen::Array3f q;
+        if(mQuantizationBits==16)
+            q = Eigen::Array3f(mQuantized16[3*id], mQuantized16[3*id+1], mQuantized16[3*id+2]);
+        else
+        {
+            unsigned long long p = mQuantized21[id];
+            q = Eigen::Array3f(float(p & 0x1fffff), float((p>>21) & 0x1fffff), float((p>>42) & 0x1fffff));
+        }
+        return mAABB.min() + (q * mQuantizationScale).matrix();
+    }
+
+    /// \returns the position of the \a vertexId -th vertex of the \a faceId -th face. vertexId must be between 0 and 2 !!
+    Eigen::Vector3f positionOfFace(int faceId, int vertexId) const { return position(vertexOfFace(faceId, vertexId)); }
+
+    /// fills \a vertices with the positions and attributes of the vertices interleaved
+    void interleavedVertices(std::vector<Vertex>& vertices) const;
 
     virtual const Eigen::AlignedBox3f& AABB() const { return mAABB; }
     
@@ -79,14 +182,34 @@ protected:
     /** Represent a triangular face via its 3 vertex indices. */
     typedef Eigen::Vector3i FaceIndex;
 
-    /** Represents a sequential list of vertices */
-    typedef std::vector<Vertex> VertexArray;
+    /** Represents a sequential list of vertex positions */
+    typedef DataArray<Eigen::Vector3f> PositionArray;
 
-    /** Represents a sequential list of triangles */
-    typedef std::vector<FaceIndex> FaceIndexArray;
+    /** Represents a sequential list of vertex attributes */
+    typedef DataArray<VertexAttributes> AttributeArray;
 
-    /** The list of vertices */
-    VertexArray mVertices;
+    /** Represents a sequential list of triangles */
+    typedef DataArray<FaceIndex> FaceIndexArray;
+
+    /** the geometry is about to differ from its source file, its binary cache must not be used nor updated anymore.
+      * The cache is written first if it is still pending, such that the next loads of the file use it. */
+    void detachFromSource();
+
+    /// resizes the position and attribute arrays to \a n vertices
+    void resizeVertices(size_t n) { mPositions.resize(n); mAttributes.resize(n); }
+    void clear();
+    /// reports the memory owned by the vertex and face arrays to MemoryStatistics, to call after they are (re)allocated
+    void updateMemoryAccount();
+    /// \returns the settings of the BVH built by buildBVH(), see setBVHBuildMethod(), setBVHOptimization() and setBVHSpatialBudget()
+    BVH::BuildSettings bvhSettings() const;
+
+    /// number of consecutive faces sharing the same vertex base in compressed mode
+    enum { FACE_GROUP_SIZE = 16 };
+
+    /** The list of vertex positions, the only vertex data needed to intersect the mesh */
+    PositionArray mPositions;
+    /** The list of vertex attributes, only read for shading */
+    AttributeArray mAttributes;
     /** The list of face indices */
     FaceIndexArray mFaces;
 
@@ -97,8 +220,30 @@ protected:
     mutable unsigned int mIndexBufferId;  ///< the id of the BufferObject storing the faces indices
     mutable unsigned int mVertexArrayId;  ///< the id of the VertexArray object
     mutable bool mIsInitialized;
+    mutable bool mVerticesModified;       ///< the vertex BufferObject must be updated (see setPositions())
 
     BVH* mBVH;
+    BVH::BuildMethod mBVHBuildMethod;
+    int mBVHOptimizationPasses;
+    float mBVHSpatialBudget;
+    bool mBVHGatherTriangles;
+
+    /** \name Compressed geometry (see compress())
+      * The positions and faces are then stored in the following arrays instead of mPositions and mFaces. */
+    //@{
+    int mQuantizationBits;                      ///< 0 if the geometry is not compressed, otherwise 16 or 21
+    Eigen::Array3f mQuantizationScale;          ///< size of a quantization step along each axis
+    DataArray<unsigned short> mQuantized16;     ///< 3 coordinates per vertex, for 16 bits
+    DataArray<unsigned long long> mQuantized21; ///< 3 coordinates packed per vertex, for 21 bits
+    DataArray<unsigned short> mLocalIndices;    ///< 3 per face, relative to the vertex base of the face group
+    DataArray<int> mVertexBases;                ///< vertex base of each group of FACE_GROUP_SIZE faces
+    //@}
+
+    MemoryAccount mMemory;          ///< the memory owned by the arrays above, the mapped ones are not counted
+
+    MappedFile mCacheFile;          ///< binary cache the vertices, faces and BVH may refer to
+    std::string mSourceFilename;    ///< file the geometry has been loaded from, empty if it has been modified since
+    bool mCachePending;             ///< the geometry has been parsed from mSourceFilename and its binary cache is not written yet
 };
 
 #endif
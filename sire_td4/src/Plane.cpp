@@ -54,7 +54,12 @@ bool Plane::intersect(const Ray& ray, Hit& hit) const
         return false;
 
     hit.setT(t);
-    hit.setNormal(Pn);
 
     return true;
 }
+
+void Plane::surfaceInteraction(const Ray& ray, Hit& hit) const
+{
+    hit.setIntersection(ray.at(hit.t()));
+    hit.setNormal(Eigen::Vector3f(0.0,0.0,1.0));
+}
@@ -16,6 +16,7 @@ public:
     virtual const Eigen::AlignedBox3f& AABB() const;
 
     virtual bool intersect(const Ray& ray, Hit& hit) const;
+    virtual void surfaceInteraction(const Ray& ray, Hit& hit) const;
 
 protected:
     Mesh* mpMesh;
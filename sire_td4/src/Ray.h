@@ -9,9 +9,9 @@ class Ray
 {
 public:
     Ray(const Eigen::Vector3f& o, const Eigen::Vector3f& d)
-        : origin(o), direction(d), beta(1.), recursionLevel(0), shadowRay(false)
+        : origin(o), direction(d), beta(1.), recursionLevel(0), shadowRay(false), hasDifferentials(false)
     {}
-    Ray() : beta(1.), recursionLevel(0), shadowRay(false) {}
+    Ray() : beta(1.), recursionLevel(0), shadowRay(false), hasDifferentials(false) {}
 
     Eigen::Vector3f origin;
     Eigen::Vector3f direction;
@@ -21,20 +21,90 @@ public:
     float beta;           ///< contribution percentage to the final value (used as a stoping critera)
     int recursionLevel;   ///< recursion level (used as a stoping critera)
     bool shadowRay;       ///< tag for shadow rays
+
+    /// kinds of rays, distinguished by the statistics
+    enum Type { PRIMARY, SECONDARY, SHADOW, NB_TYPES };
+    Type type() const { return shadowRay ? SHADOW : (recursionLevel==0 ? PRIMARY : SECONDARY); }
+    static const char* typeName(int type)
+    {
+        static const char* names[NB_TYPES] = { "primary", "secondary", "shadow" };
+        return names[type];
+    }
+
+    /** \name Ray differentials
+      * Derivatives of the origin and direction with respect to the image coordinates (in pixels),
+      * they are only meaningful if hasDifferentials is true. */
+    //@{
+    bool hasDifferentials;
+    Eigen::Vector3f dOdx, dOdy;
+    Eigen::Vector3f dDdx, dDdy;
+    //@}
+
+    /** sets the differentials of a ray starting at a fixed point and whose direction is \a p normalized,
+      * \a dpdx and \a dpdy being the derivatives of \a p */
+    void setDirectionDifferentials(const Eigen::Vector3f& p, const Eigen::Vector3f& dpdx, const Eigen::Vector3f& dpdy)
+    {
+        float invNorm = 1.f / p.norm();
+        float invNorm3 = invNorm * invNorm * invNorm;
+        hasDifferentials = true;
+        dOdx.setZero();
+        dOdy.setZero();
+        dDdx = (p.squaredNorm() * dpdx - p.dot(dpdx) * p) * invNorm3;
+        dDdy = (p.squaredNorm() * dpdy - p.dot(dpdy) * p) * invNorm3;
+    }
+
+    /** computes the derivatives \a dPdx, \a dPdy of the intersection point at(\a t)
+      * with a surface of normal \a n (the normal does not need to be normalized) */
+    void hitDifferentials(float t, const Eigen::Vector3f& n, Eigen::Vector3f& dPdx, Eigen::Vector3f& dPdy) const
+    {
+        float dn = direction.dot(n);
+        if(!hasDifferentials || dn==0.f)
+        {
+            dPdx.setZero();
+            dPdy.setZero();
+            return;
+        }
+        // move the offset rays to the tangent plane of the hit point
+        Eigen::Vector3f px = dOdx + t*dDdx;
+        Eigen::Vector3f py = dOdy + t*dDdy;
+        dPdx = px - (px.dot(n) / dn) * direction;
+        dPdy = py - (py.dot(n) / dn) * direction;
+    }
+
+    /** sets the differentials of the ray reflected at the distance \a t along \a incident by a mirror of normal \a n.
+      * The surface is assumed to be locally flat (the derivatives of the normal are neglected). */
+    void setReflectedDifferentials(const Ray& incident, float t, const Eigen::Vector3f& n)
+    {
+        hasDifferentials = incident.hasDifferentials;
+        if(!hasDifferentials)
+            return;
+        incident.hitDifferentials(t, n, dOdx, dOdy);
+        dDdx = incident.dDdx - 2.f * incident.dDdx.dot(n) * n;
+        dDdy = incident.dDdy - 2.f * incident.dDdy.dot(n) * n;
+    }
 };
 
+/** Intersection record.
+  * During the traversal, the shapes only record the distance t, the primitive and its barycentric coordinates.
+  * The shading data (intersection point, normal, texture coordinates) are computed once for the closest hit
+  * by Shape::surfaceInteraction().
+  */
 class Hit
 {
 private:
     Eigen::Vector3f m_intersection;
     Eigen::Vector3f m_normal;
     Eigen::Vector2f m_texcoord;
+    Eigen::Vector2f m_dTexcoordDx, m_dTexcoordDy;
+    Eigen::Vector2f m_barycentrics;
     const Object* mp_object;
+    int m_primitive;
     float m_t;
 
 public:
     Hit()
-        : m_texcoord(0,0), mp_object(0), m_t(std::numeric_limits<float>::max())
+        : m_texcoord(0,0), m_dTexcoordDx(0,0), m_dTexcoordDy(0,0), m_barycentrics(0,0), mp_object(0), m_primitive(-1),
+          m_t(std::numeric_limits<float>::max())
     {}
     bool foundIntersection() const { return m_t < std::numeric_limits<float>::max(); }
 
@@ -42,7 +112,12 @@ public:
     float t() const { return m_t; }
 
     void setIntersection(const Eigen::Vector3f& i) { m_intersection = i; }
-    const Eigen::Vector3f& intersection() { return m_intersection; }
+    const Eigen::Vector3f& intersection() const { return m_intersection; }
+
+    /// sets the index of the primitive (e.g., the face of a mesh) hit, and the barycentric coordinates of the hit point in it
+    void setPrimitive(int id, const Eigen::Vector2f& barycentrics) { m_primitive = id; m_barycentrics = barycentrics; }
+    int primitive() const { return m_primitive; }
+    const Eigen::Vector2f& barycentrics() const { return m_barycentrics; }
 
     void setObject(const Object* obj) { mp_object = obj; }
     const Object* object() const { return mp_object; }
@@ -52,6 +127,11 @@ public:
 
     void setTexcoord(const Eigen::Vector2f& uv) { m_texcoord = uv; }
     const Eigen::Vector2f& texcoord() const { return m_texcoord; }
+
+    /// sets the derivatives of the texture coordinates with respect to the image coordinates
+    void setTexcoordDifferentials(const Eigen::Vector2f& dx, const Eigen::Vector2f& dy) { m_dTexcoordDx = dx; m_dTexcoordDy = dy; }
+    const Eigen::Vector2f& dTexcoordDx() const { return m_dTexcoordDx; }
+    const Eigen::Vector2f& dTexcoordDy() const { return m_dTexcoordDy; }
 };
 
 /** Compute the intersection between a ray and an aligned box
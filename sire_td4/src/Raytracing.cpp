@@ -1,25 +1,69 @@
 
 #include "Raytracing.h"
 #include "camera.h"
+#include "RenderStatistics.h"
+#include "MemoryStatistics.h"
+#include "Trace.h"
 
 #include <Eigen/Geometry>
 #include <QProgressDialog>
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <time.h>
+
+/// \returns a monotonic time in microseconds
+static double currentTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+/// \returns the cost of the work counted so far by the calling thread for the given heatmap mode
+static double pixelCost(Raytracing::Mode mode)
+{
+    if(mode==Raytracing::HEATMAP_TIME)
+        return currentTime();
+    RenderStatistics::Counter counter = mode==Raytracing::HEATMAP_NODES ? RenderStatistics::NODES_VISITED : RenderStatistics::TRIANGLE_TESTS;
+    const RenderStatistics::Counters& counters = RenderStatistics::threadCounters();
+    long long sum = 0;
+    for(int type=0; type<Ray::NB_TYPES; ++type)
+        sum += counters.values[counter][type];
+    return double(sum);
+}
 
 /** Render a scene using a raytracer.
   *
+  * The render statistics are reset before and printed after the rendering, and also written
+  * in JSON to the file named by the SIRE_STATISTICS_JSON environment variable if it is set.
+  * The memory statistics are printed at the end, the image being accounted as a framebuffer.
   */
-QImage Raytracing::raytraceImage(const Scene &scene)
+QImage Raytracing::raytraceImage(const Scene &scene, Mode mode, std::vector<float>* costs)
 {
+    SIRE_TRACE_ZONE("Raytracing::raytraceImage");
     QProgressDialog progress("Raytracing...", "Cancel", 0, scene.camera().vpWidth() * scene.camera().vpHeight());
     progress.setWindowModality(Qt::WindowModal);
 
     using namespace Eigen;
-    float tanfovy2 = tan(scene.camera().fovY()*0.5);
-    Vector3f camX = scene.camera().right() * tanfovy2 * scene.camera().nearDist() * float(scene.camera().vpWidth())/float(scene.camera().vpHeight());
-    Vector3f camY = scene.camera().up() * tanfovy2 * scene.camera().nearDist();
-    Vector3f camF = scene.camera().direction() * scene.camera().nearDist();
     QImage img(scene.camera().vpWidth(), scene.camera().vpHeight(), QImage::Format_ARGB32);
+    RenderStatistics::reset();
+    std::vector<float> pixelCosts;
+    if(mode!=SHADED)
+    {
+#if !SIRE_RENDER_STATISTICS
+        if(mode!=HEATMAP_TIME)
+            std::cerr << "Raytracing: the node and triangle heatmaps require SIRE_RENDER_STATISTICS" << std::endl;
+#endif
+        pixelCosts.resize(scene.camera().vpWidth() * scene.camera().vpHeight(), 0.f);
+    }
+    MemoryAccount framebuffers(MemoryStatistics::FRAMEBUFFERS);
+    framebuffers.set(size_t(img.bytesPerLine())*img.height() + pixelCosts.capacity()*sizeof(float));
     for(int j=0; j<scene.camera().vpHeight(); ++j)
+    {
+        SIRE_TRACE_ZONE("Raytracing row");
         for(int i=0; i<scene.camera().vpWidth(); ++i)
         {
             progress.setValue(j*scene.camera().vpHeight() + i);
@@ -27,13 +71,16 @@ QImage Raytracing::raytraceImage(const Scene &scene)
                 return img;
 
             // compute the primary ray parameters
-            Ray ray;
-            ray.origin = scene.camera().position();
-            scene.camera().direction();
-            ray.direction = (camF + camX * (2.0*float(i+0.5)/float(scene.camera().vpWidth()) - 1.) - camY * (2.0*float(j+0.5)/float(scene.camera().vpHeight()) - 1.0)).normalized();
+            Ray ray = primaryRay(scene.camera(), i+0.5f, j+0.5f);
 
             // raytrace the ray
+            double cost = mode!=SHADED ? pixelCost(mode) : 0.;
             Eigen::Array3f color = scene.raytrace(ray);
+            if(mode!=SHADED)
+            {
+                pixelCosts[j*scene.camera().vpWidth() + i] = float(pixelCost(mode) - cost);
+                continue;
+            }
 
             // Basic tone mapping, and mapping from 0:1 to 0:255
             color /= (color + 0.25);
@@ -43,5 +90,87 @@ QImage Raytracing::raytraceImage(const Scene &scene)
 
             img.setPixel(i, j, qRgb(color(0), color(1), color(2)));
         }
+    }
+
+    if(mode!=SHADED)
+    {
+        static const char* names[] = { "", "BVH nodes visited", "triangles tested", "microseconds" };
+        float maxCost = pixelCosts.empty() ? 0.f : *std::max_element(pixelCosts.begin(), pixelCosts.end());
+        double sum = 0.;
+        for(size_t k=0; k<pixelCosts.size(); ++k)
+            sum += pixelCosts[k];
+        std::cout << "Heatmap: " << names[mode] << " per pixel, average " << sum/std::max<size_t>(1, pixelCosts.size())
+                  << ", maximum " << maxCost << " (red)\n";
+        for(int j=0; j<img.height(); ++j)
+            for(int i=0; i<img.width(); ++i)
+                img.setPixel(i, j, falseColor(maxCost>0.f ? pixelCosts[j*img.width() + i]/maxCost : 0.f));
+        if(costs)
+            costs->swap(pixelCosts);
+    }
+
+    RenderStatistics::print(std::cout);
+    MemoryStatistics::print(std::cout, "after rendering");
+    if(const char* filename = getenv("SIRE_STATISTICS_JSON"))
+    {
+        std::ofstream out(filename);
+        if(out)
+            RenderStatistics::printJSON(out);
+        else
+            std::cerr << "Raytracing: cannot write the statistics to " << filename << std::endl;
+    }
     return img;
 }
+
+Ray Raytracing::primaryRay(const Camera& camera, float x, float y)
+{
+    using namespace Eigen;
+    float tanfovy2 = tan(camera.fovY()*0.5);
+    Vector3f camX = camera.right() * tanfovy2 * camera.nearDist() * float(camera.vpWidth())/float(camera.vpHeight());
+    Vector3f camY = camera.up() * tanfovy2 * camera.nearDist();
+    Vector3f camF = camera.direction() * camera.nearDist();
+    // derivatives of the image plane point w.r.t. the pixel coordinates
+    Vector3f dpdx = camX * (2.f/float(camera.vpWidth()));
+    Vector3f dpdy = -camY * (2.f/float(camera.vpHeight()));
+
+    Ray ray;
+    ray.origin = camera.position();
+    Vector3f p = camF + camX * (2.0*x/float(camera.vpWidth()) - 1.) - camY * (2.0*y/float(camera.vpHeight()) - 1.0);
+    ray.direction = p.normalized();
+    ray.setDirectionDifferentials(p, dpdx, dpdy);
+    return ray;
+}
+
+/// maps \a x in [0,1] to the blue, cyan, green, yellow, red color ramp
+QRgb Raytracing::falseColor(float x)
+{
+    static const float ramp[5][3] = { {0,0,1}, {0,1,1}, {0,1,0}, {1,1,0}, {1,0,0} };
+    x = std::min(std::max(x, 0.f), 1.f) * 4.f;
+    int k = std::min(int(x), 3);
+    float a = x - k;
+    float c[3];
+    for(int d=0; d<3; ++d)
+        c[d] = (1.f-a)*ramp[k][d] + a*ramp[k+1][d];
+    return qRgb(int(255*c[0]), int(255*c[1]), int(255*c[2]));
+}
+
+bool Raytracing::saveCosts(const std::string& filename, int width, int height, const std::vector<float>& costs)
+{
+    SIRE_TRACE_ZONE("Raytracing::saveCosts");
+    if(costs.size()!=size_t(width*height))
+        return false;
+    FILE* f = fopen(filename.c_str(), "wb");
+    if(!f)
+    {
+        std::cerr << "Raytracing: cannot open " << filename << " for writing" << std::endl;
+        return false;
+    }
+    // PFM stores the rows from bottom to top, the negative scale tells they are little endian
+    fprintf(f, "Pf\n%d %d\n-1.0\n", width, height);
+    bool ok = true;
+    for(int j=height-1; j>=0 && ok; --j)
+        ok = fwrite(&costs[j*width], sizeof(float), width, f)==size_t(width);
+    ok = fclose(f)==0 && ok;
+    if(!ok)
+        std::cerr << "Raytracing: error while writing " << filename << std::endl;
+    return ok;
+}
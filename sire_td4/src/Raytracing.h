@@ -4,11 +4,33 @@
 
 #include "Scene.h"
 #include <QImage>
+#include <vector>
+#include <string>
 
 class Raytracing
 {
 public:
-    static QImage raytraceImage(const Scene& scene);
+    /// what raytraceImage() writes in the pixels
+    enum Mode {
+        SHADED,                 ///< the radiance
+        HEATMAP_NODES,          ///< the number of BVH nodes visited by all the rays of the pixel
+        HEATMAP_TRIANGLES,      ///< the number of ray/triangle tests of all the rays of the pixel
+        HEATMAP_TIME            ///< the rendering time of the pixel, in microseconds
+    };
+
+    /** Renders \a scene. In the heatmap modes, the cost of each pixel is mapped to a false color from blue (no cost)
+      * to red (the maximal cost in the image), and the raw costs are stored row by row in \a costs if not null.
+      * The node and triangle heatmaps require SIRE_RENDER_STATISTICS. */
+    static QImage raytraceImage(const Scene& scene, Mode mode = SHADED, std::vector<float>* costs = 0);
+
+    /// saves \a costs of a \a width x \a height heatmap as a grayscale PFM image, \returns false on failure
+    static bool saveCosts(const std::string& filename, int width, int height, const std::vector<float>& costs);
+
+    /// \returns the ray, with its differentials, of \a camera through the point (\a x, \a y) of the image in pixels
+    static Ray primaryRay(const Camera& camera, float x, float y);
+
+private:
+    static QRgb falseColor(float x);
 };
 
 #endif // SIRE_RAYTRACING_H
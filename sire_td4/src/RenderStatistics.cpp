@@ -0,0 +1,80 @@
+#include "RenderStatistics.h"
+
+#include <cstring>
+#include <algorithm>
+
+RenderStatistics::ThreadCounters RenderStatistics::ms_threadCounters[RenderStatistics::MAX_THREADS];
+RenderStatistics::ThreadCounters RenderStatistics::ms_sharedCounters;
+int RenderStatistics::ms_nbThreads = 0;
+__thread RenderStatistics::ThreadCounters* RenderStatistics::ms_thread = 0;
+
+RenderStatistics::ThreadCounters* RenderStatistics::registerThread()
+{
+    int slot = __sync_fetch_and_add(&ms_nbThreads, 1);
+    ms_thread = slot<MAX_THREADS ? &ms_threadCounters[slot] : &ms_sharedCounters;
+    return ms_thread;
+}
+
+RenderStatistics::Counters RenderStatistics::totals()
+{
+    Counters res = ms_sharedCounters.counters;
+    const int nbThreads = std::min<int>(ms_nbThreads, MAX_THREADS);
+    for(int t=0; t<nbThreads; ++t)
+        for(int c=0; c<NB_COUNTERS; ++c)
+            for(int type=0; type<Ray::NB_TYPES; ++type)
+                res.values[c][type] += ms_threadCounters[t].counters.values[c][type];
+    return res;
+}
+
+void RenderStatistics::reset()
+{
+    // the threads keep their counters
+    memset(ms_threadCounters, 0, sizeof(ms_threadCounters));
+    memset(&ms_sharedCounters, 0, sizeof(ms_sharedCounters));
+}
+
+const char* RenderStatistics::counterName(int counter)
+{
+    static const char* names[NB_COUNTERS] = { "rays", "nodes_visited", "box_tests", "triangle_tests", "shading_calls", "light_samples" };
+    return names[counter];
+}
+
+void RenderStatistics::print(std::ostream& out)
+{
+#if SIRE_RENDER_STATISTICS
+    Counters stats = totals();
+    for(int type=0; type<Ray::NB_TYPES; ++type)
+    {
+        long long nbRays = stats.values[RAYS][type];
+        bool counted = false;
+        for(int c=0; c<NB_COUNTERS; ++c)
+            counted = counted || stats.values[c][type]!=0;
+        if(!counted)
+            continue;
+        out << "Render statistics, " << Ray::typeName(type) << " rays: " << nbRays << " rays";
+        for(int c=RAYS+1; c<NB_COUNTERS; ++c)
+        {
+            out << ", " << counterName(c) << " " << stats.values[c][type];
+            if(nbRays>0)
+                out << " (" << double(stats.values[c][type])/nbRays << "/ray)";
+        }
+        out << "\n";
+    }
+#else
+    out << "Render statistics: disabled at compile time (SIRE_RENDER_STATISTICS)\n";
+#endif
+}
+
+void RenderStatistics::printJSON(std::ostream& out)
+{
+    Counters stats = totals();
+    out << "{\n";
+    for(int c=0; c<NB_COUNTERS; ++c)
+    {
+        out << "  \"" << counterName(c) << "\": { ";
+        for(int type=0; type<Ray::NB_TYPES; ++type)
+            out << "\"" << Ray::typeName(type) << "\": " << stats.values[c][type] << (type+1<Ray::NB_TYPES ? ", " : " ");
+        out << "}" << (c+1<NB_COUNTERS ? ",\n" : "\n");
+    }
+    out << "}\n";
+}
@@ -0,0 +1,86 @@
+#ifndef SIRE_RENDERSTATISTICS_H
+#define SIRE_RENDERSTATISTICS_H
+
+#include "Ray.h"
+#include <iostream>
+
+/// set to 0 to compile out the counting of SIRE_COUNT()
+#ifndef SIRE_RENDER_STATISTICS
+#define SIRE_RENDER_STATISTICS 1
+#endif
+
+/** Counters of the rendering work, by ray type.
+  *
+  * Each thread increments its own counters, padded to avoid false sharing, such that the counting
+  * does not race whichever threads render (OpenMP teams, nested or not, Qt pool...). A thread is given
+  * its counters the first time it counts. The counters of all the threads are merged by totals(). Use the SIRE_COUNT() macro to increment a counter, it expands to nothing
+  * when SIRE_RENDER_STATISTICS is 0.
+  */
+class RenderStatistics
+{
+public:
+    enum Counter {
+        RAYS,               ///< rays traced through the scene
+        NODES_VISITED,      ///< BVH nodes whose box has been hit
+        BOX_TESTS,          ///< ray/box intersection tests
+        TRIANGLE_TESTS,     ///< ray/triangle intersection tests
+        SHADING_CALLS,      ///< hits shaded
+        LIGHT_SAMPLES,      ///< light samples evaluated at the hits, including their shadow rays
+        NB_COUNTERS
+    };
+
+    /// maximal number of threads counted separately, the following ones share counters incremented atomically
+    enum { MAX_THREADS = 64 };
+
+    struct Counters
+    {
+        long long values[NB_COUNTERS][Ray::NB_TYPES];
+    };
+
+    static void add(Counter counter, int rayType, long long n)
+    {
+        ThreadCounters* thread = ms_thread ? ms_thread : registerThread();
+        if(thread==&ms_sharedCounters)
+            __sync_fetch_and_add(&thread->counters.values[counter][rayType], n);
+        else
+            thread->counters.values[counter][rayType] += n;
+    }
+
+    /// \returns the counters of the calling thread, shared with other threads if more than MAX_THREADS have counted
+    static const Counters& threadCounters() { return (ms_thread ? ms_thread : registerThread())->counters; }
+    /// \returns the sum of the counters of all the threads
+    static Counters totals();
+    /// resets the counters of all the threads, must not be called while rendering
+    static void reset();
+
+    static const char* counterName(int counter);
+
+    /// prints the totals and their average per ray
+    static void print(std::ostream& out);
+    /// prints the totals as a JSON object, by counter and then by ray type
+    static void printJSON(std::ostream& out);
+
+private:
+    /// the counters of a thread, on their own cache lines
+    struct ThreadCounters
+    {
+        Counters counters;
+        char padding[64];
+    };
+
+    /// assigns counters to the calling thread, \returns them
+    static ThreadCounters* registerThread();
+
+    static ThreadCounters ms_threadCounters[MAX_THREADS];
+    static ThreadCounters ms_sharedCounters;        ///< counters of the threads beyond MAX_THREADS
+    static int ms_nbThreads;                        ///< number of threads registered, may exceed MAX_THREADS
+    static __thread ThreadCounters* ms_thread;      ///< counters of the calling thread, 0 until registered
+};
+
+#if SIRE_RENDER_STATISTICS
+#define SIRE_COUNT(counter, rayType, n) RenderStatistics::add(RenderStatistics::counter, (rayType), (n))
+#else
+#define SIRE_COUNT(counter, rayType, n) ((void)0)
+#endif
+
+#endif // SIRE_RENDERSTATISTICS_H
@@ -3,12 +3,16 @@
 #include "Raytracing.h"
 #include "GLPrimitives.h"
 #include "Mesh.h"
+#include "TextureCache.h"
+#include "MemoryStatistics.h"
+#include "Trace.h"
 
 #include <Eigen/Geometry>
 #include <iostream>
 #include <QKeyEvent>
 #include <QFileDialog>
 #include <QImage>
+#include <QElapsedTimer>
 
 using namespace Eigen;
 
@@ -106,6 +110,7 @@ void RenderingWidget::initializeGL()
     mFlatProgram.loadFromFiles(SIRE_DIR"/shaders/flat.vert", SIRE_DIR"/shaders/flat.frag");
 
     mScene.createDefaultScene(mProgram);
+    MemoryStatistics::print(std::cout, "after loading");
     mGLCamera = Camera(mScene.camera());
 
     // Assign camera to trackball
@@ -126,6 +131,7 @@ void RenderingWidget::loadScene()
         return;
 
     mScene.loadFromFile(name);
+    MemoryStatistics::print(std::cout, "after loading");
     updateGL();
 }
 
@@ -160,12 +166,36 @@ void RenderingWidget::keyPressEvent(QKeyEvent * e)
     }
     case Qt::Key_R:
     {
-        int t = clock();
-        Mesh::ms_itersection_count = 0;
+        // wall-clock time, clock() would add up the time of all the threads
+        QElapsedTimer timer;
+        timer.start();
         QImage img = Raytracing::raytraceImage(mScene);
-        t = clock() - t;
-        std::cout << "Raytracing time : " << float(t)/CLOCKS_PER_SEC << "s  -  nb triangle intersection: " << Mesh::ms_itersection_count << "\n";
-        img.save("filename.png");
+        std::cout << "Raytracing time : " << timer.elapsed()*1e-3 << "s\n";
+        for(size_t i=0; i<mScene.objectList().size(); ++i)
+        {
+            const Mesh* mesh = dynamic_cast<const Mesh*>(mScene.objectList()[i]->shape());
+            if(mesh && mesh->bvh())
+                mesh->bvh()->printStatistics(std::cout);
+        }
+        TextureCache::instance().printStatistics(std::cout);
+        {
+            SIRE_TRACE_ZONE("QImage::save");
+            img.save("filename.png");
+        }
+        break;
+    }
+    case Qt::Key_T:
+    {
+        // traversal cost heatmap: nodes visited, triangles tested with shift, time with control
+        Raytracing::Mode mode = (e->modifiers()&Qt::ShiftModifier) ? Raytracing::HEATMAP_TRIANGLES
+                              : (e->modifiers()&Qt::ControlModifier) ? Raytracing::HEATMAP_TIME : Raytracing::HEATMAP_NODES;
+        std::vector<float> costs;
+        QImage img = Raytracing::raytraceImage(mScene, mode, &costs);
+        {
+            SIRE_TRACE_ZONE("QImage::save");
+            img.save("heatmap.png");
+        }
+        Raytracing::saveCosts("heatmap.pfm", img.width(), img.height(), costs);
         break;
     }
     case Qt::Key_B:
@@ -4,6 +4,8 @@
 #include "Plane.h"
 #include "DomUtils.h"
 #include "AreaLight.h"
+#include "RenderStatistics.h"
+#include "Trace.h"
 
 #include <time.h>
 #include <Eigen/Geometry>
@@ -30,6 +32,7 @@ void Scene::clear()
 
 void Scene::createDefaultScene(Shader &Program)
 {
+    SIRE_TRACE_ZONE("Scene::createDefaultScene");
     Object* pObj = 0;
 
     nbLightWInAL = 4.f;
@@ -97,11 +100,15 @@ void Scene::createDefaultScene(Shader &Program)
     // set background color
     mBackgroundColor = Array3f(0.2,0.2,0.2);
 
-    // Create Cube map
+    // Create Cube map, the background color is used if it is missing
     cubeMap = new CubeMap();
 
-    if (!cubeMap->load("grace_cross.hdr"));
+    if (!cubeMap->load(SIRE_DIR"/data/grace_cross.hdr"))
+    {
         std::cerr << "Problem to load cube map" << std::endl;
+        delete cubeMap;
+        cubeMap = 0;
+    }
 
     mProgram = &Program;
 }
@@ -111,8 +118,14 @@ void Scene::addObject(Object* o)
     mObjectList.push_back(o);
 }
 
+void Scene::addLight(Light* l)
+{
+    mLightList.push_back(l);
+}
+
 void Scene::loadFromFile(const QString& filename)
 {
+    SIRE_TRACE_ZONE("Scene::loadFromFile");
     clear();
 
     QDomDocument doc(filename);
@@ -165,9 +178,15 @@ void Scene::loadFromFile(const QString& filename)
     }
 }
 
-/** Search for the nearest intersection between the ray and the object list */
+/** Search for the nearest intersection between the ray and the object list.
+  * The shading data of the hit are only computed for the closest object, and not at all for shadow rays. */
 void Scene::intersect(const Ray& ray, Hit& hit) const
 {
+    SIRE_COUNT(RAYS, ray.type(), 1);
+    Ray closest_ray;
+    Hit closest_hit;
+    Eigen::Affine3f closest_M;
+    Eigen::Matrix3f closest_invL;
     for(int i=0; i<mObjectList.size(); ++i)
     {
         Ray local_ray;
@@ -192,12 +211,33 @@ void Scene::intersect(const Ray& ray, Hit& hit) const
             // we found a new closest intersection point for this object, record it:
             hit.setObject(mObjectList[i]);
             Eigen::Vector3f x = local_ray.at(h.t());
-            hit.setNormal( (invM.linear().transpose() * h.normal()).normalized() );
             hit.setT( (M * x - ray.origin).norm() );
+            closest_ray = local_ray;
+            closest_hit = h;
+            closest_M = M;
+            closest_invL = invM.linear();
         }else{
             hit.setT(old_t);
         }
     }
+
+    if(!hit.foundIntersection() || ray.shadowRay)
+        return;
+
+    // shading data of the closest hit, computed in the frame of its object
+    if(ray.hasDifferentials)
+    {
+        closest_ray.dOdx = closest_invL * ray.dOdx;
+        closest_ray.dOdy = closest_invL * ray.dOdy;
+        closest_ray.dDdx = closest_invL * ray.dDdx;
+        closest_ray.dDdy = closest_invL * ray.dDdy;
+    }
+    hit.object()->shape()->surfaceInteraction(closest_ray, closest_hit);
+    hit.setPrimitive(closest_hit.primitive(), closest_hit.barycentrics());
+    hit.setIntersection(closest_M * closest_hit.intersection());
+    hit.setNormal( (closest_invL.transpose() * closest_hit.normal()).normalized() );
+    hit.setTexcoord(closest_hit.texcoord());
+    hit.setTexcoordDifferentials(closest_hit.dTexcoordDx(), closest_hit.dTexcoordDy());
 }
 
 /// recursively trace a ray, \returns the light intensity (as a RGB color) received at the origin of the ray in the direction of the ray
@@ -217,6 +257,7 @@ Eigen::Array3f Scene::raytrace(const Ray& ray) const
     intersect(ray, hit);
     if(hit.foundIntersection())
     {
+        SIRE_COUNT(SHADING_CALLS, ray.type(), 1);
         Vector3f rayHit = ray.at(hit.t());
 
         // add ambient
@@ -285,6 +326,7 @@ Eigen::Array3f Scene::raytrace(const Ray& ray) const
             }
             else{*/
 
+                SIRE_COUNT(LIGHT_SAMPLES, ray.type(), 1);
                 Vector3f lightDir = mLightList[i]->direction(rayHit, &dist);
                 Ray shadow_ray(rayHit+hit.normal()*1e-4, lightDir);
                 shadow_ray.shadowRay = true;
@@ -298,6 +340,9 @@ Eigen::Array3f Scene::raytrace(const Ray& ray) const
             /*}*/
         }
 
+        // texture lookup at the hit point
+        value = hit.object()->material()->applyTexture(value, hit.texcoord(), hit.dTexcoordDx(), hit.dTexcoordDy());
+
         // reflexions
         {
             // compute the reflexion factor alpha
@@ -327,6 +372,7 @@ Eigen::Array3f Scene::raytrace(const Ray& ray) const
                 Ray reflexion_ray(rayHit+hit.normal()*1e-4, r);
                 reflexion_ray.recursionLevel = ray.recursionLevel + 1;
                 reflexion_ray.beta = ray.beta * alpha.matrix().norm();
+                reflexion_ray.setReflectedDifferentials(ray, hit.t(), hit.normal());
                 value += alpha * raytrace(reflexion_ray);
             }
         }
@@ -338,7 +384,13 @@ Eigen::Array3f Scene::raytrace(const Ray& ray) const
 
     else if(ray.recursionLevel == 0) {
         //value = mBackgroundColor;
-        value = cubeMap->intensity(ray.direction);
+        if(cubeMap && !cubeMap->isNull())
+        {
+            float footprint = ray.hasDifferentials ? std::max(ray.dDdx.norm(), ray.dDdy.norm()) : 0.f;
+            value = cubeMap->intensity(ray.direction, footprint);
+        }
+        else
+            value = mBackgroundColor;
     }
 
     return value;
@@ -12,10 +12,11 @@ typedef std::vector<Light*> LightList;
 class Scene
 {
 public :
-    Scene() : mBackgroundColor(0.6,0.6,0.6) {}
+    Scene() : mBackgroundColor(0.6,0.6,0.6), mProgram(0), cubeMap(0) {}
     void draw() const;
     void clear();
     void addObject(Object* o);
+    void addLight(Light* l);
     void createDefaultScene(Shader &Program);
     void loadFromFile(const QString& filename);
 
@@ -16,7 +16,13 @@ public:
 
     virtual const Eigen::AlignedBox3f& AABB() const = 0;
 
+    /** finds the closest intersection with \a ray closer than hit.t().
+      * Only the distance and the primitive are recorded, see surfaceInteraction(). */
     virtual bool intersect(const Ray& ray, Hit& hit) const = 0;
+
+    /** computes the shading data (intersection point, normal, texture coordinates and their differentials)
+      * of the intersection \a hit found by intersect() for the ray \a ray */
+    virtual void surfaceInteraction(const Ray& ray, Hit& hit) const = 0;
 };
 
 #endif
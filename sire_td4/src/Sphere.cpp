@@ -96,9 +96,14 @@ bool Sphere::intersect(const Ray& ray, Hit& hit) const
             return false;
 
         hit.setT(t);
-        hit.setNormal((ray.at(t) - mCenter).normalized());
 
         return true;
     }
     return false;
 }
+
+void Sphere::surfaceInteraction(const Ray& ray, Hit& hit) const
+{
+    hit.setIntersection(ray.at(hit.t()));
+    hit.setNormal((hit.intersection() - mCenter).normalized());
+}
@@ -22,6 +22,7 @@ public:
     virtual const Eigen::AlignedBox3f& AABB() const;
 
     virtual bool intersect(const Ray& ray, Hit& hit) const;
+    virtual void surfaceInteraction(const Ray& ray, Hit& hit) const;
 
     float radius() const { return mRadius; }
     const Eigen::Vector3f& center() const { return mCenter; }
@@ -0,0 +1,172 @@
+#ifndef SIRE_TEXTPARSER_H
+#define SIRE_TEXTPARSER_H
+
+#include <vector>
+#include <cstring>
+#include <cstddef>
+
+/** Helpers to parse ASCII files mapped in memory.
+  * All functions take the current position \a p and the end of the buffer \a end,
+  * which does not need to be null terminated. Number parsing does not depend on the locale.
+  */
+class TextParser
+{
+public:
+    static bool isSpace(char c) { return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f'; }
+    static bool isDigit(char c) { return c>='0' && c<='9'; }
+
+    /// skips spaces and tabulations, but not the end of lines
+    static const char* skipSpaces(const char* p, const char* end)
+    {
+        while(p<end && isSpace(*p)) ++p;
+        return p;
+    }
+
+    /// \returns the position following the end of the current line
+    static const char* nextLine(const char* p, const char* end)
+    {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end-p));
+        return eol ? eol+1 : end;
+    }
+
+    /// \returns the end of the current line (pointing to '\n' or \a end)
+    static const char* endOfLine(const char* p, const char* end)
+    {
+        const char* eol = static_cast<const char*>(memchr(p, '\n', end-p));
+        return eol ? eol : end;
+    }
+
+    /// \returns the end of the statement starting at \a p: the end of the line, or the start of a comment introduced by \a comment
+    static const char* endOfStatement(const char* p, const char* end, char comment)
+    {
+        const char* eol = endOfLine(p, end);
+        const char* c = static_cast<const char*>(memchr(p, comment, eol-p));
+        return c ? c : eol;
+    }
+
+    /** Parses an integer starting at \a p (leading spaces are skipped).
+      * \returns the position following the number, or 0 if there is no number at \a p */
+    static const char* parseInt(const char* p, const char* end, int& value)
+    {
+        p = skipSpaces(p, end);
+        bool negative = false;
+        if(p<end && (*p=='-' || *p=='+'))
+        {
+            negative = *p=='-';
+            ++p;
+        }
+        if(p>=end || !isDigit(*p))
+            return 0;
+        int v = 0;
+        while(p<end && isDigit(*p))
+            v = v*10 + (*p++ - '0');
+        value = negative ? -v : v;
+        return p;
+    }
+
+    /** Parses a floating point number in decimal notation with an optional exponent.
+      * \returns the position following the number, or 0 if there is no number at \a p */
+    static const char* parseFloat(const char* p, const char* end, float& value)
+    {
+        p = skipSpaces(p, end);
+        bool negative = false;
+        if(p<end && (*p=='-' || *p=='+'))
+        {
+            negative = *p=='-';
+            ++p;
+        }
+
+        // the 19 first significant digits are accumulated exactly, the following ones only shift the exponent
+        unsigned long long mantissa = 0;
+        int nbDigits = 0, exponent = 0;
+        bool hasDigits = false;
+        for(; p<end && isDigit(*p); ++p)
+        {
+            hasDigits = true;
+            if(nbDigits<19)
+            {
+                mantissa = mantissa*10 + (*p - '0');
+                if(mantissa) ++nbDigits;
+            }
+            else
+                ++exponent;
+        }
+        if(p<end && *p=='.')
+        {
+            for(++p; p<end && isDigit(*p); ++p)
+            {
+                hasDigits = true;
+                if(nbDigits<19)
+                {
+                    mantissa = mantissa*10 + (*p - '0');
+                    if(mantissa) ++nbDigits;
+                    --exponent;
+                }
+            }
+        }
+        if(!hasDigits)
+            return 0;
+
+        if(p<end && (*p=='e' || *p=='E'))
+        {
+            const char* q = p+1;
+            int e;
+            if((q = parseExponent(q, end, e)))
+            {
+                exponent += e;
+                p = q;
+            }
+        }
+
+        double v = double(mantissa);
+        if(mantissa!=0 && exponent!=0)
+        {
+            static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                             1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+            int e = exponent<0 ? -exponent : exponent;
+            double scale = 1.;
+            for(; e>22 && scale<1e300; e-=22)
+                scale *= 1e22;
+            scale *= powers[e>22 ? 22 : e];
+            v = exponent<0 ? v/scale : v*scale;
+        }
+        value = float(negative ? -v : v);
+        return p;
+    }
+
+    /** Splits [\a begin, \a end) into about \a chunkSize bytes large chunks starting at the beginning of a line.
+      * The i-th chunk is [bounds[i], bounds[i+1]). */
+    static void splitLines(const char* begin, const char* end, size_t chunkSize, std::vector<const char*>& bounds)
+    {
+        bounds.clear();
+        bounds.push_back(begin);
+        const char* p = begin;
+        while(size_t(end-p) > chunkSize)
+        {
+            p = nextLine(p + chunkSize, end);
+            if(p<end)
+                bounds.push_back(p);
+        }
+        bounds.push_back(end);
+    }
+
+private:
+    static const char* parseExponent(const char* p, const char* end, int& e)
+    {
+        bool negative = false;
+        if(p<end && (*p=='-' || *p=='+'))
+        {
+            negative = *p=='-';
+            ++p;
+        }
+        if(p>=end || !isDigit(*p))
+            return 0;
+        e = 0;
+        for(; p<end && isDigit(*p); ++p)
+            if(e<10000) e = e*10 + (*p - '0');
+        if(negative) e = -e;
+        return p;
+    }
+};
+
+#endif // SIRE_TEXTPARSER_H
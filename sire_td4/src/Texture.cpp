@@ -0,0 +1,169 @@
+#include "Texture.h"
+#include "Trace.h"
+
+#include <math.h>
+#include <algorithm>
+
+float Texture::ms_srgbToLinear[256];
+bool Texture::ms_srgbTableInitialized = Texture::initializeSrgbTable();
+
+bool Texture::initializeSrgbTable()
+{
+    for(int i=0; i<256; ++i)
+    {
+        float c = i / 255.f;
+        ms_srgbToLinear[i] = c<=0.04045f ? c/12.92f : powf((c+0.055f)/1.055f, 2.4f);
+    }
+    return true;
+}
+
+unsigned char Texture::linearToSrgb(float v)
+{
+    v = std::min(std::max(v, 0.f), 1.f);
+    float c = v<=0.0031308f ? 12.92f*v : 1.055f*powf(v, 1.f/2.4f) - 0.055f;
+    return (unsigned char)(c * 255.f + 0.5f);
+}
+
+bool Texture::load(const QString& filename, Format format)
+{
+    SIRE_TRACE_ZONE("Texture::load");
+    QImage image;
+    if(!image.load(filename))
+    {
+        m_levels.clear();
+        m_memory.set(0);
+        return false;
+    }
+    setImage(image, format);
+    return true;
+}
+
+void Texture::setImage(const QImage& image, Format format)
+{
+    m_format = format;
+    m_levels.clear();
+    m_memory.set(0);
+    if(image.isNull())
+        return;
+
+    // level 0: convert the image into linear float planes
+    QImage rgb = image.convertToFormat(QImage::Format_RGB32);
+    Level base;
+    base.width = rgb.width();
+    base.height = rgb.height();
+    size_t n = size_t(base.width) * base.height;
+    base.data.resize(3*n);
+    for(int y=0; y<base.height; ++y)
+    {
+        const QRgb* line = reinterpret_cast<const QRgb*>(rgb.constScanLine(y));
+        for(int x=0; x<base.width; ++x)
+        {
+            size_t i = size_t(y)*base.width + x;
+            base.data[i]     = srgbToLinear(qRed(line[x]));
+            base.data[i+n]   = srgbToLinear(qGreen(line[x]));
+            base.data[i+2*n] = srgbToLinear(qBlue(line[x]));
+        }
+    }
+    m_levels.push_back(base);
+
+    // the other levels: 2x2 box filter of the previous one
+    while(m_levels.back().width>1 || m_levels.back().height>1)
+    {
+        const Level& src = m_levels.back();
+        Level dst;
+        dst.width  = std::max(1, src.width/2);
+        dst.height = std::max(1, src.height/2);
+        size_t srcN = size_t(src.width) * src.height;
+        size_t dstN = size_t(dst.width) * dst.height;
+        dst.data.resize(3*dstN);
+        for(int c=0; c<3; ++c)
+        {
+            const float* s = &src.data[c*srcN];
+            float* d = &dst.data[c*dstN];
+            for(int y=0; y<dst.height; ++y)
+            {
+                int y0 = std::min(2*y, src.height-1), y1 = std::min(2*y+1, src.height-1);
+                for(int x=0; x<dst.width; ++x)
+                {
+                    int x0 = std::min(2*x, src.width-1), x1 = std::min(2*x+1, src.width-1);
+                    d[y*dst.width+x] = 0.25f * (s[y0*src.width+x0] + s[y0*src.width+x1]
+                                              + s[y1*src.width+x0] + s[y1*src.width+x1]);
+                }
+            }
+        }
+        m_levels.push_back(dst);
+    }
+    // the float planes are the peak of the 8-bit conversion
+    m_memory.set(memoryFootprint());
+
+    if(m_format==UNORM8)
+    {
+        for(size_t l=0; l<m_levels.size(); ++l)
+        {
+            Level& level = m_levels[l];
+            level.data8.resize(level.data.size());
+            for(size_t i=0; i<level.data.size(); ++i)
+                level.data8[i] = linearToSrgb(level.data[i]);
+            std::vector<float>().swap(level.data);
+        }
+    }
+    m_memory.set(memoryFootprint());
+}
+
+size_t Texture::memoryFootprint() const
+{
+    size_t bytes = 0;
+    for(size_t l=0; l<m_levels.size(); ++l)
+        bytes += m_levels[l].data.size()*sizeof(float) + m_levels[l].data8.size();
+    return bytes;
+}
+
+float Texture::lod(const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const
+{
+    Eigen::Vector2f size(width(), height());
+    float width = std::max(duvdx.cwiseProduct(size).norm(), duvdy.cwiseProduct(size).norm());
+    return width>1.f ? std::log(width) / std::log(2.f) : 0.f;
+}
+
+Eigen::Array3f Texture::texel(const Level& level, int x, int y) const
+{
+    size_t n = size_t(level.width) * level.height;
+    size_t i = size_t(y)*level.width + x;
+    if(m_format==UNORM8)
+        return Eigen::Array3f(srgbToLinear(level.data8[i]), srgbToLinear(level.data8[i+n]), srgbToLinear(level.data8[i+2*n]));
+    return Eigen::Array3f(level.data[i], level.data[i+n], level.data[i+2*n]);
+}
+
+Eigen::Array3f Texture::sampleBilinear(const Eigen::Vector2f& uv, int level) const
+{
+    if(isNull())
+        return Eigen::Array3f::Ones();
+    const Level& l = m_levels[std::min(std::max(level, 0), nbLevels()-1)];
+
+    // texel centers are at half integers
+    float x = uv.x() * l.width - 0.5f;
+    float y = uv.y() * l.height - 0.5f;
+    float fx = floorf(x), fy = floorf(y);
+    float ucoef = x - fx, vcoef = y - fy;
+
+    // wrap around
+    int x0 = int(fx) % l.width;  if(x0<0) x0 += l.width;
+    int y0 = int(fy) % l.height; if(y0<0) y0 += l.height;
+    int x1 = x0+1<l.width  ? x0+1 : 0;
+    int y1 = y0+1<l.height ? y0+1 : 0;
+
+    return (1.f - vcoef) * ((1.f - ucoef) * texel(l, x0, y0) + ucoef * texel(l, x1, y0))
+         +        vcoef  * ((1.f - ucoef) * texel(l, x0, y1) + ucoef * texel(l, x1, y1));
+}
+
+Eigen::Array3f Texture::sample(const Eigen::Vector2f& uv, float lod) const
+{
+    if(isNull())
+        return Eigen::Array3f::Ones();
+    lod = std::min(std::max(lod, 0.f), float(nbLevels()-1));
+    int l0 = int(lod);
+    float t = lod - l0;
+    if(t==0.f || l0+1>=nbLevels())
+        return sampleBilinear(uv, l0);
+    return (1.f-t) * sampleBilinear(uv, l0) + t * sampleBilinear(uv, l0+1);
+}
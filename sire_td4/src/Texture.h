@@ -0,0 +1,76 @@
+#ifndef SIRE_TEXTURE_H
+#define SIRE_TEXTURE_H
+
+#include <Eigen/Core>
+#include <QImage>
+#include <QString>
+#include <vector>
+
+#include "MemoryStatistics.h"
+
+/** A texture converted once at load time into a mip chain.
+  * The sRGB encoded images are decoded to linear values, such that the mip levels average the actual intensities.
+  * Each level stores its red, green and blue channels in separate planes, either as linear floats in [0,1]
+  * or as 8-bit sRGB values decoded at lookup, so that lookups never go through Qt.
+  * Texture coordinates wrap around (repeat mode).
+  */
+class Texture
+{
+public:
+    /// storage of the texels
+    enum Format { FLOAT32, UNORM8 };
+
+    Texture() : m_format(FLOAT32), m_memory(MemoryStatistics::TEXTURES) {}
+
+    /// loads the image \a filename, \returns false if it cannot be read
+    bool load(const QString& filename, Format format = FLOAT32);
+
+    /// converts \a image and builds its mip chain
+    void setImage(const QImage& image, Format format = FLOAT32);
+
+    bool isNull() const { return m_levels.empty(); }
+    int width(int level = 0) const { return isNull() ? 0 : m_levels[level].width; }
+    int height(int level = 0) const { return isNull() ? 0 : m_levels[level].height; }
+    int nbLevels() const { return m_levels.size(); }
+
+    /// \returns the linear value of the texel (\a x, \a y) of the mip level \a level
+    Eigen::Array3f texel(int level, int x, int y) const { return texel(m_levels[level], x, y); }
+
+    /// bilinear lookup at \a uv in the mip level \a level
+    Eigen::Array3f sampleBilinear(const Eigen::Vector2f& uv, int level = 0) const;
+
+    /// trilinear lookup at \a uv, \a lod being the (fractional) mip level, 0 is the full resolution
+    Eigen::Array3f sample(const Eigen::Vector2f& uv, float lod = 0.f) const;
+
+    /// \returns the mip level matching the derivatives \a duvdx, \a duvdy of the texture coordinates
+    float lod(const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const;
+
+    /// \returns the number of bytes used by the mip chain
+    size_t memoryFootprint() const;
+
+    /// \returns the linear value of the 8-bit sRGB value \a c
+    static float srgbToLinear(unsigned char c) { return ms_srgbToLinear[c]; }
+    /// \returns the 8-bit sRGB encoding of the linear value \a v, clamped to [0,1]
+    static unsigned char linearToSrgb(float v);
+
+protected:
+    struct Level
+    {
+        int width, height;
+        std::vector<float> data;            ///< FLOAT32 planes: r, g, then b
+        std::vector<unsigned char> data8;   ///< UNORM8 planes: r, g, then b, sRGB encoded
+    };
+
+    Eigen::Array3f texel(const Level& level, int x, int y) const;
+
+    Format m_format;
+    std::vector<Level> m_levels;
+    MemoryAccount m_memory;     ///< memoryFootprint(), updated by setImage()
+
+private:
+    static bool initializeSrgbTable();
+    static float ms_srgbToLinear[256];
+    static bool ms_srgbTableInitialized;
+};
+
+#endif // SIRE_TEXTURE_H
@@ -0,0 +1,394 @@
+#include "TextureCache.h"
+#include "Texture.h"
+#include "Trace.h"
+
+#include <QImage>
+#include <QMutexLocker>
+#include <math.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Header of a tiled file, followed by the tiles of all the mip levels.
+  * The tiles of a level are stored row by row, each of them being TILE_BYTES long.
+  */
+struct TilesHeader
+{
+    enum { VERSION = 1 };
+
+    char magic[8];              ///< "SIRETILE"
+    int version;
+    int tileSize;
+    long long sourceSize;       ///< size of the source image
+    long long sourceTime;       ///< modification time of the source image
+    int width, height;
+    int nbLevels;
+    int padding;
+};
+
+static const char s_tilesMagic[8] = { 'S', 'I', 'R', 'E', 'T', 'I', 'L', 'E' };
+
+TextureCache& TextureCache::instance()
+{
+    static TextureCache* cache = 0;
+    if(!cache)
+    {
+        cache = new TextureCache;
+        if(const char* budget = getenv("SIRE_TEXTURE_CACHE_MB"))
+            cache->setMemoryBudget(size_t(atol(budget)) << 20);
+    }
+    return *cache;
+}
+
+TextureCache::TextureCache(size_t memoryBudget)
+    : mNbTextures(0), mMemoryBudget(memoryBudget), mMemoryUsed(0), mPeakMemoryUsed(0),
+      mSourceMemory(MemoryStatistics::TEXTURE_CACHE)
+{}
+
+TextureCache::~TextureCache()
+{
+    for(int i=0; i<mNbTextures; ++i)
+        delete mTextures[i];
+}
+
+int TextureCache::addTexture(const QString& filename)
+{
+    QMutexLocker locker(&mMutex);
+    for(int i=0; i<mNbTextures; ++i)
+        if(mTextures[i]->filename == filename)
+            return i;
+    if(mNbTextures==MAX_TEXTURES)
+    {
+        qWarning("TextureCache: too many textures, %s is not registered", qPrintable(filename));
+        return -1;
+    }
+
+    TextureInfo* info = new TextureInfo;
+    info->filename = filename;
+    if(!openTiles(*info) && !convertTiles(*info))
+    {
+        qWarning("TextureCache: unable to read %s", qPrintable(filename));
+        delete info;
+        return -1;
+    }
+    mSourceMemory.set(mSourceMemory.bytes() + info->tiles.memoryFootprint());
+    mTextures[mNbTextures] = info;
+    // the texture must be complete before its id is used by other threads
+#pragma omp flush
+    return mNbTextures++;
+}
+
+void TextureCache::setLevels(TextureInfo& info, int width, int height)
+{
+    info.levels.clear();
+    size_t nbTiles = 0;
+    for(;;)
+    {
+        LevelInfo level;
+        level.width = width;
+        level.height = height;
+        level.tilesX = (width + TILE_SIZE-1) / TILE_SIZE;
+        level.tilesY = (height + TILE_SIZE-1) / TILE_SIZE;
+        level.firstTile = nbTiles;
+        nbTiles += size_t(level.tilesX) * level.tilesY;
+        info.levels.push_back(level);
+        if(width==1 && height==1)
+            break;
+        // same chain as Texture
+        width = std::max(1, width/2);
+        height = std::max(1, height/2);
+    }
+}
+
+bool TextureCache::openTiles(TextureInfo& info)
+{
+    struct stat st;
+    std::string source = info.filename.toStdString();
+    if(stat(source.c_str(), &st)!=0 || !info.file.open(tilesFilename(info.filename)))
+        return false;
+
+    const TilesHeader* header = reinterpret_cast<const TilesHeader*>(info.file.data());
+    if(info.file.size() < sizeof(TilesHeader)
+            || memcmp(header->magic, s_tilesMagic, 8)!=0
+            || header->version != TilesHeader::VERSION
+            || header->tileSize != TILE_SIZE
+            || header->sourceSize != (long long)st.st_size
+            || header->sourceTime != (long long)st.st_mtime
+            || header->width <= 0 || header->height <= 0)
+    {
+        info.file.close();
+        return false;
+    }
+    setLevels(info, header->width, header->height);
+    const LevelInfo& last = info.levels.back();
+    size_t nbTiles = last.firstTile + size_t(last.tilesX) * last.tilesY;
+    if(header->nbLevels != int(info.levels.size()) || sizeof(TilesHeader) + nbTiles*TILE_BYTES > info.file.size())
+    {
+        info.file.close();
+        return false;
+    }
+    info.tiles.setExternal(reinterpret_cast<const unsigned char*>(info.file.data() + sizeof(TilesHeader)), nbTiles*TILE_BYTES);
+    return true;
+}
+
+bool TextureCache::convertTiles(TextureInfo& info)
+{
+    SIRE_TRACE_ZONE("TextureCache::convertTiles");
+    // the mip chain is built by Texture, in linear space
+    Texture texture;
+    if(!texture.load(info.filename, Texture::UNORM8))
+        return false;
+    setLevels(info, texture.width(), texture.height());
+    const LevelInfo& last = info.levels.back();
+    size_t nbTiles = last.firstTile + size_t(last.tilesX) * last.tilesY;
+
+    std::vector<unsigned char> tiles(nbTiles*TILE_BYTES, 0);
+    for(int l=0; l<int(info.levels.size()); ++l)
+    {
+        const LevelInfo& level = info.levels[l];
+#pragma omp parallel for
+        for(int y=0; y<level.height; ++y)
+            for(int x=0; x<level.width; ++x)
+            {
+                size_t tile = level.firstTile + size_t(y/TILE_SIZE)*level.tilesX + x/TILE_SIZE;
+                unsigned char* dst = &tiles[tile*TILE_BYTES + (y%TILE_SIZE)*TILE_SIZE + x%TILE_SIZE];
+                Eigen::Array3f c = texture.texel(l, x, y);
+                for(int k=0; k<3; ++k)
+                    dst[k*TILE_SIZE*TILE_SIZE] = Texture::linearToSrgb(c[k]);
+            }
+    }
+
+    // write into a temporary file renamed once complete, such that other processes never map a partial file
+    struct stat st;
+    std::string source = info.filename.toStdString();
+    std::string name = tilesFilename(info.filename);
+    std::ostringstream tmpStream;
+    tmpStream << name << ".tmp" << getpid();
+    std::string tmpName = tmpStream.str();
+    FILE* f = stat(source.c_str(), &st)==0 ? fopen(tmpName.c_str(), "wb") : 0;
+    if(f)
+    {
+        TilesHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, s_tilesMagic, 8);
+        header.version = TilesHeader::VERSION;
+        header.tileSize = TILE_SIZE;
+        header.sourceSize = st.st_size;
+        header.sourceTime = st.st_mtime;
+        header.width = texture.width();
+        header.height = texture.height();
+        header.nbLevels = info.levels.size();
+        bool ok = fwrite(&header, sizeof(header), 1, f)==1 && fwrite(&tiles[0], 1, tiles.size(), f)==tiles.size();
+        ok = (fclose(f)==0) && ok;
+        if(ok && rename(tmpName.c_str(), name.c_str())==0 && openTiles(info))
+            return true;
+        remove(tmpName.c_str());
+    }
+    std::cerr << "TextureCache: unable to write " << name << ", the tiles are kept in memory" << std::endl;
+    info.tiles.swap(tiles);
+    return true;
+}
+
+void TextureCache::setMemoryBudget(size_t bytes)
+{
+    mMemoryBudget = bytes;
+    for(int s=0; s<NB_SHARDS; ++s)
+    {
+        QMutexLocker locker(&mShards[s].mutex);
+        evict(mShards[s], mMemoryBudget/NB_SHARDS, 0);
+    }
+}
+
+TextureCache::Statistics TextureCache::statistics() const
+{
+    Statistics stats;
+    for(int s=0; s<NB_SHARDS; ++s)
+    {
+        const Shard& shard = mShards[s];
+        QMutexLocker locker(const_cast<QMutex*>(&shard.mutex));
+        stats.hits += shard.hits;
+        stats.misses += shard.misses;
+        stats.evictions += shard.evictions;
+    }
+    QMutexLocker locker(&mMemoryMutex);
+    stats.memoryUsed = mMemoryUsed;
+    stats.peakMemoryUsed = mPeakMemoryUsed;
+    return stats;
+}
+
+void TextureCache::resetStatistics()
+{
+    for(int s=0; s<NB_SHARDS; ++s)
+    {
+        QMutexLocker locker(&mShards[s].mutex);
+        mShards[s].hits = mShards[s].misses = mShards[s].evictions = 0;
+    }
+    QMutexLocker locker(&mMemoryMutex);
+    mPeakMemoryUsed = mMemoryUsed;
+}
+
+void TextureCache::printStatistics(std::ostream& out) const
+{
+    Statistics stats = statistics();
+    long long lookups = stats.hits + stats.misses;
+    out << "Texture cache: " << lookups << " tile lookups, "
+        << stats.hits << " hits (" << (lookups ? 100.*stats.hits/lookups : 0.) << "%), "
+        << stats.misses << " misses, " << stats.evictions << " evictions, "
+        << (stats.memoryUsed >> 20) << "MB used (peak " << (stats.peakMemoryUsed >> 20) << "MB"
+        << ", budget " << (mMemoryBudget >> 20) << "MB)\n";
+}
+
+void TextureCache::clear()
+{
+    for(int s=0; s<NB_SHARDS; ++s)
+    {
+        QMutexLocker locker(&mShards[s].mutex);
+        evict(mShards[s], 0, 0);
+    }
+}
+
+void TextureCache::addMemoryUsed(long long bytes)
+{
+    QMutexLocker locker(&mMemoryMutex);
+    mMemoryUsed += bytes;
+    mPeakMemoryUsed = std::max(mPeakMemoryUsed, mMemoryUsed);
+}
+
+void TextureCache::evict(Shard& shard, size_t budget, size_t minTiles)
+{
+    size_t before = shard.memoryUsed;
+    while(shard.tiles.size() > minTiles && shard.memoryUsed > budget)
+    {
+        const Tile& tile = shard.tiles.back();
+        shard.memoryUsed -= tile.bytes();
+        shard.tileMap.erase(tile.key);
+        shard.tiles.pop_back();
+        ++shard.evictions;
+    }
+    if(shard.memoryUsed != before)
+    {
+        shard.memory.set(shard.memoryUsed);
+        addMemoryUsed((long long)shard.memoryUsed - (long long)before);
+    }
+}
+
+bool TextureCache::loadTile(const TextureInfo& info, int level, int tx, int ty, Tile& tile) const
+{
+    SIRE_TRACE_ZONE("TextureCache::loadTile");
+    if(level<0 || level>=int(info.levels.size()))
+        return false;
+    const LevelInfo& l = info.levels[level];
+    if(tx<0 || ty<0 || tx>=l.tilesX || ty>=l.tilesY)
+        return false;
+
+    tile.key = 0;
+    tile.width  = std::min<int>(TILE_SIZE, l.width - tx*TILE_SIZE);
+    tile.height = std::min<int>(TILE_SIZE, l.height - ty*TILE_SIZE);
+    int n = tile.width*tile.height;
+    tile.data.resize(3*n);
+    const unsigned char* src = info.tiles.data() + (l.firstTile + size_t(ty)*l.tilesX + tx) * TILE_BYTES;
+    for(int c=0; c<3; ++c)
+        for(int y=0; y<tile.height; ++y)
+            for(int x=0; x<tile.width; ++x)
+                tile.data[c*n + y*tile.width + x] = Texture::srgbToLinear(src[c*TILE_SIZE*TILE_SIZE + y*TILE_SIZE + x]);
+    return true;
+}
+
+const TextureCache::Tile* TextureCache::findTile(Shard& shard, int texId, int level, int tx, int ty)
+{
+    TileKey key = tileKey(texId, level, tx, ty);
+    std::map<TileKey, TileList::iterator>::iterator it = shard.tileMap.find(key);
+    if(it != shard.tileMap.end())
+    {
+        ++shard.hits;
+        // move the tile in front of the LRU list
+        shard.tiles.splice(shard.tiles.begin(), shard.tiles, it->second);
+        return &*it->second;
+    }
+    ++shard.misses;
+
+    // a tile which cannot be decoded is not inserted, it will be tried again
+    Tile tile;
+    if(!loadTile(*mTextures[texId], level, tx, ty, tile))
+        return 0;
+    tile.key = key;
+    shard.tiles.push_front(Tile());
+    shard.tiles.front().key = tile.key;
+    shard.tiles.front().width = tile.width;
+    shard.tiles.front().height = tile.height;
+    shard.tiles.front().data.swap(tile.data);
+    shard.tileMap[key] = shard.tiles.begin();
+    shard.memoryUsed += shard.tiles.front().bytes();
+    shard.memory.set(shard.memoryUsed);
+    addMemoryUsed(shard.tiles.front().bytes());
+    evict(shard, mMemoryBudget/NB_SHARDS, 1);
+    return &shard.tiles.front();
+}
+
+void TextureCache::texels(int texId, int level, int n, const int* xs, const int* ys, Eigen::Array3f* values)
+{
+    bool done[4] = { false, false, false, false };
+    for(int i=0; i<n; ++i)
+    {
+        if(done[i])
+            continue;
+        int tx = xs[i] / TILE_SIZE, ty = ys[i] / TILE_SIZE;
+        Shard& shard = mShards[shardIndex(tileKey(texId, level, tx, ty))];
+        QMutexLocker locker(&shard.mutex);
+        const Tile* tile = findTile(shard, texId, level, tx, ty);
+        // the tile is read while the lock prevents its eviction
+        for(int j=i; j<n; ++j)
+        {
+            if(done[j] || xs[j]/TILE_SIZE!=tx || ys[j]/TILE_SIZE!=ty)
+                continue;
+            values[j] = tile ? tile->texel(xs[j] - tx*TILE_SIZE, ys[j] - ty*TILE_SIZE) : Eigen::Array3f::Zero();
+            done[j] = true;
+        }
+    }
+}
+
+Eigen::Array3f TextureCache::sampleBilinear(int texId, int level, const Eigen::Vector2f& uv)
+{
+    const LevelInfo& l = mTextures[texId]->levels[level];
+
+    // texel centers are at half integers
+    float x = uv.x() * l.width - 0.5f;
+    float y = uv.y() * l.height - 0.5f;
+    float fx = floorf(x), fy = floorf(y);
+    float ucoef = x - fx, vcoef = y - fy;
+
+    // wrap around
+    int x0 = int(fx) % l.width;  if(x0<0) x0 += l.width;
+    int y0 = int(fy) % l.height; if(y0<0) y0 += l.height;
+    int x1 = x0+1<l.width  ? x0+1 : 0;
+    int y1 = y0+1<l.height ? y0+1 : 0;
+
+    int xs[4] = { x0, x1, x0, x1 };
+    int ys[4] = { y0, y0, y1, y1 };
+    Eigen::Array3f t[4];
+    texels(texId, level, 4, xs, ys, t);
+    return (1.f - vcoef) * ((1.f - ucoef) * t[0] + ucoef * t[1])
+         +        vcoef  * ((1.f - ucoef) * t[2] + ucoef * t[3]);
+}
+
+Eigen::Array3f TextureCache::sample(int texId, const Eigen::Vector2f& uv, float lod)
+{
+    int nbLevels = mTextures[texId]->levels.size();
+    lod = std::min(std::max(lod, 0.f), float(nbLevels-1));
+    int l0 = int(lod);
+    float t = lod - l0;
+    if(t==0.f || l0+1>=nbLevels)
+        return sampleBilinear(texId, l0, uv);
+    return (1.f-t) * sampleBilinear(texId, l0, uv) + t * sampleBilinear(texId, l0+1, uv);
+}
+
+float TextureCache::lod(int texId, const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const
+{
+    Eigen::Vector2f size(width(texId), height(texId));
+    float width = std::max(duvdx.cwiseProduct(size).norm(), duvdy.cwiseProduct(size).norm());
+    return width>1.f ? std::log(width) / std::log(2.f) : 0.f;
+}
@@ -0,0 +1,163 @@
+#ifndef SIRE_TEXTURECACHE_H
+#define SIRE_TEXTURECACHE_H
+
+#include <Eigen/Core>
+#include <QString>
+#include <QMutex>
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "DataArray.h"
+#include "MappedFile.h"
+#include "MemoryStatistics.h"
+
+/** A cache of texture tiles loaded on demand.
+  *
+  * When a texture is registered, its image is decoded once and converted into a tiled file next to it
+  * (see tilesFilename()), holding the whole mip chain as 8-bit sRGB tiles of TILE_SIZE x TILE_SIZE texels.
+  * The tiled file is mapped, and reused by the next runs as long as the image is not modified.
+  * If it cannot be written, the tiles are kept in memory instead.
+  *
+  * A tile is decoded to linear floats the first time one of its texels is accessed, and the decoded tiles
+  * are kept in LRU lists whose total size does not exceed the memory budget. The tiles are spread over
+  * NB_SHARDS independent lists, each with its own lock and an equal share of the budget, such that
+  * concurrent lookups rarely wait for each other. A shard always keeps its most recent tile,
+  * the budget may thus be exceeded by up to NB_SHARDS tiles.
+  *
+  * The budget defaults to 256MB and can be overridden with the SIRE_TEXTURE_CACHE_MB environment variable.
+  */
+class TextureCache
+{
+public:
+    enum { TILE_SIZE = 64, NB_SHARDS = 16, MAX_TEXTURES = 1024 };
+
+    struct Statistics
+    {
+        Statistics() : hits(0), misses(0), evictions(0), memoryUsed(0), peakMemoryUsed(0) {}
+        long long hits;          ///< number of tile accesses served by a resident tile
+        long long misses;        ///< number of tiles decoded
+        long long evictions;     ///< number of tiles dropped to respect the budget
+        size_t memoryUsed;       ///< bytes currently used by the resident tiles
+        size_t peakMemoryUsed;
+    };
+
+    /// \returns the cache shared by all the materials
+    static TextureCache& instance();
+
+    explicit TextureCache(size_t memoryBudget = size_t(256) << 20);
+    ~TextureCache();
+
+    /** registers the image \a filename, converting it into a tiled file if needed.
+      * \returns its id, or -1 if the file cannot be read */
+    int addTexture(const QString& filename);
+
+    int width(int texId) const { return mTextures[texId]->levels[0].width; }
+    int height(int texId) const { return mTextures[texId]->levels[0].height; }
+    int nbLevels(int texId) const { return mTextures[texId]->levels.size(); }
+
+    /// trilinear lookup at \a uv in the texture \a texId, \a lod being the (fractional) mip level, coordinates wrap around
+    Eigen::Array3f sample(int texId, const Eigen::Vector2f& uv, float lod = 0.f);
+
+    /// \returns the mip level of the texture \a texId matching the derivatives \a duvdx, \a duvdy of the texture coordinates
+    float lod(int texId, const Eigen::Vector2f& duvdx, const Eigen::Vector2f& duvdy) const;
+
+    void setMemoryBudget(size_t bytes);
+    size_t memoryBudget() const { return mMemoryBudget; }
+
+    Statistics statistics() const;
+    void resetStatistics();
+    void printStatistics(std::ostream& out) const;
+
+    /// drops all the resident tiles, the textures stay registered
+    void clear();
+
+    /// \returns the name of the tiled file of the image \a filename
+    static std::string tilesFilename(const QString& filename) { return filename.toStdString() + ".tiles"; }
+
+protected:
+    typedef long long TileKey;
+
+    /// bytes of a stored tile: 3 planes of TILE_SIZE x TILE_SIZE sRGB values, the tiles on the borders being padded
+    enum { TILE_BYTES = 3*TILE_SIZE*TILE_SIZE };
+
+    struct LevelInfo
+    {
+        int width, height;
+        int tilesX, tilesY;
+        size_t firstTile;       ///< index of the first tile of the level in the tiled file
+    };
+
+    struct TextureInfo
+    {
+        QString filename;
+        std::vector<LevelInfo> levels;
+        MappedFile file;                    ///< the tiled file
+        DataArray<unsigned char> tiles;     ///< all the stored tiles, in the mapped file or in memory
+    };
+
+    struct Tile
+    {
+        TileKey key;
+        int width, height;
+        std::vector<float> data;    ///< linear planes: r, g, then b
+
+        Eigen::Array3f texel(int x, int y) const
+        {
+            int i = y*width + x, n = width*height;
+            return Eigen::Array3f(data[i], data[i+n], data[i+2*n]);
+        }
+        size_t bytes() const { return data.size()*sizeof(float); }
+    };
+
+    typedef std::list<Tile> TileList;
+
+    /// an independent part of the cache, holding the tiles whose key hashes to it
+    struct Shard
+    {
+        Shard() : hits(0), misses(0), evictions(0), memoryUsed(0), memory(MemoryStatistics::TEXTURE_CACHE) {}
+        QMutex mutex;
+        TileList tiles;                                 ///< resident tiles, most recently used first
+        std::map<TileKey, TileList::iterator> tileMap;
+        long long hits, misses, evictions;
+        size_t memoryUsed;
+        MemoryAccount memory;
+    };
+
+    static TileKey tileKey(int texId, int level, int tx, int ty)
+    {
+        return (TileKey(texId) << 45) | (TileKey(level) << 40) | (TileKey(ty) << 20) | TileKey(tx);
+    }
+    static int shardIndex(TileKey key) { return int((unsigned long long)(key) * 0x9E3779B97F4A7C15ULL >> 60) & (NB_SHARDS-1); }
+
+    /// maps the tiled file of \a info if it is up to date with its image
+    static bool openTiles(TextureInfo& info);
+    /// decodes the image of \a info and stores its tiles, in the tiled file if possible
+    static bool convertTiles(TextureInfo& info);
+    static void setLevels(TextureInfo& info, int width, int height);
+
+    /// bilinear lookup at \a uv in the mip level \a level of the texture \a texId
+    Eigen::Array3f sampleBilinear(int texId, int level, const Eigen::Vector2f& uv);
+    /// fetches the \a n texels (\a xs[i], \a ys[i]) of the mip level \a level, locking a shard once per distinct tile
+    void texels(int texId, int level, int n, const int* xs, const int* ys, Eigen::Array3f* values);
+    /// \returns the tile (\a tx, \a ty) of the mip level \a level, decoded if needed, or 0 if it cannot be decoded (the shard lock must be held)
+    const Tile* findTile(Shard& shard, int texId, int level, int tx, int ty);
+    bool loadTile(const TextureInfo& info, int level, int tx, int ty, Tile& tile) const;
+    /// drops the least recently used tiles of \a shard, keeping at least \a minTiles, until its tiles fit within \a budget (the shard lock must be held)
+    void evict(Shard& shard, size_t budget, size_t minTiles);
+    void addMemoryUsed(long long bytes);
+
+    QMutex mMutex;                              ///< serializes the registration of the textures
+    TextureInfo* mTextures[MAX_TEXTURES];       ///< read without lock, a texture is complete once its id has been returned
+    int mNbTextures;
+    Shard mShards[NB_SHARDS];
+    size_t mMemoryBudget;
+    mutable QMutex mMemoryMutex;                ///< protects the two following members
+    size_t mMemoryUsed;
+    size_t mPeakMemoryUsed;
+    MemoryAccount mSourceMemory;                ///< tiles kept in memory when their tiled file cannot be written
+};
+
+#endif // SIRE_TEXTURECACHE_H
@@ -0,0 +1,116 @@
+#include "Trace.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+Trace::ThreadEvents Trace::ms_threadEvents[Trace::MAX_THREADS];
+int Trace::ms_nbThreads = 0;
+__thread Trace::ThreadEvents* Trace::ms_thread = 0;
+__thread bool Trace::ms_threadRegistered = false;
+std::string Trace::ms_filename;
+bool Trace::ms_enabled = Trace::initialize();
+
+/// \returns a monotonic time in microseconds
+static double monotonicTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
+// time origin of the trace
+static const double traceOrigin = monotonicTime();
+
+bool Trace::initialize()
+{
+    const char* filename = getenv("SIRE_TRACE");
+    if(!filename || !filename[0])
+        return false;
+    ms_filename = filename;
+    atexit(saveAtExit);
+    return true;
+}
+
+void Trace::saveAtExit()
+{
+    save(ms_filename);
+}
+
+double Trace::now()
+{
+    return monotonicTime() - traceOrigin;
+}
+
+Trace::ThreadEvents* Trace::registerThread()
+{
+    ms_threadRegistered = true;
+    int slot = __sync_fetch_and_add(&ms_nbThreads, 1);
+    if(slot>=MAX_THREADS)
+        return 0;
+    ThreadEvents& thread = ms_threadEvents[slot];
+    thread.events.resize(MAX_EVENTS);
+    thread.count = 0;
+    thread.osThreadId = syscall(SYS_gettid);
+    return &thread;
+}
+
+void Trace::record(const char* name, double start, double duration)
+{
+    if(!ms_thread)
+    {
+        if(ms_threadRegistered)
+            return;
+        ms_thread = registerThread();
+        if(!ms_thread)
+            return;
+    }
+    ThreadEvents& thread = *ms_thread;
+    Event& e = thread.events[thread.count % MAX_EVENTS];
+    e.name = name;
+    e.start = start;
+    e.duration = duration;
+    ++thread.count;
+}
+
+void Trace::write(std::ostream& out)
+{
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    const long pid = getpid();
+    const int nbThreads = std::min<int>(ms_nbThreads, MAX_THREADS);
+    for(int t=0; t<nbThreads; ++t)
+    {
+        const ThreadEvents& thread = ms_threadEvents[t];
+        if(thread.events.empty())
+            continue;
+        const long tid = thread.osThreadId;
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << tid
+            << ",\"args\":{\"name\":\"" << (tid==pid ? "main thread" : "thread") << " " << tid << "\"}}";
+        first = false;
+        size_t begin = thread.count>size_t(MAX_EVENTS) ? thread.count-MAX_EVENTS : 0;
+        for(size_t i=begin; i<thread.count; ++i)
+        {
+            const Event& e = thread.events[i % MAX_EVENTS];
+            out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid
+                << ",\"ts\":" << e.start << ",\"dur\":" << e.duration << "}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+bool Trace::save(const std::string& filename)
+{
+    std::ofstream out(filename.c_str());
+    if(!out)
+    {
+        std::cerr << "Trace: cannot write " << filename << std::endl;
+        return false;
+    }
+    out.precision(15);
+    write(out);
+    return bool(out);
+}
@@ -0,0 +1,97 @@
+#ifndef SIRE_TRACE_H
+#define SIRE_TRACE_H
+
+#include <vector>
+#include <string>
+#include <iostream>
+
+/// set to 0 to compile out the zones of SIRE_TRACE_ZONE()
+#ifndef SIRE_TRACE_ZONES
+#define SIRE_TRACE_ZONES 1
+#endif
+
+/** Timeline of the phases of the program (loading, BVH builds, rendering...), in the Chrome trace format.
+  *
+  * The tracing is enabled by setting the SIRE_TRACE environment variable to the name of the file
+  * to write at exit, which can be opened in chrome://tracing or https://ui.perfetto.dev.
+  * Each thread records its zones in its own ring buffer, keeping the MAX_EVENTS last ones. The buffer is
+  * registered when the thread records its first zone, and the thread is identified by its OS thread id,
+  * whatever the OpenMP team or Qt pool it belongs to. The zones of the threads beyond MAX_THREADS are dropped.
+  * Use SIRE_TRACE_ZONE("name") to time the enclosing scope, the name must be a string literal.
+  */
+class Trace
+{
+public:
+    enum { MAX_THREADS = 64, MAX_EVENTS = 1<<16 };
+
+    static bool isEnabled() { return ms_enabled; }
+
+    /// \returns the time in microseconds since the start of the program
+    static double now();
+
+    /// records the zone \a name of the calling thread, which started at \a start and lasted \a duration microseconds
+    static void record(const char* name, double start, double duration);
+
+    /// writes the recorded zones of all the threads as a Chrome trace JSON object
+    static void write(std::ostream& out);
+    /// writes the trace to \a filename, \returns false on failure
+    static bool save(const std::string& filename);
+
+private:
+    struct Event
+    {
+        const char* name;
+        double start;
+        double duration;
+    };
+
+    /// ring buffer of a thread, allocated when it records its first zone
+    struct ThreadEvents
+    {
+        std::vector<Event> events;
+        size_t count;           ///< number of events recorded, the last MAX_EVENTS ones being kept
+        long osThreadId;
+        char padding[64];
+    };
+
+    /// assigns a buffer to the calling thread, \returns 0 if all of them are taken
+    static ThreadEvents* registerThread();
+
+    static bool initialize();
+    static void saveAtExit();
+
+    static ThreadEvents ms_threadEvents[MAX_THREADS];
+    static int ms_nbThreads;                        ///< number of buffers assigned, may exceed MAX_THREADS
+    static __thread ThreadEvents* ms_thread;        ///< buffer of the calling thread, 0 until registered
+    static __thread bool ms_threadRegistered;
+    static std::string ms_filename;
+    static bool ms_enabled;
+};
+
+/// times the scope in which it is declared, see SIRE_TRACE_ZONE()
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* name)
+        : mName(name), mStart(Trace::isEnabled() ? Trace::now() : 0.)
+    {}
+    ~TraceZone()
+    {
+        if(Trace::isEnabled())
+            Trace::record(mName, mStart, Trace::now() - mStart);
+    }
+
+private:
+    const char* mName;
+    double mStart;
+};
+
+#define SIRE_TRACE_CONCAT2(a, b) a##b
+#define SIRE_TRACE_CONCAT(a, b) SIRE_TRACE_CONCAT2(a, b)
+#if SIRE_TRACE_ZONES
+#define SIRE_TRACE_ZONE(name) TraceZone SIRE_TRACE_CONCAT(sireTraceZone, __LINE__)(name)
+#else
+#define SIRE_TRACE_ZONE(name) ((void)0)
+#endif
+
+#endif // SIRE_TRACE_H